@@ -5,7 +5,43 @@
 #define USE_MODERN_OPENGL 0
 
 //========================================================================
-int main() {
+/*
+ PathTracing --merge out.exr a.accum b.accum ...
+   積算ファイルをまとめるだけでウィンドウは開かない
+ PathTracing --split <process> [--crop x0 y0 x1 y1]
+   process ごとに別の乱数列で描き, <scene>.split*.accum に積算結果を書き出す
+ PathTracing --framebuffer <path>
+   画素をメモリでなく path にマップして置く. メモリに収まらない解像度向け
+ PathTracing --resume
+   <scene>.checkpoint から続きを描く. チェックポイントは描いている間と止めたときに書かれる
+*/
+int main(int argc, char *argv[]) {
+	if (4 <= argc && strcmp(argv[1], "--merge") == 0) {
+		std::vector<std::string> inputs(argv + 3, argv + argc);
+		return mergeAccumulationFiles(argv[2], inputs) ? 0 : 1;
+	}
+
+	ofApp *app = new ofApp();
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+			app->_splitRender = true;
+			app->_split.process = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--crop") == 0 && i + 4 < argc) {
+			app->_splitRender = true;
+			app->_split.crop.x0 = atoi(argv[++i]);
+			app->_split.crop.y0 = atoi(argv[++i]);
+			app->_split.crop.x1 = atoi(argv[++i]);
+			app->_split.crop.y1 = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--framebuffer") == 0 && i + 1 < argc) {
+			app->_framebufferPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--resume") == 0) {
+			app->_resumeCheckpoint = true;
+		}
+	}
+
 	glfwInit();
 	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
 	float xscale, yscale;
@@ -25,6 +61,6 @@ int main() {
 		// this kicks off the running of my app
 		// can be OF_WINDOW or OF_FULLSCREEN
 		// pass in width and height too:
-	ofRunApp(new ofApp());
+	ofRunApp(app);
 
 }
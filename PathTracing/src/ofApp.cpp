@@ -1,46 +1,63 @@
 ﻿#include "ofApp.h"
 
-inline ofPixels toOf(const rt::Image &image) {
+inline ofPixels toOf(const rt::ImageSnapshot &image, const rt::DisplayTransform &transform) {
 	ofPixels pixels;
-	pixels.allocate(image.width(), image.height(), OF_IMAGE_COLOR);
-	uint8_t *dst = pixels.getPixels();
-
-	double scale = 1.0;
-	for (int y = 0; y < image.height(); ++y) {
-		for (int x = 0; x < image.width(); ++x) {
-			int index = y * image.width() + x;
-			const auto &px = *image.pixel(x, y);
-			auto L = px.color / (double)px.sample;
-			dst[index * 3 + 0] = (uint8_t)glm::clamp(glm::pow(L.x * scale, 1.0 / 2.2) * 256.0, 0.0, 255.99999);
-			dst[index * 3 + 1] = (uint8_t)glm::clamp(glm::pow(L.y * scale, 1.0 / 2.2) * 256.0, 0.0, 255.99999);
-			dst[index * 3 + 2] = (uint8_t)glm::clamp(glm::pow(L.z * scale, 1.0 / 2.2) * 256.0, 0.0, 255.99999);
-		}
-	}
+	pixels.allocate(image.width, image.height, OF_IMAGE_COLOR);
+	transform.apply(image.radiance.data(), image.width, image.height, pixels.getPixels());
 	return pixels;
 }
 
-inline ofFloatPixels toOfLinear(const rt::Image &image) {
-	ofFloatPixels pixels;
-	pixels.allocate(image.width(), image.height(), OF_IMAGE_COLOR);
-	float *dst = pixels.getPixels();
-
-	for (int y = 0; y < image.height(); ++y) {
-		for (int x = 0; x < image.width(); ++x) {
-			int index = y * image.width() + x;
-			const auto &px = *image.pixel(x, y);
-			auto L = px.color / (double)px.sample;
-			dst[index * 3 + 0] = L[0];
-			dst[index * 3 + 1] = L[1];
-			dst[index * 3 + 2] = L[2];
+bool mergeAccumulationFiles(const std::string &output, const std::vector<std::string> &inputs) {
+	std::vector<std::unique_ptr<rt::RenderAccumulation>> files;
+	std::vector<const rt::RenderAccumulation *> accumulations;
+	for (const std::string &input : inputs) {
+		files.emplace_back(new rt::RenderAccumulation());
+		if (files.back()->open(input) == false) {
+			printf("failed to open %s\n", input.c_str());
+			return false;
 		}
+		printf("%s : process %d, %d steps\n", input.c_str(), files.back()->process(), files.back()->steps());
+		accumulations.push_back(files.back().get());
 	}
-	return pixels;
+
+	int w, h;
+	std::vector<rt::AccumulationPixel> merged;
+	if (rt::merge_accumulations(accumulations, &w, &h, &merged) == false) {
+		printf("can't merge: different scenes or overlapping windows of the same process\n");
+		return false;
+	}
+
+	// .exr は beauty, samples, variance の層を持つタイル EXR, .pfm は beauty だけ
+	std::vector<rt::ImageLayer> layers = rt::accumulation_layers(&merged, w);
+	std::string extension = std::filesystem::path(output).extension().string();
+	bool ok = false;
+	if (extension == ".exr") {
+		ok = rt::write_exr(output, w, h, layers);
+	}
+	else if (extension == ".pfm") {
+		ok = rt::write_pfm(output, w, h, layers[0]);
+	}
+	else {
+		ofFloatPixels pixels;
+		pixels.allocate(w, h, OF_IMAGE_COLOR);
+		for (int y = 0; y < h; ++y) {
+			layers[0].read(0, y, w, pixels.getPixels() + (std::size_t)y * w * 3);
+		}
+		ok = ofSaveImage(pixels, output);
+	}
+	if (ok == false) {
+		printf("failed to write %s\n", output.c_str());
+	}
+	return ok;
 }
 
 //--------------------------------------------------------------
 void ofApp::setup() {
 	ofxRaccoonImGui::initialize();
 
+	_displayTransform = std::make_shared<rt::DisplayTransform>(_display);
+	_writer = std::unique_ptr<rt::WorkerQueue>(new rt::WorkerQueue(2));
+
 	_camera.setNearClip(0.1f);
 	_camera.setFarClip(100.0f);
 	_camera.setDistance(5.0f);
@@ -48,7 +65,14 @@ void ofApp::setup() {
 	loadScene();
 }
 
+inline bool isPowerOfTwo(uint32_t n) {
+	return (n & (n - 1)) == 0;
+}
+
 void ofApp::loadScene() {
+	// 古いレンダラーを止めてから
+	_renderThread.reset();
+
 	std::string abcPath = ofToDataPath("../../../scenes/CornelBox.abc", true);
 	houdini_alembic::AlembicStorage storage;
 	std::string error_message;
@@ -67,43 +91,142 @@ void ofApp::loadScene() {
 	std::filesystem::path absDirectory(abcPath);
 	absDirectory.remove_filename();
 	_scene = std::shared_ptr<rt::Scene>(new rt::Scene(_alembicscene, absDirectory));
-	_renderer = std::shared_ptr<rt::PTRenderer>(new rt::PTRenderer(_scene));
+	_renderer = std::shared_ptr<rt::PTRenderer>(new rt::PTRenderer(_scene, _split, _framebufferPath));
+
+	// 分けて描くときは担当ごとに別のファイル
+	std::string outputPath = abcPath;
+	if (_splitRender) {
+		char suffix[128];
+		sprintf(suffix, ".split%d_%d_%d_%d_%d", _split.process, _split.crop.x0, _split.crop.y0, _split.crop.x1, _split.crop.y1);
+		outputPath += suffix;
+		_accumulationPath = outputPath + ".accum";
+	}
+
+	// --resume なら同じシーンの途中経過から続ける. 'r' で読み直したときは最初から
+	_renderer->_checkpointPath = outputPath + ".checkpoint";
+	_renderer->_checkpointKey = rt::file_identity(abcPath);
+	if (_resumeCheckpoint) {
+		if (_renderer->loadCheckpoint(_renderer->_checkpointPath, _renderer->_checkpointKey)) {
+			printf("resumed from %s, %d steps\n", _renderer->_checkpointPath.string().c_str(), _renderer->stepCount());
+		}
+		else {
+			printf("no checkpoint to resume in %s\n", _renderer->_checkpointPath.string().c_str());
+		}
+		_resumeCheckpoint = false;
+	}
+
+	_renderer->_useVisibilityCache = _useVisibilityCache;
+	_renderer->_rayOrder = _rayOrder;
+	_renderer->_adaptive = _adaptive;
+
+	_renderThread = std::unique_ptr<rt::RenderThread>(new rt::RenderThread(_renderer));
+	_renderThread->_preview = _progressivePreview;
+
+	// レンダースレッドで呼ばれる. 画像のエンコードと保存は _writer のスレッドで
+	std::string accumulationPath = _accumulationPath;
+	_renderThread->_afterStep = [this, accumulationPath](rt::PTRenderer *renderer) {
+		uint32_t n = renderer->stepCount();
+		if (32 <= n && isPowerOfTwo(n)) {
+			// PNG は表示と同じ大きさ. kDisplayMaxPixels を超える画像では縮小したもの
+			auto snapshot = std::make_shared<rt::ImageSnapshot>();
+			rt::take_snapshot(renderer, snapshot.get());
+			std::shared_ptr<const rt::DisplayTransform> transform = std::atomic_load(&_displayTransform);
+			_writer->push([snapshot, transform, n]() {
+				char name[64];
+				sprintf(name, "%dspp.png", n);
+				ofSaveImage(toOf(*snapshot, *transform), name);
+			});
+			printf("elapsed %fs\n", ofGetElapsedTimef());
+
+			/*
+			 HDR と AOV は積算バッファをタイルの行ごとに読んで, LayerStream で _writer の write_exr() へ渡す.
+			 持つのは kExrStrips 帯までなので, step() が待つのは書き出しがそれだけ遅れたときだけ.
+			 out-of-core なら読み終えた行のタイルはファイルへ戻す
+			*/
+			if (_saveExr) {
+				const int kExrTileSize = 64;
+				const int kExrStrips = 4;
+				char name[64];
+				sprintf(name, "%dspp.exr", n);
+				std::string path = ofToDataPath(name, true);
+				int w = renderer->_image.width();
+				int h = renderer->_image.height();
+				auto stream = std::make_shared<rt::LayerStream>(rt::image_layers(&renderer->_image), w, h, kExrTileSize, kExrStrips);
+				_writer->push([stream, w, h, path]() {
+					if (rt::write_exr(path, w, h, stream->layers(), kExrTileSize) == false) {
+						printf("failed to write %s\n", path.c_str());
+					}
+					stream->close();
+				});
+				rt::Image *image = &renderer->_image;
+				stream->produce([image](int y0, int y1) {
+					if (image->outOfCore() == false) {
+						return;
+					}
+					for (int tile = 0; tile < image->tileCount(); ++tile) {
+						rt::PixelWindow window = image->tileWindow(tile);
+						if (y0 <= window.y0 && window.y0 < y1) {
+							image->evictTile(tile);
+						}
+					}
+				});
+			}
+
+			if (accumulationPath.empty() == false && renderer->writeAccumulation(accumulationPath, renderer->_checkpointKey) == false) {
+				printf("failed to write %s\n", accumulationPath.c_str());
+			}
+		}
+	};
+	_renderThread->start();
 }
 void ofApp::exit() {
+	_renderThread.reset();
+	if (_renderer && _accumulationPath.empty() == false) {
+		_renderer->writeAccumulation(_accumulationPath, _renderer->_checkpointKey);
+	}
+	// 書きかけの画像を待つ
+	_writer.reset();
 	ofxRaccoonImGui::shutdown();
 }
 
+// UI で変えた設定を, 次の step() の前にレンダースレッドで反映する
+void ofApp::applySettings() {
+	bool useVisibilityCache = _useVisibilityCache;
+	rt::RayOrder rayOrder = _rayOrder;
+	rt::AdaptiveSamplingConfig adaptive = _adaptive;
+	_renderThread->post([=](rt::PTRenderer *renderer) {
+		renderer->_useVisibilityCache = useVisibilityCache;
+		renderer->_rayOrder = rayOrder;
+		renderer->_adaptive = adaptive;
+	});
+}
+
 //--------------------------------------------------------------
 void ofApp::update() {
 
 }
 
-inline bool isPowerOfTwo(uint32_t n) {
-	return (n & (n - 1)) == 0;
-}
-
 //--------------------------------------------------------------
 void ofApp::draw() {
 	static bool show_scene_preview = false;
 	static int frame = 0;
 
-	if (_renderer) {
-		_renderer->step();
+	// 表示の設定が変わったら LUT を作り直して, 同じ snapshot を描き直す
+	bool displayChanged = false;
+	if (_displayTransform->config().exposure != _display.exposure || _displayTransform->config().reinhard != _display.reinhard || _displayTransform->config().curve != _display.curve) {
+		std::atomic_store(&_displayTransform, std::shared_ptr<const rt::DisplayTransform>(std::make_shared<rt::DisplayTransform>(_display)));
+		displayChanged = true;
+	}
 
+	if (_renderThread) {
 		ofDisableArbTex();
 
-		if (ofGetFrameNum() % 5 == 0) {
-			_image.setFromPixels(toOf(_renderer->_image));
+		// レンダラーは別スレッド. 新しい snapshot が来ていれば表示を更新する
+		bool updated = _renderThread->acquire();
+		if ((updated || displayChanged) && 0 < _renderThread->snapshot().width) {
+			_image.setFromPixels(toOf(_renderThread->snapshot(), *_displayTransform));
 			_image.getTexture().setTextureMinMagFilter(GL_NEAREST, GL_NEAREST);
 		}
-		uint32_t n = _renderer->stepCount();
-		if (32 <= n && isPowerOfTwo(n)) {
-			_image.setFromPixels(toOf(_renderer->_image));
-			char name[64];
-			sprintf(name, "%dspp.png", n);
-			_image.save(name);
-			printf("elapsed %fs\n", ofGetElapsedTimef());
-		}
 
 		//if (_renderer->stepCount() == 512) {
 		//	_image.setFromPixels(toOf(_renderer->_image));
@@ -178,20 +301,54 @@ void ofApp::draw() {
 
 	ImGui::Begin("settings", nullptr);
 	ImGui::Checkbox("scene preview", &show_scene_preview);
+	bool changed = false;
+	changed |= ImGui::Checkbox("envmap visibility cache", &_useVisibilityCache);
+
+	const char *rayOrders[] = { "per pixel", "stream", "octant + morton" };
+	int rayOrder = (int)_rayOrder;
+	if (ImGui::Combo("secondary ray order", &rayOrder, rayOrders, IM_ARRAYSIZE(rayOrders))) {
+		_rayOrder = (rt::RayOrder)rayOrder;
+		changed = true;
+	}
+
+	changed |= ImGui::Checkbox("adaptive sampling", &_adaptive.enabled);
+	changed |= ImGui::InputInt("pilot steps", &_adaptive.pilotSteps);
+	changed |= ImGui::SliderFloat("target error", &_adaptive.targetError, 0.001f, 0.2f, "%.3f", 2.0f);
+	if (changed) {
+		applySettings();
+	}
+	ImGui::Checkbox("progressive preview", &_progressivePreview);
+
+	ImGui::SliderFloat("exposure", &_display.exposure, -8.0f, 8.0f, "%.2f EV");
+	ImGui::Checkbox("reinhard", &_display.reinhard);
+	const char *curves[] = { "gamma 2.2", "sRGB" };
+	int curve = (int)_display.curve;
+	if (ImGui::Combo("display curve", &curve, curves, IM_ARRAYSIZE(curves))) {
+		_display.curve = (rt::DisplayCurve)curve;
+	}
+	bool saveExr = _saveExr.load();
+	if (ImGui::Checkbox("save exr", &saveExr)) {
+		_saveExr = saveExr;
+	}
+
+	const rt::ImageSnapshot &snapshot = _renderThread->snapshot();
+	if (snapshot.previewScale != 0) {
+		ImGui::Text("preview 1/%d", snapshot.previewScale);
+	}
+	if (snapshot.displayScale != 1) {
+		ImGui::Text("display 1/%d", snapshot.displayScale);
+	}
+	ImGui::Text("%d active pixels%s", snapshot.adaptiveActivePixels, snapshot.converged ? " (converged)" : "");
 	
 	ImGui::Text("frame : %d", frame);
 	ImGui::Separator();
-	ImGui::Text("%d sample, fps = %.3f", _renderer->stepCount(), ofGetFrameRate());
-	ImGui::Text("%d bad sample nan", _renderer->badSampleNanCount());
-	ImGui::Text("%d bad sample inf", _renderer->badSampleInfCount());
-	ImGui::Text("%d bad sample neg", _renderer->badSampleNegativeCount());
-	ImGui::Text("%d bad sample firefly", _renderer->badSampleFireflyCount());
+	ImGui::Text("%d sample, fps = %.3f", snapshot.steps, ofGetFrameRate());
+	ImGui::Text("%d bad sample nan", snapshot.badSampleNan);
+	ImGui::Text("%d bad sample inf", snapshot.badSampleInf);
+	ImGui::Text("%d bad sample neg", snapshot.badSampleNegative);
+	ImGui::Text("%d bad sample firefly", snapshot.badSampleFirefly);
 	ImGui::Text("%f pdf_mismatch_ratio", rt::radiance_stat::instance().pdf_mismatch_ratio());
-	
-	if (ofGetFrameNum() % 10 == 0) {
-		_renderer->measureRaysPerSecond();
-	}
-	ImGui::Text("%.3f MRays/s", (double)_renderer->getRaysPerSecond() * 0.001 * 0.001);
+	ImGui::Text("%.3f MRays/s", (double)snapshot.raysPerSecond * 0.001 * 0.001);
 
 	if (_image.isAllocated()) {
 
@@ -7,6 +7,9 @@
 #include "ofxRaccoonImGui.hpp"
 #include "houdini_alembic.hpp"
 #include "path_tracing.hpp"
+#include "render_thread.hpp"
+#include "display_transform.hpp"
+#include "worker_queue.hpp"
 #include "alembic_preview.hpp"
 
 class ofApp : public ofBaseApp{
@@ -30,6 +33,7 @@ public:
 	void gotMessage(ofMessage msg);
 
 	void loadScene();
+	void applySettings();
 
 	ofEasyCam _camera;
 	ofImage _image;
@@ -38,4 +42,35 @@ public:
 	std::shared_ptr<houdini_alembic::AlembicScene> _alembicscene;
 	std::shared_ptr<rt::Scene> _scene;
 	std::shared_ptr<rt::PTRenderer> _renderer;
+	std::unique_ptr<rt::RenderThread> _renderThread;
+
+	// UI で編集する設定. applySettings() でレンダラーに渡す
+	bool _useVisibilityCache = false;
+	rt::RayOrder _rayOrder = rt::RayOrder::PerPixel;
+	rt::AdaptiveSamplingConfig _adaptive;
+
+	// loadScene() の後, フル解像度の前に粗い下見を見せる. 次の loadScene() から
+	bool _progressivePreview = true;
+
+	// 表示と保存する PNG の変換. レンダースレッドからも読むので atomic_load / atomic_store で差し替える
+	rt::DisplayTransformConfig _display;
+	std::shared_ptr<const rt::DisplayTransform> _displayTransform;
+	std::atomic<bool> _saveExr = false;
+
+	// 画像のエンコードと保存
+	std::unique_ptr<rt::WorkerQueue> _writer;
+
+	// --split で起動したときの担当. そのときは _accumulationPath に積算結果を書き出す
+	bool _splitRender = false;
+	rt::RenderSplit _split;
+	std::string _accumulationPath;
+
+	// --framebuffer. 空でなければ画素をこのファイルに置く
+	std::string _framebufferPath;
+
+	// --resume. 最初の loadScene() だけ, 前回止めたときのチェックポイントから続ける
+	bool _resumeCheckpoint = false;
 };
+
+// --merge. 各プロセスの積算ファイルをまとめて output (.exr など) に保存する
+bool mergeAccumulationFiles(const std::string &output, const std::vector<std::string> &inputs);
@@ -11,9 +11,25 @@
 #include "triangle_sampler.hpp"
 #include "plane_equation.hpp"
 #include "triangle_util.hpp"
+#include "spherical_triangle_sampler.hpp"
+#include "stopwatch.hpp"
 #include "assertion.hpp"
 #include "value_prportional_sampler.hpp"
 #include "alias_method.hpp"
+#include "envmap.hpp"
+#include "texture_cache.hpp"
+#include "fast_math.hpp"
+#include "shading_queue.hpp"
+#include "ray_sort.hpp"
+#include "adaptive_sampling.hpp"
+#include "render_checkpoint.hpp"
+#include "render_split.hpp"
+#include "tiled_framebuffer.hpp"
+#include "progressive_preview.hpp"
+#include "triple_buffer.hpp"
+#include "display_transform.hpp"
+#include "worker_queue.hpp"
+#include "float_image_writer.hpp"
 #include "n_order_equation.hpp"
 #include "plot.hpp"
 
@@ -73,6 +89,25 @@ TEST_CASE("random", "[random]") {
 	SECTION("MT") {
 		run(&rt::MT(6));
 	}
+	SECTION("Xoshiro128StarStar split") {
+		rt::Xoshiro128StarStar parent(5);
+		rt::Xoshiro128StarStar child = parent.split();
+		run(&child);
+
+		// 子をどれだけ使っても親の続きは同じ
+		rt::Xoshiro128StarStar a(9);
+		rt::Xoshiro128StarStar b(9);
+		rt::Xoshiro128StarStar ca = a.split();
+		rt::Xoshiro128StarStar cb = b.split();
+		REQUIRE(ca.state() == cb.state());
+		for (int i = 0; i < 100; ++i) {
+			ca.uniform();
+		}
+		REQUIRE(a.state() == b.state());
+
+		// 続けて split() した列は別の列
+		REQUIRE(a.split().state() != cb.state());
+	}
 }
 
 TEST_CASE("online", "[online]") {
@@ -262,6 +297,29 @@ TEST_CASE("triangle_util", "[triangle_util]") {
 			REQUIRE(glm::abs(n.z) == Approx(1.0).margin(1.0e-9));
 		}
 	}
+	SECTION("triangle_geometric_normal_cw") {
+		DefaultRandom random;
+
+		// 1e-3 の大きさの三角形でも単位長さで, 大きい三角形と同じ向き
+		for (int i = 0; i < 1000; ++i) {
+			glm::vec3 p0 = { random.uniform(), random.uniform(), random.uniform() };
+			glm::vec3 d1 = { random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f) };
+			glm::vec3 d2 = { random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f) };
+			if (glm::length(glm::cross(d1, d2)) < 0.1f) {
+				continue;
+			}
+
+			glm::vec3 n = rt::triangle_geometric_normal_cw(p0, p0 + d1 * 1.0e-3f, p0 + d2 * 1.0e-3f);
+			glm::vec3 reference = rt::triangle_normal_cw(glm::vec3(0.0f), d1, d2);
+			REQUIRE(glm::length(n) == Approx(1.0f).margin(1.0e-5f));
+			REQUIRE(glm::dot(n, reference) == Approx(1.0f).margin(1.0e-3f));
+		}
+
+		// 面積 0 だけが 0
+		glm::vec3 p = { 0.5f, 0.25f, 1.0f };
+		glm::vec3 n = rt::triangle_geometric_normal_cw(p, p + glm::vec3(1.0f, 0.0f, 0.0f), p + glm::vec3(2.0f, 0.0f, 0.0f));
+		REQUIRE(n == glm::vec3(0.0f));
+	}
 }
 
 TEST_CASE("triangle sampler", "[triangle sampler]") {
@@ -316,6 +374,126 @@ TEST_CASE("triangle sampler", "[triangle sampler]") {
 	}
 }
 
+// the angle sum (Girard) version with 3 acos and 3 normalized cross products, to compare against
+template <class Real>
+struct GirardSphericalTriangle {
+	using Vec3 = glm::tvec3<Real>;
+	GirardSphericalTriangle(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &o) {
+		A = glm::normalize(a - o);
+		B = glm::normalize(b - o);
+		C = glm::normalize(c - o);
+		Vec3 nAB = glm::normalize(glm::cross(A, B));
+		Vec3 nBC = glm::normalize(glm::cross(B, C));
+		Vec3 nCA = glm::normalize(glm::cross(C, A));
+		alpha = std::acos(glm::dot(-nAB, nCA));
+		Real beta = std::acos(glm::dot(-nBC, nAB));
+		Real gamma = std::acos(glm::dot(-nCA, nBC));
+		sr = alpha + beta + gamma - glm::pi<Real>();
+	}
+	Vec3 sample_direction(Real xi_u, Real xi_v) const {
+		Real phi = sr * xi_u - alpha;
+		Real u = std::cos(phi) - std::cos(alpha);
+		Real v = std::sin(phi) + std::sin(alpha) * glm::dot(A, B);
+		Real cos_b_hat = ((v * std::cos(phi) - u * std::sin(phi)) * std::cos(alpha) - v) / ((v * std::sin(phi) + u * std::cos(phi)) * std::sin(alpha));
+		Vec3 C_hat = A * cos_b_hat + std::sqrt(std::max(Real(1.0) - cos_b_hat * cos_b_hat, Real(0.0))) * glm::normalize(C - glm::dot(C, A) * A);
+		Real cosTheta = Real(1.0) - xi_v * (Real(1.0) - glm::dot(C_hat, B));
+		return cosTheta * B + std::sqrt(std::max(Real(1.0) - cosTheta * cosTheta, Real(0.0))) * glm::normalize(C_hat - glm::dot(C_hat, B) * B);
+	}
+	Vec3 A, B, C;
+	Real alpha;
+	Real sr;
+};
+
+TEST_CASE("spherical triangle sampler", "[spherical triangle sampler]") {
+	DefaultRandom random;
+	for (int j = 0; j < 1000; ++j) {
+		glm::dvec3 p0 = { random.uniform(), random.uniform(), random.uniform() };
+		glm::dvec3 p1 = { random.uniform(), random.uniform(), random.uniform() };
+		glm::dvec3 p2 = { random.uniform(), random.uniform(), random.uniform() };
+		glm::dvec3 o = glm::dvec3(random.uniform(), random.uniform(), random.uniform()) * 4.0 - glm::dvec3(1.5);
+
+		rt::SphericalTriangleSampler<double> sampler(p0, p1, p2, o);
+		GirardSphericalTriangle<double> reference(p0, p1, p2, o);
+		REQUIRE(sampler.solidAngle() == Approx(reference.sr).margin(1.0e-9));
+
+		for (int i = 0; i < 100; ++i) {
+			double u = random.uniform();
+			double v = random.uniform();
+			glm::dvec3 a = sampler.sample_direction(u, v);
+			glm::dvec3 b = reference.sample_direction(u, v);
+			REQUIRE(glm::length(a - b) < 1.0e-6);
+		}
+
+		// float. the directions of thin triangles are not precise enough for the hit test
+		glm::vec3 p0f(p0), p1f(p1), p2f(p2), of(o);
+		rt::SphericalTriangleSampler<float> samplerf(p0f, p1f, p2f, of);
+		REQUIRE(samplerf.solidAngle() == Approx(reference.sr).margin(1.0e-5));
+		if (samplerf.solidAngle() < 0.05f) {
+			continue;
+		}
+		for (int i = 0; i < 100; ++i) {
+			float u = glm::mix(0.01f, 0.99f, random.uniform());
+			float v = glm::mix(0.01f, 0.99f, random.uniform());
+			glm::vec3 wi = samplerf.sample_direction(u, v);
+			REQUIRE(glm::length2(wi) == Approx(1.0f).margin(1.0e-5f));
+
+			float tmin;
+			REQUIRE(rt::intersect_ray_triangle(of, wi, p0f, p1f, p2f, &tmin));
+		}
+	}
+}
+
+// per query cost of the luminaire sampling. run with [benchmark]
+TEST_CASE("spherical triangle sampler benchmark", "[.][benchmark]") {
+	DefaultRandom random;
+	const int kTriangles = 1024;
+	const int kQueries = 1000000;
+
+	std::vector<glm::vec3> points(kTriangles * 3);
+	for (int i = 0; i < points.size(); ++i) {
+		points[i] = glm::vec3(random.uniform(), random.uniform(), random.uniform());
+	}
+	glm::vec3 o(0.5f, -1.0f, 0.5f);
+
+	// setup + sample + pdf every query, as LuminaireSampler did
+	glm::vec3 sum_reference;
+	rt::Stopwatch sw_reference;
+	for (int i = 0; i < kQueries; ++i) {
+		int t = (i % kTriangles) * 3;
+		GirardSphericalTriangle<float> s(points[t], points[t + 1], points[t + 2], o);
+		sum_reference += s.sample_direction(random.uniform(), random.uniform()) * (1.0f / s.sr);
+	}
+	double reference_seconds = sw_reference.elapsed();
+
+	glm::vec3 sum_setup;
+	rt::Stopwatch sw_setup;
+	for (int i = 0; i < kQueries; ++i) {
+		int t = (i % kTriangles) * 3;
+		rt::SphericalTriangleSampler<float> s(points[t], points[t + 1], points[t + 2], o);
+		sum_setup += s.sample_direction(random.uniform(), random.uniform()) * s.pdf();
+	}
+	double setup_seconds = sw_setup.elapsed();
+
+	// the setup is shared by sample and pdf
+	std::vector<rt::SphericalTriangleSampler<float>> cached(kTriangles);
+	for (int i = 0; i < kTriangles; ++i) {
+		cached[i] = rt::SphericalTriangleSampler<float>(points[i * 3], points[i * 3 + 1], points[i * 3 + 2], o);
+	}
+	glm::vec3 sum_cached;
+	rt::Stopwatch sw_cached;
+	for (int i = 0; i < kQueries; ++i) {
+		const auto &s = cached[i % kTriangles];
+		sum_cached += s.sample_direction(random.uniform(), random.uniform()) * s.pdf();
+	}
+	double cached_seconds = sw_cached.elapsed();
+
+	printf("spherical triangle, ns / query\n");
+	printf("  girard (3 acos)   : %.1f\n", reference_seconds * 1.0e9 / kQueries);
+	printf("  setup every query : %.1f\n", setup_seconds * 1.0e9 / kQueries);
+	printf("  cached setup      : %.1f\n", cached_seconds * 1.0e9 / kQueries);
+	printf("  (%f %f %f)\n", sum_reference.x + sum_setup.x + sum_cached.x, sum_reference.y + sum_setup.y + sum_cached.y, sum_reference.z + sum_setup.z + sum_cached.z);
+}
+
 TEST_CASE("ValueProportionalSampler", "[ValueProportionalSampler]") {
 	DefaultRandom random;
 
@@ -338,6 +516,33 @@ TEST_CASE("ValueProportionalSampler", "[ValueProportionalSampler]") {
 	}
 }
 
+TEST_CASE("ValueProportionalSampler search", "[ValueProportionalSampler]") {
+	DefaultRandom random;
+
+	// both the linear and the eytzinger search must agree with std::upper_bound
+	rt::ValueProportionalSampler<float> sampler;
+	for (int n : { 1, 3, 4, 5, 63, 64, 65, 100, 1000, 4097 }) {
+		sampler.clear();
+		std::vector<float> cumulative;
+		float sum = 0.0f;
+		for (int i = 0; i < n; ++i) {
+			float value = random.uniform() < 0.25f ? 0.0f : (float)(random.uniform_integer() % 100);
+			sampler.add(value);
+			sum += value;
+			cumulative.push_back(sum);
+		}
+		for (int i = 0; i < 10000; ++i) {
+			float x = random.uniform(-1.0f, sum + 1.0f);
+			if (i % 3 == 0) {
+				x = (float)(random.uniform_integer() % ((int)sum + 2));
+			}
+			int expected = (int)std::distance(cumulative.begin(), std::upper_bound(cumulative.begin(), cumulative.end(), x));
+			expected = std::min(expected, n - 1);
+			REQUIRE(sampler.search(x) == expected);
+		}
+	}
+}
+
 TEST_CASE("AliasMethod", "[AliasMethod]") {
 	DefaultRandom random;
 
@@ -382,3 +587,1421 @@ TEST_CASE("AliasMethod", "[AliasMethod]") {
 	}
 }
 
+TEST_CASE("CompactAliasMethod", "[CompactAliasMethod]") {
+	DefaultRandom random;
+
+	// the probability of each index can be recovered exactly from the buckets.
+	// 100000 entries go through the parallel path.
+	for (int N : { 1, 5, 1000, 100000 }) {
+		std::vector<double> ws(N);
+		for (int i = 0; i < N; ++i) {
+			double w = random.uniform();
+			ws[i] = random.uniform() < 0.1f ? 0.0 : w * w * w;
+		}
+		ws[0] += 1.0;
+		double w_sum = std::accumulate(ws.begin(), ws.end(), 0.0);
+
+		rt::CompactAliasMethod alias;
+		alias.prepare(ws);
+		REQUIRE(alias.size() == N);
+
+		std::vector<double> probs(N);
+		for (int i = 0; i < N; ++i) {
+			auto bucket = alias.buckets[i];
+			probs[i] += (double)bucket.threshold / N;
+			probs[bucket.alias] += (1.0 - (double)bucket.threshold) / N;
+		}
+		for (int i = 0; i < N; ++i) {
+			REQUIRE(probs[i] == Approx(ws[i] / w_sum).margin(1.0e-6 / N));
+		}
+	}
+
+	// batched sampling
+	std::vector<double> ws = { 1.0, 2.0, 0.0, 3.0, 4.0 };
+	rt::CompactAliasMethod alias;
+	alias.prepare(ws);
+
+	int N = 1000000;
+	std::vector<int> indices(N);
+	alias.sample(&random, indices.data(), N);
+
+	std::vector<int> hist(ws.size());
+	for (int index : indices) {
+		hist[index]++;
+	}
+	for (int i = 0; i < ws.size(); ++i) {
+		REQUIRE((double)hist[i] / N == Approx(ws[i] / 10.0).margin(3.0e-3));
+	}
+}
+
+TEST_CASE("equal_area_octahedral", "[equal_area_octahedral]") {
+	DefaultRandom random;
+
+	SECTION("roundtrip") {
+		for (int i = 0; i < 100000; ++i) {
+			glm::dvec3 d = rt::sample_on_unit_sphere<double>(random.uniform(), random.uniform());
+			glm::dvec2 uv = rt::sphere_to_equal_area_octahedral(d);
+			REQUIRE(std::abs(uv.x) <= 1.0);
+			REQUIRE(std::abs(uv.y) <= 1.0);
+
+			glm::dvec3 maybe_d = rt::equal_area_octahedral_to_sphere(uv.x, uv.y);
+			REQUIRE(glm::length2(maybe_d) == Approx(1.0).margin(1.0e-9));
+			for (int j = 0; j < 3; ++j) {
+				REQUIRE(maybe_d[j] == Approx(d[j]).margin(1.0e-7));
+			}
+		}
+	}
+
+	SECTION("equal area") {
+		// uniform directions must fall into every cell of the square equally
+		int k = 4;
+		std::vector<int> hist(k * k);
+		int N = 1000000;
+		for (int i = 0; i < N; ++i) {
+			glm::dvec3 d = rt::sample_on_unit_sphere<double>(random.uniform(), random.uniform());
+			glm::dvec2 uv = rt::sphere_to_equal_area_octahedral(d);
+			int x = glm::clamp((int)((uv.x * 0.5 + 0.5) * k), 0, k - 1);
+			int y = glm::clamp((int)((uv.y * 0.5 + 0.5) * k), 0, k - 1);
+			hist[y * k + x]++;
+		}
+		for (int i = 0; i < hist.size(); ++i) {
+			double prob = (double)hist[i] / N;
+			REQUIRE(prob == Approx(1.0 / (k * k)).margin(2.0e-3));
+		}
+	}
+}
+
+TEST_CASE("EnvmapImportance", "[EnvmapImportance]") {
+	DefaultRandom random;
+
+	rt::Image2D image;
+	image.resize(64, 32);
+	for (int y = 0; y < image.height(); ++y) {
+		for (int x = 0; x < image.width(); ++x) {
+			image(x, y) = glm::vec4(random.uniform(), random.uniform(), random.uniform(), 1.0f);
+		}
+	}
+
+	// the total power must not depend on the importance resolution
+	auto full = rt::latlong_importance(image, 0);
+	REQUIRE(full.width == 64);
+	REQUIRE(full.height == 32);
+	double full_power = std::accumulate(full.power.begin(), full.power.end(), 0.0);
+
+	for (int resolution : { 1, 7, 16, 33, 64 }) {
+		auto coarse = rt::latlong_importance(image, resolution);
+		REQUIRE(coarse.width == resolution);
+		REQUIRE(coarse.power.size() == coarse.width * coarse.height);
+		double coarse_power = std::accumulate(coarse.power.begin(), coarse.power.end(), 0.0);
+		REQUIRE(coarse_power == Approx(full_power).epsilon(1.0e-9));
+	}
+}
+
+
+TEST_CASE("TexelFormat", "[TexelFormat]") {
+	DefaultRandom random;
+
+	// error relative to the largest component of the texel
+	struct Case {
+		rt::TexelFormat format;
+		float error;
+	};
+	for (Case c : { Case{ rt::TexelFormat::RGB16F, 1.0f / 2048.0f }, Case{ rt::TexelFormat::RGBE, 1.0f / 128.0f }, Case{ rt::TexelFormat::RGB9E5, 1.0f / 512.0f } }) {
+		rt::Image2D image;
+		image.resize(256, 64, c.format);
+		REQUIRE(image.bytes() == 256 * 64 * rt::texel_bytes(c.format));
+
+		std::vector<glm::vec3> values(image.width() * image.height());
+		for (int i = 0; i < values.size(); ++i) {
+			float scale = std::pow(10.0f, glm::mix(-3.0f, 4.0f, random.uniform()));
+			values[i] = glm::vec3(random.uniform(), random.uniform(), random.uniform()) * scale;
+			image.set_texel(i, glm::vec4(values[i], 1.0f));
+		}
+		for (int i = 0; i < values.size(); ++i) {
+			glm::vec3 v = values[i];
+			glm::vec4 t = image.texel(i);
+			float m = std::max(std::max(v.x, v.y), v.z);
+			REQUIRE(std::abs(t.x - v.x) <= m * c.error);
+			REQUIRE(std::abs(t.y - v.y) <= m * c.error);
+			REQUIRE(std::abs(t.z - v.z) <= m * c.error);
+			REQUIRE(t.w == 1.0f);
+		}
+	}
+
+	REQUIRE(rt::half_to_float(rt::float_to_half(65504.0f)) == 65504.0f);
+	REQUIRE(rt::decode_rgb9e5(rt::encode_rgb9e5(glm::vec3(1.0e9f, 0.0f, 0.0f))).x == 65408.0f);
+	REQUIRE(rt::decode_rgbe(rt::encode_rgbe(glm::vec3(0.0f))).x == 0.0f);
+}
+
+TEST_CASE("TextureCache", "[TextureCache]") {
+	DefaultRandom random;
+
+	auto image = std::shared_ptr<rt::Image2D>(new rt::Image2D());
+	image->resize(300, 200);
+	for (int y = 0; y < image->height(); ++y) {
+		for (int x = 0; x < image->width(); ++x) {
+			(*image)(x, y) = glm::vec4(random.uniform(), random.uniform(), random.uniform(), 1.0f);
+		}
+	}
+	auto source = std::shared_ptr<rt::ImageTileSource>(new rt::ImageTileSource(image));
+	REQUIRE(source->levels() == 9);
+
+	// only 4 tiles can be resident
+	std::size_t budget = 4 * rt::tile_bytes(rt::TexelFormat::RGBA32F);
+	rt::TextureCache cache(budget);
+	int texture = cache.add(source);
+
+	SECTION("texel") {
+		for (int i = 0; i < 100000; ++i) {
+			int x = random.uniform_integer() % image->width();
+			int y = random.uniform_integer() % image->height();
+			glm::vec4 a = cache.texel(texture, 0, x, y);
+			glm::vec4 b = (*image)(x, y);
+			REQUIRE(a.x == b.x);
+			REQUIRE(a.y == b.y);
+			REQUIRE(a.z == b.z);
+		}
+		REQUIRE(cache.stats().residentBytes <= budget);
+		REQUIRE(0 < cache.stats().evictions);
+	}
+	SECTION("mip") {
+		glm::vec4 a = cache.texel(texture, 1, 3, 4);
+		glm::vec4 b = ((*image)(6, 8) + (*image)(7, 8) + (*image)(6, 9) + (*image)(7, 9)) * 0.25f;
+		REQUIRE(a.x == Approx(b.x));
+	}
+	SECTION("bilinear") {
+		// at the texel center
+		for (int i = 0; i < 1000; ++i) {
+			int x = random.uniform_integer() % image->width();
+			int y = random.uniform_integer() % image->height();
+			float u = (x + 0.5f) / image->width();
+			float v = 1.0f - (y + 0.5f) / image->height();
+			REQUIRE(cache.bilinear(texture, u, v).x == Approx((*image)(x, y).x).margin(1.0e-4));
+			REQUIRE(cache.trilinear(texture, u, v, 0.0f).x == Approx((*image)(x, y).x).margin(1.0e-4));
+		}
+	}
+
+	auto rgbe = std::shared_ptr<rt::Image2D>(new rt::Image2D());
+	rgbe->resize(300, 200, rt::TexelFormat::RGBE);
+	for (int y = 0; y < rgbe->height(); ++y) {
+		for (int x = 0; x < rgbe->width(); ++x) {
+			rgbe->set_texel(x, y, glm::vec4(random.uniform(), random.uniform(), random.uniform(), 1.0f) * 8.0f);
+		}
+	}
+	SECTION("texel format") {
+		// tiles are kept as RGBE, the same budget holds 4x tiles
+		rt::TextureCache rgbe_cache(budget);
+		int rgbe_texture = rgbe_cache.add(std::shared_ptr<rt::ImageTileSource>(new rt::ImageTileSource(rgbe)));
+		for (int i = 0; i < 100000; ++i) {
+			int x = random.uniform_integer() % rgbe->width();
+			int y = random.uniform_integer() % rgbe->height();
+			glm::vec4 a = rgbe_cache.texel(rgbe_texture, 0, x, y);
+			glm::vec4 b = rgbe->texel(x, y);
+			REQUIRE(a == b);
+		}
+		REQUIRE(rgbe_cache.stats().residentBytes == 16 * rt::tile_bytes(rt::TexelFormat::RGBE));
+	}
+	SECTION("tiled file") {
+		rt::ImageTileSource source(rgbe);
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "rt_unit_test.tiles";
+		REQUIRE(rt::TiledFileSource::write(path, source, "key"));
+
+		// the sidecar is in the texel format of the source
+		std::size_t tiles = 0;
+		for (int level = 0; level < source.levels(); ++level) {
+			tiles += rt::tile_count(rt::mip_level_size(rgbe->width(), level)) * rt::tile_count(rt::mip_level_size(rgbe->height(), level));
+		}
+		REQUIRE(std::filesystem::file_size(path) < tiles * rt::tile_bytes(rt::TexelFormat::RGBE) + 64);
+
+		auto file = std::shared_ptr<rt::TiledFileSource>(new rt::TiledFileSource());
+		REQUIRE(file->open(path, "other key") == false);
+		REQUIRE(file->open(path, "key"));
+		REQUIRE(file->format() == rt::TexelFormat::RGBE);
+
+		std::vector<uint8_t> a(rt::tile_bytes(rt::TexelFormat::RGBE));
+		std::vector<uint8_t> b(rt::tile_bytes(rt::TexelFormat::RGBE));
+		for (int level = 0; level < source.levels(); ++level) {
+			for (int ty = 0; ty < rt::tile_count(rt::mip_level_size(rgbe->height(), level)); ++ty) {
+				for (int tx = 0; tx < rt::tile_count(rt::mip_level_size(rgbe->width(), level)); ++tx) {
+					source.read_tile(level, tx, ty, a.data());
+					file->read_tile(level, tx, ty, b.data());
+					REQUIRE(a == b);
+				}
+			}
+		}
+		file.reset();
+		std::filesystem::remove(path);
+	}
+	SECTION("envmap") {
+		// the envmap through the cache is the same as the resident one
+		auto textures = std::shared_ptr<rt::TextureCache>(new rt::TextureCache(budget));
+		int envmap_texture = textures->add(std::shared_ptr<rt::ImageTileSource>(new rt::ImageTileSource(rgbe)));
+		rt::SixAxisImageEnvmap resident(rgbe, rt::EnvmapLayout::LatLong, 64);
+		rt::SixAxisImageEnvmap cached(textures, envmap_texture, 64);
+		for (int i = 0; i < 10000; ++i) {
+			glm::vec3 rd = rt::sample_on_unit_sphere(random.uniform(), random.uniform());
+			glm::vec3 n = rt::sample_on_unit_sphere(random.uniform(), random.uniform());
+			REQUIRE(cached.radiance(rd) == resident.radiance(rd));
+			REQUIRE(cached.pdf(rd, n) == resident.pdf(rd, n));
+		}
+		REQUIRE(textures->stats().residentBytes <= budget);
+	}
+}
+
+TEST_CASE("fast_math", "[fast_math]") {
+	DefaultRandom random;
+
+	SECTION("scalar") {
+		for (int i = 0; i < 1000000; ++i) {
+			float x = glm::mix(-8192.0f, 8192.0f, random.uniform());
+			float s, c;
+			rt::fast_sincos(x, &s, &c);
+			REQUIRE(std::abs(s - std::sin((double)x)) <= 1.5e-7);
+			REQUIRE(std::abs(c - std::cos((double)x)) <= 1.5e-7);
+
+			float ay = glm::mix(-1.0f, 1.0f, random.uniform());
+			float ax = glm::mix(-1.0f, 1.0f, random.uniform());
+			REQUIRE(std::abs(rt::fast_atan2(ay, ax) - std::atan2((double)ay, (double)ax)) <= 3.5e-7);
+			REQUIRE(std::abs(rt::fast_acos(ax) - std::acos((double)ax)) <= 3.5e-7);
+
+			float e = glm::mix(-87.3f, 88.7f, random.uniform());
+			double exp_ref = std::exp((double)e);
+			REQUIRE(std::abs(rt::fast_exp(e) - exp_ref) <= exp_ref * 1.5e-7);
+
+			float l = glm::mix(0.5f, 2.0f, random.uniform());
+			REQUIRE(std::abs(rt::fast_log(l) - std::log((double)l)) <= 1.0e-7);
+			float L = std::ldexp(glm::mix(1.0f, 2.0f, random.uniform()), (int)(random.uniform_integer() % 250) - 125);
+			double log_ref = std::log((double)L);
+			if (1.0 < std::abs(log_ref)) {
+				REQUIRE(std::abs(rt::fast_log(L) - log_ref) <= std::abs(log_ref) * 1.5e-7);
+			}
+		}
+	}
+	SECTION("special values") {
+		REQUIRE(rt::fast_atan2(0.0f, -1.0f) == Approx(glm::pi<float>()));
+		REQUIRE(rt::fast_atan2(-0.0f, -1.0f) == Approx(-glm::pi<float>()));
+		REQUIRE(rt::fast_atan2(0.0f, 0.0f) == 0.0f);
+		REQUIRE(rt::fast_acos(1.0f) == 0.0f);
+		REQUIRE(rt::fast_acos(1.0001f) == 0.0f);
+		REQUIRE(rt::fast_exp(0.0f) == 1.0f);
+		REQUIRE(rt::fast_exp(-100.0f) == 0.0f);
+		REQUIRE(std::isinf(rt::fast_exp(100.0f)));
+		REQUIRE(rt::fast_log(1.0f) == 0.0f);
+		REQUIRE(rt::fast_log(0.0f) == -std::numeric_limits<float>::infinity());
+		REQUIRE(std::isnan(rt::fast_log(-1.0f)));
+	}
+#if defined(RT_FAST_MATH_SSE2)
+	SECTION("sse2") {
+		// same kernels and bounds as the scalar version
+		for (int i = 0; i < 100000; ++i) {
+			alignas(16) float x[4], s[4], c[4], a[4], e[4], l[4];
+			for (int j = 0; j < 4; ++j) {
+				x[j] = glm::mix(-100.0f, 100.0f, random.uniform());
+			}
+			__m128 v = _mm_load_ps(x);
+			__m128 vs, vc;
+			rt::fast_sincos(v, &vs, &vc);
+			_mm_store_ps(s, vs);
+			_mm_store_ps(c, vc);
+			_mm_store_ps(a, rt::fast_atan2(v, _mm_set1_ps(-3.0f)));
+			_mm_store_ps(e, rt::fast_exp(_mm_mul_ps(v, _mm_set1_ps(0.5f))));
+			_mm_store_ps(l, rt::fast_log(_mm_add_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), v), _mm_set1_ps(1.0e-3f))));
+			for (int j = 0; j < 4; ++j) {
+				REQUIRE(std::abs(s[j] - std::sin((double)x[j])) <= 1.5e-7);
+				REQUIRE(std::abs(c[j] - std::cos((double)x[j])) <= 1.5e-7);
+				REQUIRE(std::abs(a[j] - std::atan2((double)x[j], -3.0)) <= 3.5e-7);
+				double exp_ref = std::exp((double)(x[j] * 0.5f));
+				REQUIRE(std::abs(e[j] - exp_ref) <= exp_ref * 1.5e-7);
+				double log_ref = std::log((double)(std::abs(x[j]) + 1.0e-3f));
+				REQUIRE(std::abs(l[j] - log_ref) <= std::max(std::abs(log_ref), 1.0) * 1.5e-7);
+			}
+		}
+	}
+#endif
+}
+
+TEST_CASE("GGX", "[GGX]") {
+	DefaultRandom random;
+
+	glm::vec3 Ng = glm::normalize(glm::vec3(0.2f, -0.3f, 1.0f));
+	rt::OrthonormalBasis<float> basis(Ng);
+
+	// 等方, 異方, grazing
+	struct Case {
+		std::unique_ptr<rt::GGX> ggx;
+		rt::ShadingPoint shadingPoint;
+		glm::vec3 wo;
+	};
+	std::vector<Case> cases;
+	auto add_case = [&](float roughnessU, float roughnessV, float woZ) {
+		Case c;
+		c.ggx.reset(new rt::GGX());
+		c.ggx->R = glm::vec3(0.9f, 0.6f, 0.3f);
+		c.ggx->RoughnessU = roughnessU;
+		c.ggx->RoughnessV = roughnessV;
+		c.shadingPoint.Ng = Ng;
+		c.shadingPoint.bxdf = c.ggx.get();
+		float sinTheta = std::sqrt(1.0f - woZ * woZ);
+		c.wo = basis.localToGlobal(glm::vec3(sinTheta * 0.6f, sinTheta * 0.8f, woZ));
+		cases.push_back(std::move(c));
+	};
+	add_case(0.5f, 0.5f, 0.9f);
+	add_case(0.7f, 0.4f, 0.5f);
+	add_case(0.9f, 0.9f, 0.15f);
+
+	SECTION("sample_eval agrees with evaluate") {
+		for (const Case &c : cases) {
+			for (int i = 0; i < 100000; ++i) {
+				rt::BxDFSample s = c.ggx->sample_eval(&random, c.wo, c.shadingPoint);
+				REQUIRE(glm::length2(s.wi) == Approx(1.0f).margin(1.0e-4f));
+				if (glm::dot(s.wi, Ng) <= 0.0f) {
+					REQUIRE(s.f == glm::vec3(0.0f));
+					continue;
+				}
+				rt::BxDFSample e = c.ggx->evaluate(c.wo, s.wi, c.shadingPoint);
+				REQUIRE(s.pdf == Approx(e.pdf).epsilon(1.0e-3f));
+				for (int j = 0; j < 3; ++j) {
+					REQUIRE(s.f[j] == Approx(e.f[j]).epsilon(1.0e-3f));
+				}
+			}
+		}
+	}
+
+	SECTION("pdf integrates to the fraction of samples above the horizon") {
+		for (const Case &c : cases) {
+			int N = 1000000;
+
+			// 一様な半球のサンプルで ∫ pdf dω
+			rt::Kahan<double> integral;
+			for (int i = 0; i < N; ++i) {
+				glm::vec3 wi = basis.localToGlobal(rt::sample_on_unit_hemisphere<float>(random.uniform(), random.uniform()));
+				integral += c.ggx->pdf(c.wo, wi, c.shadingPoint) * glm::two_pi<double>();
+			}
+
+			int above = 0;
+			for (int i = 0; i < N; ++i) {
+				rt::BxDFSample s = c.ggx->sample_eval(&random, c.wo, c.shadingPoint);
+				if (0.0f < glm::dot(s.wi, Ng)) {
+					above++;
+				}
+			}
+			double fraction = (double)above / N;
+			REQUIRE(integral / N == Approx(fraction).margin(0.01));
+		}
+	}
+
+	SECTION("histogram of sampled directions follows pdf") {
+		// cos(theta) と phi で等立体角のビンに分ける
+		const int kBinsZ = 8;
+		const int kBinsPhi = 16;
+		float dz = 1.0f / kBinsZ;
+		float dphi = glm::two_pi<float>() / kBinsPhi;
+
+		for (const Case &c : cases) {
+			int N = 1000000;
+			std::vector<int> histogram(kBinsZ * kBinsPhi);
+			for (int i = 0; i < N; ++i) {
+				rt::BxDFSample s = c.ggx->sample_eval(&random, c.wo, c.shadingPoint);
+				glm::vec3 local = basis.globalToLocal(s.wi);
+				if (local.z <= 0.0f) {
+					continue;
+				}
+				float phi = std::atan2(local.y, local.x);
+				if (phi < 0.0f) {
+					phi += glm::two_pi<float>();
+				}
+				int iz = std::min((int)(local.z / dz), kBinsZ - 1);
+				int iphi = std::min((int)(phi / dphi), kBinsPhi - 1);
+				histogram[iz * kBinsPhi + iphi]++;
+			}
+
+			// ビンごとの ∫ pdf dω を中点則で. dω = dz dphi
+			const int kSub = 16;
+			for (int iz = 0; iz < kBinsZ; ++iz) {
+				for (int iphi = 0; iphi < kBinsPhi; ++iphi) {
+					double expected = 0.0;
+					for (int a = 0; a < kSub; ++a) {
+						for (int b = 0; b < kSub; ++b) {
+							float z = (iz + (a + 0.5f) / kSub) * dz;
+							float phi = (iphi + (b + 0.5f) / kSub) * dphi;
+							float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+							glm::vec3 wi = basis.localToGlobal(glm::vec3(r * std::cos(phi), r * std::sin(phi), z));
+							expected += c.ggx->pdf(c.wo, wi, c.shadingPoint);
+						}
+					}
+					expected *= (double)dz * dphi / (kSub * kSub);
+
+					double observed = (double)histogram[iz * kBinsPhi + iphi] / N;
+					double sigma = std::sqrt(expected / N);
+					REQUIRE(std::abs(observed - expected) < 5.0 * sigma + 0.02 * expected);
+				}
+			}
+		}
+	}
+}
+
+TEST_CASE("ShadingQueue", "[ShadingQueue]") {
+	using namespace rt::shading_queue_detail;
+	using Kernel = void(*)(const float *const *, const float *const *, float *const *);
+
+	DefaultRandom random;
+	auto random_direction = [&]() {
+		return glm::normalize(glm::vec3(random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f), random.uniform(-1.0f, 1.0f)));
+	};
+
+	rt::ShadingNormals normals;
+	normals.N.push_back(glm::normalize(glm::vec3(0.1f, 0.2f, 1.0f)));
+	normals.N.push_back(glm::normalize(glm::vec3(-0.2f, 0.1f, 1.0f)));
+	normals.N.push_back(glm::normalize(glm::vec3(0.0f, -0.3f, 1.0f)));
+	normals.indices = { 0, 1, 2 };
+
+	std::vector<std::unique_ptr<rt::BxDF>> materials;
+	for (int i = 0; i < 8; ++i) {
+		rt::LambertianBRDF *lambertian = new rt::LambertianBRDF();
+		lambertian->R = glm::vec3(random.uniform(), random.uniform(), random.uniform());
+		lambertian->ShadingNormal = i % 2;
+		materials.emplace_back(lambertian);
+
+		materials.emplace_back(new rt::Ward());
+
+		rt::GGX *ggx = new rt::GGX();
+		ggx->R = glm::vec3(random.uniform(), random.uniform(), random.uniform());
+		ggx->RoughnessU = random.uniform(0.05f, 1.0f);
+		ggx->RoughnessV = random.uniform(0.05f, 1.0f);
+		materials.emplace_back(ggx);
+	}
+	rt::MaterialTable table;
+	std::vector<rt::MaterialSlot> slots;
+	for (auto &m : materials) {
+		slots.push_back(table.add(m.get()));
+	}
+
+	struct Hit {
+		int material;
+		glm::vec3 wo;
+		rt::ShadingPoint shadingPoint;
+		float u0, u1;
+		rt::BxDFSample reference;
+	};
+	auto make_hit = [&](int material) {
+		Hit hit;
+		hit.material = material;
+		hit.shadingPoint.bxdf = materials[material].get();
+		hit.shadingPoint.Ng = random_direction();
+		if (table.use_shading_normal(slots[material])) {
+			// 頂点法線は +z のまわり
+			hit.shadingPoint.Ng = glm::normalize(glm::vec3(0.0f, 0.0f, 1.0f) + 0.1f * hit.shadingPoint.Ng);
+			hit.shadingPoint.normals = &normals;
+			hit.shadingPoint.u = random.uniform(0.0f, 0.5f);
+			hit.shadingPoint.v = random.uniform(0.0f, 0.5f);
+		}
+		hit.wo = random_direction();
+		hit.u0 = random.uniform();
+		hit.u1 = random.uniform();
+
+		ReplayRandom replay;
+		replay.u[0] = hit.u0;
+		replay.u[1] = hit.u1;
+		hit.reference = hit.shadingPoint.bxdf->sample_eval(&replay, hit.wo, hit.shadingPoint);
+		return hit;
+	};
+
+	// fast_math の誤差の範囲で同じ
+	auto require_same = [](const rt::BxDFSample &s, const rt::BxDFSample &reference) {
+		REQUIRE(glm::length(s.wi - reference.wi) < 1.0e-3f);
+		for (int i = 0; i < 3; ++i) {
+			REQUIRE(s.f[i] == Approx(reference.f[i]).epsilon(1.0e-2).margin(1.0e-4));
+		}
+		REQUIRE(s.pdf == Approx(reference.pdf).epsilon(1.0e-2).margin(1.0e-4));
+	};
+
+	SECTION("kernels") {
+		struct Kernels {
+			rt::BxDFKind kind;
+			std::vector<Kernel> kernels;
+		};
+		std::vector<Kernels> kinds = {
+			{ rt::BxDFKind::Lambertian, { lambertian_sample_eval<F1> } },
+			{ rt::BxDFKind::Ward, { ward_sample_eval<F1> } },
+			{ rt::BxDFKind::GGX, { ggx_sample_eval<F1> } },
+		};
+#if defined(RT_FAST_MATH_SSE2)
+		kinds[0].kernels.push_back(lambertian_sample_eval<F4>);
+		kinds[1].kernels.push_back(ward_sample_eval<F4>);
+		kinds[2].kernels.push_back(ggx_sample_eval<F4>);
+#endif
+#if defined(RT_FAST_MATH_AVX2)
+		kinds[0].kernels.push_back(lambertian_sample_eval<F8>);
+		kinds[1].kernels.push_back(ward_sample_eval<F8>);
+		kinds[2].kernels.push_back(ggx_sample_eval<F8>);
+#endif
+		// F1, F4, F8 の順
+		const int widths[] = { 1, 4, 8 };
+
+		for (const Kernels &k : kinds) {
+			std::vector<int> candidates;
+			for (int i = 0; i < materials.size(); ++i) {
+				if (slots[i].kind == k.kind) {
+					candidates.push_back(i);
+				}
+			}
+
+			for (int batch = 0; batch < 256; ++batch) {
+				Hit hits[kBatchSize];
+				alignas(32) float inputs[kInputCount][kBatchSize];
+				alignas(32) float params[kParamCount][kBatchSize] = {};
+				for (int lane = 0; lane < kBatchSize; ++lane) {
+					Hit &hit = hits[lane] = make_hit(candidates[random.uniform_integer() % candidates.size()]);
+					glm::vec3 Ns = table.use_shading_normal(slots[hit.material]) ? hit.shadingPoint.Ns() : hit.shadingPoint.Ng;
+					const float values[kInputCount] = {
+						hit.shadingPoint.Ng.x, hit.shadingPoint.Ng.y, hit.shadingPoint.Ng.z,
+						hit.wo.x, hit.wo.y, hit.wo.z,
+						Ns.x, Ns.y, Ns.z,
+						hit.u0, hit.u1
+					};
+					for (int i = 0; i < kInputCount; ++i) {
+						inputs[i][lane] = values[i];
+					}
+					uint32_t index = slots[hit.material].index;
+					if (k.kind == rt::BxDFKind::Lambertian) {
+						params[kRX][lane] = table.lambertian_params.R.x()[index];
+						params[kRY][lane] = table.lambertian_params.R.y()[index];
+						params[kRZ][lane] = table.lambertian_params.R.z()[index];
+						params[kShadingNormal][lane] = table.lambertian_params.shadingNormal[index];
+					}
+					else if (k.kind == rt::BxDFKind::GGX) {
+						params[kRX][lane] = table.ggx_params.R.x()[index];
+						params[kRY][lane] = table.ggx_params.R.y()[index];
+						params[kRZ][lane] = table.ggx_params.R.z()[index];
+						params[kAlphaU][lane] = table.ggx_params.alphaU[index];
+						params[kAlphaV][lane] = table.ggx_params.alphaV[index];
+					}
+				}
+
+				for (int w = 0; w < k.kernels.size(); ++w) {
+					alignas(32) float outputs[kOutputCount][kBatchSize];
+					for (int lane = 0; lane < kBatchSize; lane += widths[w]) {
+						const float *in[kInputCount];
+						for (int i = 0; i < kInputCount; ++i) {
+							in[i] = inputs[i] + lane;
+						}
+						const float *param[kParamCount];
+						for (int p = 0; p < kParamCount; ++p) {
+							param[p] = params[p] + lane;
+						}
+						float *out[kOutputCount];
+						for (int o = 0; o < kOutputCount; ++o) {
+							out[o] = outputs[o] + lane;
+						}
+						k.kernels[w](in, param, out);
+					}
+					for (int lane = 0; lane < kBatchSize; ++lane) {
+						rt::BxDFSample s;
+						s.wi = glm::vec3(outputs[kWiX][lane], outputs[kWiY][lane], outputs[kWiZ][lane]);
+						s.f = glm::vec3(outputs[kFX][lane], outputs[kFY][lane], outputs[kFZ][lane]);
+						s.pdf = outputs[kPdf][lane];
+						require_same(s, hits[lane].reference);
+					}
+				}
+			}
+		}
+	}
+
+	SECTION("queue") {
+		// 種類の混ざった, 8 の倍数でない数
+		rt::ShadingQueue queue(&table);
+		std::vector<Hit> hits;
+		for (int i = 0; i < 1003; ++i) {
+			hits.push_back(make_hit((int)(random.uniform_integer() % materials.size())));
+			const Hit &hit = hits.back();
+			queue.push(i, hit.wo, hit.shadingPoint, slots[hit.material], hit.u0, hit.u1);
+		}
+		REQUIRE(queue.size() == hits.size());
+
+		std::vector<rt::BxDFSample> results(hits.size());
+		queue.sample_eval(results.data());
+		REQUIRE(queue.size() == 0);
+		for (int i = 0; i < hits.size(); ++i) {
+			REQUIRE(results[i].lobe == hits[i].reference.lobe);
+			require_same(results[i], hits[i].reference);
+		}
+	}
+}
+
+TEST_CASE("RaySorter", "[RaySorter]") {
+	DefaultRandom random;
+
+	// morton code is the bit interleave of x, y, z
+	for (int i = 0; i < 10000; ++i) {
+		uint32_t x = random.uniform_integer() % 512;
+		uint32_t y = random.uniform_integer() % 512;
+		uint32_t z = random.uniform_integer() % 512;
+		uint32_t expected = 0;
+		for (int b = 0; b < 9; ++b) {
+			expected |= ((x >> b) & 1) << (b * 3);
+			expected |= ((y >> b) & 1) << (b * 3 + 1);
+			expected |= ((z >> b) & 1) << (b * 3 + 2);
+		}
+		REQUIRE(rt::morton_code_9(x, y, z) == expected);
+	}
+
+	glm::vec3 lower(-2.0f, -1.0f, 0.0f);
+	glm::vec3 upper(2.0f, 3.0f, 1.0f);
+	glm::vec3 invExtent = glm::vec3(1.0f) / (upper - lower);
+
+	rt::RaySorter sorter;
+	for (int n : { 0, 1, 7, 1000, 5000 }) {
+		std::vector<glm::vec3> ro(n);
+		std::vector<glm::vec3> rd(n);
+		for (int i = 0; i < n; ++i) {
+			ro[i] = glm::mix(lower - glm::vec3(0.5f), upper + glm::vec3(0.5f), glm::vec3(random.uniform(), random.uniform(), random.uniform()));
+			rd[i] = rt::sample_on_unit_sphere<float>(random.uniform(), random.uniform());
+		}
+		std::vector<uint32_t> order(n);
+		sorter.sort(ro.data(), rd.data(), n, lower, upper, order.data());
+
+		// a stable permutation in key order, grouped by octant first
+		std::vector<int> seen(n);
+		for (int k = 0; k < n; ++k) {
+			REQUIRE(order[k] < n);
+			seen[order[k]]++;
+			if (0 < k) {
+				uint32_t a = rt::ray_sort_key(ro[order[k - 1]], rd[order[k - 1]], lower, invExtent);
+				uint32_t b = rt::ray_sort_key(ro[order[k]], rd[order[k]], lower, invExtent);
+				REQUIRE(a <= b);
+				if (a == b) {
+					REQUIRE(order[k - 1] < order[k]);
+				}
+				uint32_t octant_a = (rd[order[k - 1]].x < 0.0f) | (rd[order[k - 1]].y < 0.0f) << 1 | (rd[order[k - 1]].z < 0.0f) << 2;
+				uint32_t octant_b = (rd[order[k]].x < 0.0f) | (rd[order[k]].y < 0.0f) << 1 | (rd[order[k]].z < 0.0f) << 2;
+				REQUIRE(octant_a <= octant_b);
+			}
+		}
+		for (int i = 0; i < n; ++i) {
+			REQUIRE(seen[i] == 1);
+		}
+	}
+}
+
+TEST_CASE("adaptive sampling", "[adaptive sampling]") {
+	DefaultRandom random;
+
+	SECTION("relative_error") {
+		// uniform [0, 2): mean 1, variance 1/3
+		rt::OnlineVariance<float> v;
+		REQUIRE(std::isinf(rt::relative_error(v)));
+		int N = 100000;
+		for (int i = 0; i < N; ++i) {
+			v.addSample(random.uniform(0.0f, 2.0f));
+		}
+		float expected = std::sqrt(1.0f / 3.0f / N) / (1.0f + 1.0e-3f);
+		REQUIRE(rt::relative_error(v) == Approx(expected).epsilon(0.02));
+
+		// flat black converges
+		rt::OnlineVariance<float> black;
+		black.addSample(0.0f);
+		black.addSample(0.0f);
+		REQUIRE(rt::relative_error(black) == 0.0f);
+	}
+
+	SECTION("allocate_adaptive_samples") {
+		std::vector<float> errors = { 0.001f, 0.5f, 0.1f, 0.0f, std::numeric_limits<float>::infinity(), 0.02f };
+		std::vector<uint8_t> counts;
+		int active = rt::allocate_adaptive_samples(errors, 0.02f, 12, 8, &counts);
+		REQUIRE(active == 3);
+		REQUIRE(counts.size() == errors.size());
+		REQUIRE(counts[0] == 0);
+		REQUIRE(counts[3] == 0);
+		REQUIRE(counts[5] == 0);
+		REQUIRE(1 <= counts[2]);
+		REQUIRE(counts[2] <= counts[1]);
+		REQUIRE(counts[4] == 8);
+
+		std::vector<float> done = { 0.01f, 0.0f };
+		REQUIRE(rt::allocate_adaptive_samples(done, 0.02f, 2, 8, &counts) == 0);
+		REQUIRE(counts[0] == 0);
+		REQUIRE(counts[1] == 0);
+	}
+
+	SECTION("AdaptiveErrorSum") {
+		// タイルごとに足して merge() しても, まとめて配ったのと同じ
+		std::vector<float> errors(1000);
+		for (float &e : errors) {
+			e = random.uniform() < 0.1f ? std::numeric_limits<float>::infinity() : random.uniform(0.0f, 0.2f);
+		}
+		std::vector<uint8_t> counts;
+		int active = rt::allocate_adaptive_samples(errors, 0.05f, 1000, 8, &counts);
+
+		rt::AdaptiveErrorSum total;
+		for (int tile = 0; tile < 10; ++tile) {
+			rt::AdaptiveErrorSum sum;
+			for (int i = tile * 100; i < (tile + 1) * 100; ++i) {
+				sum.add(errors[i], 0.05f);
+			}
+			total.merge(sum);
+		}
+		REQUIRE(total.active == active);
+		for (int i = 0; i < errors.size(); ++i) {
+			REQUIRE(rt::adaptive_sample_count(errors[i], 0.05f, 1000, 8, total) == counts[i]);
+		}
+	}
+}
+
+TEST_CASE("RenderCheckpoint", "[RenderCheckpoint]") {
+	DefaultRandom random;
+
+	SECTION("rng continuation") {
+		rt::Xoshiro128StarStar a(17);
+		for (int i = 0; i < 100; ++i) {
+			a.uniform();
+		}
+		rt::Xoshiro128StarStar b;
+		b.set_state(a.state());
+		for (int i = 0; i < 1000; ++i) {
+			REQUIRE(a.uniform_integer() == b.uniform_integer());
+		}
+	}
+
+	SECTION("round trip") {
+		struct Pixel {
+			int sample;
+			float color[3];
+		};
+		int w = 37;
+		int h = 11;
+		std::vector<Pixel> pixels(w * h);
+		std::vector<glm::uvec4> states(w * h);
+		for (int i = 0; i < w * h; ++i) {
+			pixels[i].sample = (int)(random.uniform_integer() % 1000);
+			pixels[i].color[0] = random.uniform();
+			pixels[i].color[1] = random.uniform();
+			pixels[i].color[2] = random.uniform();
+			states[i] = glm::uvec4((uint32_t)random.uniform_integer(), (uint32_t)random.uniform_integer(), (uint32_t)random.uniform_integer(), (uint32_t)random.uniform_integer());
+		}
+		rt::RenderCounters counters;
+		counters.steps = 123;
+		counters.badSampleFirefly = 4;
+
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "rt_unit_test.checkpoint";
+		REQUIRE(rt::RenderCheckpoint::write(path, "scene", w, h, counters, sizeof(Pixel),
+			[&](int y, uint8_t *row) { memcpy(row, pixels.data() + y * w, sizeof(Pixel) * w); },
+			[&](int y, glm::uvec4 *row) { std::copy(states.begin() + y * w, states.begin() + (y + 1) * w, row); }));
+
+		rt::RenderCheckpoint checkpoint;
+		REQUIRE(checkpoint.open(path, "scene", w, h, sizeof(Pixel)));
+		REQUIRE(checkpoint.counters().steps == 123);
+		REQUIRE(checkpoint.counters().badSampleFirefly == 4);
+		REQUIRE(memcmp(checkpoint.pixels(), pixels.data(), sizeof(Pixel) * w * h) == 0);
+		for (int i = 0; i < w * h; ++i) {
+			REQUIRE(checkpoint.randomState(i) == states[i]);
+		}
+		checkpoint.close();
+
+		// another scene, resolution or pixel layout is a miss
+		REQUIRE(checkpoint.open(path, "other scene", w, h, sizeof(Pixel)) == false);
+		REQUIRE(checkpoint.open(path, "scene", w, h + 1, sizeof(Pixel)) == false);
+		REQUIRE(checkpoint.open(path, "scene", w, h, sizeof(Pixel) + 4) == false);
+
+		std::filesystem::remove(path);
+		REQUIRE(checkpoint.open(path, "scene", w, h, sizeof(Pixel)) == false);
+	}
+}
+
+TEST_CASE("RenderSplit", "[RenderSplit]") {
+	DefaultRandom random;
+
+	SECTION("online variance merge") {
+		for (int j = 0; j < 100; ++j) {
+			int na = (int)(random.uniform_integer() % 50);
+			int nb = (int)(random.uniform_integer() % 50);
+			rt::OnlineVariance<double> a;
+			rt::OnlineVariance<double> b;
+			rt::OnlineVariance<double> all;
+			for (int i = 0; i < na + nb; ++i) {
+				double x = random.uniform(-10.0f, 10.0f);
+				(i < na ? a : b).addSample(x);
+				all.addSample(x);
+			}
+			a.merge(b);
+			REQUIRE(a.sampleCount() == all.sampleCount());
+			REQUIRE(a.mean() == Approx(all.mean()).margin(1.0e-9));
+			REQUIRE(a.variance() == Approx(all.variance()).margin(1.0e-9));
+		}
+	}
+
+	SECTION("long jump") {
+		rt::Xoshiro128StarStar a;
+		rt::Xoshiro128StarStar b;
+		b.long_jump();
+		REQUIRE(a.state() != b.state());
+
+		rt::Xoshiro128StarStar c;
+		c.long_jump();
+		REQUIRE(b.state() == c.state());
+	}
+
+	SECTION("window") {
+		rt::RenderSplit split;
+		rt::PixelWindow whole = split.window(64, 32);
+		REQUIRE(whole.x0 == 0);
+		REQUIRE(whole.y0 == 0);
+		REQUIRE(whole.x1 == 64);
+		REQUIRE(whole.y1 == 32);
+
+		split.crop.x0 = -5;
+		split.crop.y0 = 10;
+		split.crop.x1 = 20;
+		split.crop.y1 = 100;
+		rt::PixelWindow w = split.window(64, 32);
+		REQUIRE(w.x0 == 0);
+		REQUIRE(w.y0 == 10);
+		REQUIRE(w.x1 == 20);
+		REQUIRE(w.y1 == 32);
+	}
+
+	SECTION("merge") {
+		int w = 23;
+		int h = 17;
+
+		// process 0 は左右 2 つの crop, process 1 は全体
+		rt::PixelWindow left;
+		left.x1 = 10;
+		left.y1 = h;
+		rt::PixelWindow right;
+		right.x0 = 10;
+		right.x1 = w;
+		right.y1 = h;
+		rt::PixelWindow whole;
+		whole.x1 = w;
+		whole.y1 = h;
+
+		struct Part {
+			int process;
+			rt::PixelWindow window;
+			std::vector<std::vector<float>> samples;
+		};
+		std::vector<Part> parts = { { 0, left }, { 0, right }, { 1, whole } };
+
+		std::vector<std::vector<float>> all(w * h);
+		std::vector<std::filesystem::path> paths;
+		for (int i = 0; i < parts.size(); ++i) {
+			Part &part = parts[i];
+			std::vector<rt::AccumulationPixel> pixels(part.window.width() * part.window.height());
+			for (int y = part.window.y0; y < part.window.y1; ++y) {
+				for (int x = part.window.x0; x < part.window.x1; ++x) {
+					rt::AccumulationPixel &px = pixels[(y - part.window.y0) * part.window.width() + (x - part.window.x0)];
+					rt::OnlineVariance<float> v;
+					int n = 1 + (int)(random.uniform_integer() % 8);
+					for (int k = 0; k < n; ++k) {
+						float L = random.uniform();
+						px.color += glm::vec3(L);
+						v.addSample(L);
+						all[y * w + x].push_back(L);
+					}
+					px.sample = n;
+					px.rays = n * 2;
+					px.luminanceMean = v.mean();
+					px.luminanceM2 = v.m2();
+				}
+			}
+			std::filesystem::path path = std::filesystem::temp_directory_path() / ("rt_unit_test_" + std::to_string(i) + ".accum");
+			REQUIRE(rt::RenderAccumulation::write(path, "scene", w, h, part.process, part.window, 8, [&](int y, rt::AccumulationPixel *row) {
+				int offset = (y - part.window.y0) * part.window.width();
+				std::copy(pixels.begin() + offset, pixels.begin() + offset + part.window.width(), row);
+			}));
+			paths.push_back(path);
+		}
+
+		std::vector<std::unique_ptr<rt::RenderAccumulation>> files;
+		std::vector<const rt::RenderAccumulation *> accumulations;
+		for (auto path : paths) {
+			files.emplace_back(new rt::RenderAccumulation());
+			REQUIRE(files.back()->open(path));
+			accumulations.push_back(files.back().get());
+		}
+		REQUIRE(accumulations[1]->window().x0 == 10);
+		REQUIRE(accumulations[2]->process() == 1);
+
+		int mw, mh;
+		std::vector<rt::AccumulationPixel> merged;
+		REQUIRE(rt::merge_accumulations(accumulations, &mw, &mh, &merged));
+		REQUIRE(mw == w);
+		REQUIRE(mh == h);
+		for (int i = 0; i < w * h; ++i) {
+			float mean, variance;
+			rt::mean_and_variance(all[i], &mean, &variance);
+			REQUIRE(merged[i].sample == all[i].size());
+			REQUIRE(merged[i].rays == all[i].size() * 2);
+			REQUIRE(merged[i].color.x / merged[i].sample == Approx(mean).margin(1.0e-5));
+			REQUIRE(merged[i].luminance().mean() == Approx(mean).margin(1.0e-5));
+			REQUIRE(merged[i].luminance().variance() == Approx(variance).margin(1.0e-5));
+		}
+
+		// 同じ process の重なりは同じ乱数列を 2 回足すことになる
+		std::vector<const rt::RenderAccumulation *> duplicated = { accumulations[0], accumulations[0] };
+		REQUIRE(rt::merge_accumulations(duplicated, &mw, &mh, &merged) == false);
+
+		files.clear();
+		for (auto path : paths) {
+			std::filesystem::remove(path);
+		}
+	}
+}
+
+TEST_CASE("TiledFramebuffer", "[TiledFramebuffer]") {
+	struct Pixel {
+		float value;
+		int32_t sample;
+	};
+	// 端のタイルが半端になる大きさ
+	int w = 150;
+	int h = 70;
+
+	auto fill = [&](rt::TiledFramebuffer<Pixel> &buffer) {
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				buffer.pixel(x, y)->value = (float)(y * w + x);
+				buffer.pixel(x, y)->sample = x;
+				*buffer.state(x, y) = glm::uvec4(x, y, x + y, 1);
+			}
+		}
+	};
+	auto check = [&](const rt::TiledFramebuffer<Pixel> &buffer) {
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				REQUIRE(buffer.pixel(x, y)->value == (float)(y * w + x));
+				REQUIRE(buffer.pixel(x, y)->sample == x);
+				REQUIRE(*buffer.state(x, y) == glm::uvec4(x, y, x + y, 1));
+			}
+		}
+	};
+
+	SECTION("tiles") {
+		rt::TiledFramebuffer<Pixel> buffer;
+		REQUIRE(buffer.allocate(w, h));
+		REQUIRE(buffer.outOfCore() == false);
+		REQUIRE(buffer.tileCount() == 3 * 2);
+
+		// タイルは重ならずに画像をちょうど覆う
+		std::vector<int> covered(w * h);
+		for (int i = 0; i < buffer.tileCount(); ++i) {
+			rt::PixelWindow tile = buffer.tileWindow(i);
+			REQUIRE(tile.empty() == false);
+			REQUIRE(tile.width() <= rt::TiledFramebuffer<Pixel>::kTileSize);
+			REQUIRE(tile.height() <= rt::TiledFramebuffer<Pixel>::kTileSize);
+			for (int y = tile.y0; y < tile.y1; ++y) {
+				for (int x = tile.x0; x < tile.x1; ++x) {
+					covered[y * w + x]++;
+				}
+			}
+		}
+		for (int c : covered) {
+			REQUIRE(c == 1);
+		}
+		rt::PixelWindow corner = buffer.tileWindow(buffer.tileCount() - 1);
+		REQUIRE(corner.x0 == 128);
+		REQUIRE(corner.y0 == 64);
+		REQUIRE(corner.x1 == w);
+		REQUIRE(corner.y1 == h);
+
+		fill(buffer);
+		check(buffer);
+	}
+
+	SECTION("out-of-core") {
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "rt_unit_test.framebuffer";
+		{
+			rt::TiledFramebuffer<Pixel> buffer;
+			REQUIRE(buffer.allocate(w, h, path));
+			REQUIRE(buffer.outOfCore());
+
+			// ファイルは 0 で始まる
+			REQUIRE(buffer.pixel(w - 1, h - 1)->sample == 0);
+			REQUIRE(*buffer.state(w - 1, h - 1) == glm::uvec4(0));
+
+			fill(buffer);
+
+			// 追い出しても中身は残る
+			for (int i = 0; i < buffer.tileCount(); ++i) {
+				buffer.evictTile(i);
+			}
+			check(buffer);
+		}
+		std::filesystem::remove(path);
+	}
+}
+
+TEST_CASE("ProgressivePreview", "[ProgressivePreview]") {
+	REQUIRE(rt::preview_extent(64, 16) == 4);
+	REQUIRE(rt::preview_extent(65, 16) == 5);
+	REQUIRE(rt::preview_extent(1, 16) == 1);
+
+	// 端が半端になる大きさ
+	int w = 101;
+	int h = 37;
+	for (int scale : rt::kPreviewScales) {
+		int pw = rt::preview_extent(w, scale);
+		int ph = rt::preview_extent(h, scale);
+
+		// 一定の値はそのまま
+		std::vector<glm::vec3> src(pw * ph, glm::vec3(0.25f, 0.5f, 1.0f));
+		std::vector<glm::vec3> dst(w * h);
+		rt::upsample_preview(src.data(), scale, w, h, dst.data());
+		for (glm::vec3 c : dst) {
+			REQUIRE(c.x == Approx(0.25f));
+			REQUIRE(c.y == Approx(0.5f));
+			REQUIRE(c.z == Approx(1.0f));
+		}
+
+		// ブロックの中心の値で作った 1 次関数は, 内側ならちょうど再現される
+		for (int j = 0; j < ph; ++j) {
+			for (int i = 0; i < pw; ++i) {
+				float cx = (i + 0.5f) * scale;
+				float cy = (j + 0.5f) * scale;
+				src[j * pw + i] = glm::vec3(cx, cy, cx + 2.0f * cy);
+			}
+		}
+		rt::upsample_preview(src.data(), scale, w, h, dst.data());
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				glm::vec3 c = dst[y * w + x];
+				float px = x + 0.5f;
+				float py = y + 0.5f;
+				bool insideX = scale * 0.5f <= px && px <= (pw - 0.5f) * scale;
+				bool insideY = scale * 0.5f <= py && py <= (ph - 0.5f) * scale;
+				if (insideX) {
+					REQUIRE(c.x == Approx(px).margin(1.0e-3));
+				}
+				if (insideY) {
+					REQUIRE(c.y == Approx(py).margin(1.0e-3));
+				}
+				if (insideX && insideY) {
+					REQUIRE(c.z == Approx(px + 2.0f * py).margin(1.0e-3));
+				}
+			}
+		}
+	}
+}
+
+TEST_CASE("TripleBuffer", "[TripleBuffer]") {
+	SECTION("latest wins") {
+		rt::TripleBuffer<int> buffer;
+		REQUIRE(buffer.acquire() == false);
+
+		buffer.back() = 1;
+		buffer.publish();
+		buffer.back() = 2;
+		buffer.publish();
+		REQUIRE(buffer.acquire());
+		REQUIRE(buffer.front() == 2);
+		REQUIRE(buffer.acquire() == false);
+		REQUIRE(buffer.front() == 2);
+
+		buffer.back() = 3;
+		buffer.publish();
+		REQUIRE(buffer.acquire());
+		REQUIRE(buffer.front() == 3);
+	}
+
+	SECTION("threads") {
+		// 読む側は書きかけのバッファを見ないこと, 古いものに戻らないこと
+		rt::TripleBuffer<std::vector<int>> buffer;
+		enum {
+			kFrames = 20000,
+			kSize = 256,
+		};
+		std::thread producer([&]() {
+			for (int i = 1; i <= kFrames; ++i) {
+				std::vector<int> &back = buffer.back();
+				back.assign(kSize, i);
+				buffer.publish();
+			}
+		});
+
+		int last = 0;
+		bool torn = false;
+		bool backward = false;
+		while (last < kFrames) {
+			if (buffer.acquire() == false) {
+				continue;
+			}
+			const std::vector<int> &front = buffer.front();
+			for (int v : front) {
+				torn |= v != front[0];
+			}
+			backward |= front[0] < last;
+			last = front[0];
+		}
+		producer.join();
+
+		REQUIRE(torn == false);
+		REQUIRE(backward == false);
+	}
+}
+
+TEST_CASE("DisplayTransform", "[DisplayTransform]") {
+	DefaultRandom random;
+
+	int w = 123;
+	int h = 45;
+	std::vector<glm::vec3> src(w * h);
+	for (int i = 0; i < src.size(); ++i) {
+		for (int j = 0; j < 3; ++j) {
+			// 1e-8 から 4 くらいまで
+			src[i][j] = std::exp(random.uniform(-18.0f, 1.5f));
+		}
+	}
+	src[0] = glm::vec3(0.0f, 1.0f, 1000.0f);
+
+	SECTION("gamma 2.2") {
+		rt::DisplayTransform transform;
+		std::vector<uint8_t> dst(w * h * 3);
+		transform.apply(src.data(), w, h, dst.data());
+		for (int i = 0; i < src.size(); ++i) {
+			for (int j = 0; j < 3; ++j) {
+				int ref = (uint8_t)glm::clamp(std::pow((double)src[i][j], 1.0 / 2.2) * 256.0, 0.0, 255.99999);
+				REQUIRE(std::abs(ref - (int)dst[i * 3 + j]) <= 1);
+			}
+		}
+		REQUIRE(dst[0] == 0);
+		REQUIRE(dst[1] == 255);
+		REQUIRE(dst[2] == 255);
+	}
+
+	SECTION("exposure, reinhard, sRGB") {
+		rt::DisplayTransformConfig config;
+		config.exposure = 1.5f;
+		config.reinhard = true;
+		config.curve = rt::DisplayCurve::sRGB;
+		rt::DisplayTransform transform(config);
+		std::vector<uint8_t> dst(w * h * 3);
+		transform.apply(src.data(), w, h, dst.data());
+
+		double scale = std::exp2(1.5);
+		for (int i = 0; i < src.size(); ++i) {
+			for (int j = 0; j < 3; ++j) {
+				double x = src[i][j] * scale;
+				x = x / (1.0 + x);
+				double v = x <= 0.0031308 ? 12.92 * x : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+				int ref = (uint8_t)glm::clamp(v * 256.0, 0.0, 255.99999);
+				REQUIRE(std::abs(ref - (int)dst[i * 3 + j]) <= 1);
+			}
+		}
+	}
+}
+
+TEST_CASE("WorkerQueue", "[WorkerQueue]") {
+	std::atomic<int> done = 0;
+	std::vector<int> order;
+	{
+		rt::WorkerQueue queue(1, 2);
+		for (int i = 0; i < 100; ++i) {
+			queue.push([&done, &order, i]() {
+				order.push_back(i);
+				done++;
+			});
+		}
+		queue.wait();
+		REQUIRE(done == 100);
+
+		// 1 スレッドなら積んだ順
+		for (int i = 0; i < 100; ++i) {
+			REQUIRE(order[i] == i);
+		}
+
+		for (int i = 0; i < 10; ++i) {
+			queue.push([&done]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				done++;
+			});
+		}
+	}
+	// デストラクタは残りを終えてから
+	REQUIRE(done == 110);
+}
+
+TEST_CASE("FloatImageWriter", "[FloatImageWriter]") {
+	int w = 150;
+	int h = 70;
+	auto value = [](int x, int y, int c) {
+		return x * 0.5f + y * 100.0f + c * 0.25f;
+	};
+
+	rt::ImageLayer beauty;
+	beauty.channels = { "R", "G", "B" };
+	beauty.read = [&](int x, int y, int n, float *dst) {
+		for (int i = 0; i < n; ++i) {
+			for (int c = 0; c < 3; ++c) {
+				dst[i * 3 + c] = value(x + i, y, c);
+			}
+		}
+	};
+	rt::ImageLayer samples;
+	samples.name = "samples";
+	samples.channels = { "Y" };
+	samples.read = [&](int x, int y, int n, float *dst) {
+		for (int i = 0; i < n; ++i) {
+			dst[i] = -value(x + i, y, 0);
+		}
+	};
+
+	auto read_file = [](std::filesystem::path path) {
+		std::vector<uint8_t> bytes;
+		rt::MappedFile file;
+		if (file.open(path)) {
+			bytes.assign(file.data(), file.data() + file.size());
+		}
+		return bytes;
+	};
+
+	SECTION("pfm") {
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "rt_unit_test.pfm";
+		REQUIRE(rt::write_pfm(path, w, h, beauty));
+		std::vector<uint8_t> bytes = read_file(path);
+		std::string header = "PF\n150 70\n-1.0\n";
+		REQUIRE(bytes.size() == header.size() + w * h * 3 * sizeof(float));
+		REQUIRE(memcmp(bytes.data(), header.data(), header.size()) == 0);
+
+		// 下の行から
+		const uint8_t *data = bytes.data() + header.size();
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				for (int c = 0; c < 3; ++c) {
+					float v;
+					memcpy(&v, data + (((h - 1 - y) * w + x) * 3 + c) * sizeof(float), sizeof(float));
+					REQUIRE(v == value(x, y, c));
+				}
+			}
+		}
+		REQUIRE(rt::write_pfm(path, w, h, rt::ImageLayer()) == false);
+		std::filesystem::remove(path);
+	}
+
+	SECTION("tiled exr") {
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "rt_unit_test.exr";
+		int tileSize = 32;
+		REQUIRE(rt::write_exr(path, w, h, { beauty, samples }, tileSize));
+		std::vector<uint8_t> bytes = read_file(path);
+		REQUIRE(16 < bytes.size());
+
+		const uint8_t *p = bytes.data();
+		auto read_i32 = [&]() {
+			int32_t v;
+			memcpy(&v, p, 4);
+			p += 4;
+			return v;
+		};
+		auto read_string = [&]() {
+			std::string s = (const char *)p;
+			p += s.size() + 1;
+			return s;
+		};
+		REQUIRE(read_i32() == 20000630);
+		REQUIRE(read_i32() == (2 | 0x200));
+
+		std::vector<std::string> channels;
+		for (;;) {
+			std::string name = read_string();
+			if (name.empty()) {
+				break;
+			}
+			std::string type = read_string();
+			int32_t size = read_i32();
+			const uint8_t *value_at = p;
+			if (name == "channels") {
+				REQUIRE(type == "chlist");
+				while (*p != 0) {
+					channels.push_back(read_string());
+					REQUIRE(read_i32() == 2);
+					p += 12;
+				}
+			}
+			if (name == "dataWindow") {
+				int32_t window[4];
+				memcpy(window, value_at, 16);
+				REQUIRE(window[2] == w - 1);
+				REQUIRE(window[3] == h - 1);
+			}
+			if (name == "tiles") {
+				REQUIRE(type == "tiledesc");
+				uint32_t size_x;
+				memcpy(&size_x, value_at, 4);
+				REQUIRE(size_x == tileSize);
+			}
+			p = value_at + size;
+		}
+		REQUIRE(channels == std::vector<std::string>({ "B", "G", "R", "samples.Y" }));
+
+		int tilesX = (w + tileSize - 1) / tileSize;
+		int tilesY = (h + tileSize - 1) / tileSize;
+		std::vector<uint64_t> offsets(tilesX * tilesY);
+		memcpy(offsets.data(), p, offsets.size() * sizeof(uint64_t));
+
+		for (int ty = 0; ty < tilesY; ++ty) {
+			for (int tx = 0; tx < tilesX; ++tx) {
+				p = bytes.data() + offsets[ty * tilesX + tx];
+				REQUIRE(read_i32() == tx);
+				REQUIRE(read_i32() == ty);
+				REQUIRE(read_i32() == 0);
+				REQUIRE(read_i32() == 0);
+				int tw = std::min(tileSize, w - tx * tileSize);
+				int th = std::min(tileSize, h - ty * tileSize);
+				REQUIRE(read_i32() == tw * th * 4 * sizeof(float));
+				for (int y = ty * tileSize; y < ty * tileSize + th; ++y) {
+					for (int c = 0; c < 4; ++c) {
+						for (int x = tx * tileSize; x < tx * tileSize + tw; ++x) {
+							float v;
+							memcpy(&v, p, sizeof(float));
+							p += sizeof(float);
+							float expected = c == 3 ? -value(x, y, 0) : value(x, y, 2 - c);
+							REQUIRE(v == expected);
+						}
+					}
+				}
+			}
+		}
+		REQUIRE(p == bytes.data() + bytes.size());
+		std::filesystem::remove(path);
+	}
+
+	SECTION("LayerStream") {
+		std::filesystem::path direct = std::filesystem::temp_directory_path() / "rt_unit_test_direct.exr";
+		std::filesystem::path streamed = std::filesystem::temp_directory_path() / "rt_unit_test_streamed.exr";
+		int tileSize = 16;
+		REQUIRE(rt::write_exr(direct, w, h, { beauty, samples }, tileSize));
+
+		// 別のスレッドの write_exr() へ帯ごとに渡しても同じファイルになる
+		rt::LayerStream stream({ beauty, samples }, w, h, tileSize, 2);
+		bool ok = false;
+		std::thread writer([&]() {
+			ok = rt::write_exr(streamed, w, h, stream.layers(), tileSize);
+			stream.close();
+		});
+		int strips = 0;
+		stream.produce([&](int y0, int y1) {
+			REQUIRE(y0 == strips * tileSize);
+			REQUIRE(y1 == std::min(y0 + tileSize, h));
+			strips++;
+		});
+		writer.join();
+		REQUIRE(ok);
+		REQUIRE(strips == (h + tileSize - 1) / tileSize);
+		REQUIRE(read_file(direct) == read_file(streamed));
+
+		// 書く側が読まずに close() しても produce() は返る. 読むのは capacity + 1 帯まで
+		rt::LayerStream abandoned({ beauty, samples }, w, h, tileSize, 2);
+		std::thread closer([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			abandoned.close();
+		});
+		int produced = 0;
+		abandoned.produce([&](int y0, int y1) {
+			produced++;
+		});
+		closer.join();
+		REQUIRE(produced <= 3);
+
+		std::filesystem::remove(direct);
+		std::filesystem::remove(streamed);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+﻿#pragma once
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+#include "online.hpp"
+
+namespace rt {
+	inline float luminance(const glm::vec3 &c) {
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
+	/*
+	 平均の相対標準誤差 sqrt(s^2 / n) / mean. s^2 は不偏分散.
+	 真っ黒なピクセルで発散しないように mean に kDarkLuminance を足す. 2 サンプル未満は inf
+	*/
+	inline float relative_error(const OnlineVariance<float> &v) {
+		const float kDarkLuminance = 1.0e-3f;
+		int n = v.sampleCount();
+		if (n < 2) {
+			return std::numeric_limits<float>::infinity();
+		}
+		float s2 = v.variance() * n / (n - 1);
+		return std::sqrt(s2 / n) / (std::max(v.mean(), 0.0f) + kDarkLuminance);
+	}
+
+	struct AdaptiveSamplingConfig {
+		bool enabled = false;
+
+		// この step 数までは全ピクセルに 1 サンプルずつ
+		int pilotSteps = 16;
+
+		// relative_error() がこれ以下のピクセルは止める. 全部止まったら終わり
+		float targetError = 0.02f;
+
+		// 1 step で 1 ピクセルに使う上限
+		int maxSamplesPerStep = 8;
+	};
+
+	/*
+	 allocate_adaptive_samples() が配るのに使う, target を超えたピクセルの数と誤差の和.
+	 画像の一部ずつ (タイルごとなど) に持って merge() すれば, 全ピクセルを読み直さずに済む
+	*/
+	struct AdaptiveErrorSum {
+		int active = 0;
+		double sum = 0.0;
+
+		void add(float e, float target) {
+			if (target < e) {
+				active++;
+				// inf は上限まで
+				sum += std::min(e, 1.0e6f);
+			}
+		}
+		void merge(const AdaptiveErrorSum &other) {
+			active += other.active;
+			sum += other.sum;
+		}
+	};
+
+	// 誤差 e のピクセル 1 つ分. total は全ピクセルの AdaptiveErrorSum
+	inline int adaptive_sample_count(float e, float target, int budget, int maxPerPixel, const AdaptiveErrorSum &total) {
+		if (e <= target) {
+			return 0;
+		}
+		double share = budget * (double)std::min(e, 1.0e6f) / total.sum;
+		return glm::clamp((int)std::round(share), 1, std::min(maxPerPixel, 255));
+	}
+
+	/*
+	 target 以下のピクセルは 0, それ以外には誤差に比例して budget を配る (1 以上 maxPerPixel 以下).
+	 戻り値はまだ止まっていないピクセルの数
+	*/
+	inline int allocate_adaptive_samples(const std::vector<float> &errors, float target, int budget, int maxPerPixel, std::vector<uint8_t> *counts) {
+		counts->resize(errors.size());
+
+		AdaptiveErrorSum total;
+		for (float e : errors) {
+			total.add(e, target);
+		}
+		for (std::size_t i = 0; i < errors.size(); ++i) {
+			(*counts)[i] = (uint8_t)adaptive_sample_count(errors[i], target, budget, maxPerPixel, total);
+		}
+		return total.active;
+	}
+}
\ No newline at end of file
@@ -2,6 +2,9 @@
 #include <tbb/tbb.h>
 #include <vector>
 #include <stack>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
 #include "assertion.hpp"
 
 namespace rt {
@@ -133,4 +136,250 @@ namespace rt {
 		std::vector<Real> probs;
 		std::vector<Bucket> buckets;
 	};
+
+	/*
+	 Alias table with 8 byte buckets (float threshold + uint32 alias) and no probs.
+	 the index is chosen by multiply-shift instead of modulo, a full bucket aliases itself so sample() has no branch on it.
+
+	 the construction is the sweep of lights (h < 1) and heavies (h >= 1) in index order.
+	 with prefix sums of the light deficits and the heavy surpluses, the sweep is a merge of two sorted sequences
+	 and each output depends only on its merge position, so chunks of the merge are built in parallel (merge path).
+	 "Parallel Weighted Random Sampling", Hubschle-Schneider and Sanders
+	*/
+	class CompactAliasMethod {
+	public:
+		struct Bucket {
+			float threshold = 1.0f;
+			uint32_t alias = 0;
+		};
+		static_assert(sizeof(Bucket) == 8, "Bucket must be 8 bytes");
+
+		template <class Real>
+		void prepare(const std::vector<Real> &weights) {
+			prepare(weights.data(), (int)weights.size());
+		}
+
+		template <class Real>
+		void prepare(const Real *weights, int N) {
+			RT_ASSERT(0 < N);
+			buckets.resize(N);
+
+			int blocks = (N + kBlock - 1) / kBlock;
+			auto block_range = [N](int block, int *beg, int *end) {
+				*beg = block * kBlock;
+				*end = std::min(*beg + kBlock, N);
+			};
+
+			// sum
+			std::vector<double> block_sums(blocks);
+			tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int> &range) {
+				for (int block = range.begin(); block < range.end(); ++block) {
+					int beg, end;
+					block_range(block, &beg, &end);
+					Kahan<double> sum;
+					for (int i = beg; i < end; ++i) {
+						sum += (double)weights[i];
+					}
+					block_sums[block] = sum;
+				}
+			});
+			Kahan<double> w_sum;
+			for (double s : block_sums) {
+				w_sum += s;
+			}
+			RT_ASSERT(0.0 < w_sum.get());
+			double scale = (double)N / w_sum.get();
+			auto height = [weights, scale](uint32_t i) {
+				return (double)weights[i] * scale;
+			};
+
+			// split into lights and heavies keeping the index order
+			std::vector<int> block_lights(blocks + 1);
+			tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int> &range) {
+				for (int block = range.begin(); block < range.end(); ++block) {
+					int beg, end;
+					block_range(block, &beg, &end);
+					int n = 0;
+					for (int i = beg; i < end; ++i) {
+						n += height(i) < 1.0 ? 1 : 0;
+					}
+					block_lights[block + 1] = n;
+				}
+			});
+			for (int block = 0; block < blocks; ++block) {
+				block_lights[block + 1] += block_lights[block];
+			}
+			int nL = block_lights[blocks];
+			int nH = N - nL;
+
+			if (nH == 0) {
+				// every height is 1 within the rounding error
+				tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int> &range) {
+					for (int i = range.begin(); i < range.end(); ++i) {
+						buckets[i].threshold = 1.0f;
+						buckets[i].alias = i;
+					}
+				});
+				return;
+			}
+
+			std::vector<uint32_t> lights(nL);
+			std::vector<uint32_t> heavies(nH);
+			tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int> &range) {
+				for (int block = range.begin(); block < range.end(); ++block) {
+					int beg, end;
+					block_range(block, &beg, &end);
+					int l = block_lights[block];
+					int h = beg - block_lights[block];
+					for (int i = beg; i < end; ++i) {
+						if (height(i) < 1.0) {
+							lights[l++] = i;
+						}
+						else {
+							heavies[h++] = i;
+						}
+					}
+				}
+			});
+
+			// keyL[a] = sum of (1 - h) of lights before a ( exclusive, keyL[nL] is the total )
+			// keyH[b] = sum of (h - 1) of heavies until b ( inclusive )
+			std::vector<double> keyL(nL + 1);
+			std::vector<double> keyH(nH);
+			parallel_prefix_sum(lights, &keyL, true, [&](uint32_t i) { return 1.0 - height(i); });
+			parallel_prefix_sum(heavies, &keyH, false, [&](uint32_t i) { return height(i) - 1.0; });
+
+			// the last heavy takes everything left
+			keyH[nH - 1] = std::numeric_limits<double>::infinity();
+
+			// light a goes before heavy b if keyL[a] <= keyH[b]
+			int M = nL + nH;
+			int chunks = (M + kBlock - 1) / kBlock;
+			tbb::parallel_for(tbb::blocked_range<int>(0, chunks), [&](const tbb::blocked_range<int> &range) {
+				for (int chunk = range.begin(); chunk < range.end(); ++chunk) {
+					int k = chunk * kBlock;
+
+					// merge path: the number of lights in the first k
+					int lo = std::max(0, k - nH);
+					int hi = std::min(k, nL);
+					while (lo < hi) {
+						int mid = (lo + hi + 1) / 2;
+						int b = k - mid;
+						if (nH <= b || keyL[mid - 1] <= keyH[b]) {
+							lo = mid;
+						}
+						else {
+							hi = mid - 1;
+						}
+					}
+					int a = lo;
+					int b = k - a;
+
+					for (int end = std::min(k + kBlock, M); k < end; ++k) {
+						if (a < nL && keyL[a] <= keyH[b]) {
+							// the current heavy fills the light
+							uint32_t i = lights[a++];
+							buckets[i].threshold = (float)height(i);
+							buckets[i].alias = heavies[b];
+						}
+						else {
+							// the heavy is used up, the rest of its bucket comes from the next heavy
+							uint32_t j = heavies[b];
+							if (b + 1 < nH) {
+								double r = 1.0 + keyH[b] - keyL[a];
+								buckets[j].threshold = (float)std::min(std::max(r, 0.0), 1.0);
+								buckets[j].alias = heavies[b + 1];
+							}
+							else {
+								buckets[j].threshold = 1.0f;
+								buckets[j].alias = j;
+							}
+							b++;
+						}
+					}
+				}
+			});
+		}
+
+		int size() const {
+			return (int)buckets.size();
+		}
+
+		// the upper 32 bits of large_u0 select the bucket
+		int sample(uint64_t large_u0, float u1) const {
+			uint32_t index = (uint32_t)(((large_u0 >> 32) * (uint64_t)buckets.size()) >> 32);
+			const Bucket &b = buckets[index];
+			return u1 < b.threshold ? (int)index : (int)b.alias;
+		}
+		// one random number. the lower 24 bits are used for the threshold
+		int sample(uint64_t u) const {
+			return sample(u, (float)(u & 0xFFFFFF) * (1.0f / 16777216.0f));
+		}
+
+		// fills n indices at once. random numbers are generated first so that the bucket fetches can overlap.
+		template <class Random>
+		void sample(Random *random, int *indices, int n) const {
+			constexpr int kBatch = 64;
+			uint64_t bucket_size = buckets.size();
+			uint32_t index[kBatch];
+			float u1[kBatch];
+			for (int beg = 0; beg < n; beg += kBatch) {
+				int m = std::min(kBatch, n - beg);
+				for (int i = 0; i < m; ++i) {
+					uint64_t u = random->uniform_integer();
+					index[i] = (uint32_t)(((u >> 32) * bucket_size) >> 32);
+					u1[i] = (float)(u & 0xFFFFFF) * (1.0f / 16777216.0f);
+				}
+				for (int i = 0; i < m; ++i) {
+					const Bucket &b = buckets[index[i]];
+					indices[beg + i] = u1[i] < b.threshold ? (int)index[i] : (int)b.alias;
+				}
+			}
+		}
+
+		std::vector<Bucket> buckets;
+	private:
+		enum {
+			kBlock = 1 << 14,
+		};
+
+		template <class F>
+		static void parallel_prefix_sum(const std::vector<uint32_t> &items, std::vector<double> *sums, bool exclusive, F value) {
+			int n = (int)items.size();
+			int blocks = (n + kBlock - 1) / kBlock;
+			std::vector<double> block_sums(blocks + 1);
+			tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int> &range) {
+				for (int block = range.begin(); block < range.end(); ++block) {
+					int end = std::min((block + 1) * kBlock, n);
+					double sum = 0.0;
+					for (int i = block * kBlock; i < end; ++i) {
+						sum += value(items[i]);
+					}
+					block_sums[block + 1] = sum;
+				}
+			});
+			for (int block = 0; block < blocks; ++block) {
+				block_sums[block + 1] += block_sums[block];
+			}
+			tbb::parallel_for(tbb::blocked_range<int>(0, blocks), [&](const tbb::blocked_range<int> &range) {
+				for (int block = range.begin(); block < range.end(); ++block) {
+					int end = std::min((block + 1) * kBlock, n);
+					double sum = block_sums[block];
+					for (int i = block * kBlock; i < end; ++i) {
+						if (exclusive) {
+							(*sums)[i] = sum;
+							sum += value(items[i]);
+						}
+						else {
+							sum += value(items[i]);
+							(*sums)[i] = sum;
+						}
+					}
+				}
+			});
+			if (exclusive) {
+				(*sums)[n] = block_sums[blocks];
+			}
+		}
+	};
 }
\ No newline at end of file
@@ -0,0 +1,139 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <tbb/tbb.h>
+#include <glm/glm.hpp>
+
+#include "fast_math.hpp"
+
+namespace rt {
+	enum class DisplayCurve : uint8_t {
+		Gamma22,
+		sRGB,
+	};
+
+	struct DisplayTransformConfig {
+		// EV. 2^exposure 倍
+		float exposure = 0.0f;
+		// x / (1 + x), チャンネルごと
+		bool reinhard = false;
+		DisplayCurve curve = DisplayCurve::Gamma22;
+	};
+
+	namespace display_transform_detail {
+		using namespace fast_math_detail;
+
+#if defined(RT_FAST_MATH_AVX2)
+		using Lane = F8;
+#elif defined(RT_FAST_MATH_SSE2)
+		using Lane = F4;
+#else
+		using Lane = F1;
+#endif
+		enum {
+			// LUT は float のビットで引く. 2^-kOctaves から 1 までの各オクターブを 2^kMantissaBits 分割
+			kOctaves = 24,
+			kMantissaBits = 8,
+			kLUTSize = kOctaves << kMantissaBits,
+			kChunk = 64,
+		};
+		// [2^-kOctaves, 1) に入れる
+		constexpr float kLower = 1.0f / (float)(1 << kOctaves);
+		constexpr float kUpper = 0.99999994f;
+
+		// 露出, reinhard, LUT の定義域へのクランプ
+		template <class V>
+		inline void prepare(const float *src, float *dst, int n, float scale, bool reinhard) {
+			int i = 0;
+			for (; i + V::width <= n; i += V::width) {
+				V x = V::load(src + i) * V(scale);
+				if (reinhard) {
+					x = x / (V(1.0f) + x);
+				}
+				vmin(vmax(x, V(kLower)), V(kUpper)).store(dst + i);
+			}
+			for (; i < n; ++i) {
+				F1 x = F1(src[i]) * F1(scale);
+				if (reinhard) {
+					x = x / (F1(1.0f) + x);
+				}
+				vmin(vmax(x, F1(kLower)), F1(kUpper)).store(dst + i);
+			}
+		}
+		inline uint32_t lut_index(float x) {
+			uint32_t bits;
+			memcpy(&bits, &x, sizeof(bits));
+			return (bits >> (23 - kMantissaBits)) - ((uint32_t)(127 - kOctaves) << kMantissaBits);
+		}
+		inline float lut_center(uint32_t index) {
+			// バケツの真ん中
+			uint32_t bits = ((index + ((uint32_t)(127 - kOctaves) << kMantissaBits)) << (23 - kMantissaBits)) | (1u << (22 - kMantissaBits));
+			float x;
+			memcpy(&x, &bits, sizeof(x));
+			return x;
+		}
+	}
+
+	/*
+	 線形の輝度 -> 8bit の表示値.
+	 露出と reinhard は SIMD で, カーブ (pow(x, 1/2.2) や sRGB) は float のビットで引く LUT.
+	 LUT は相対誤差が一定なので暗部も潰れず, pow を直接計算した値とのずれは 1 以内
+	*/
+	class DisplayTransform {
+	public:
+		DisplayTransform(DisplayTransformConfig config = DisplayTransformConfig()) :_config(config), _lut(display_transform_detail::kLUTSize) {
+			using namespace display_transform_detail;
+			for (uint32_t i = 0; i < kLUTSize; ++i) {
+				_lut[i] = quantize(curve(lut_center(i)));
+			}
+		}
+		const DisplayTransformConfig &config() const {
+			return _config;
+		}
+
+		// 露出などをかけた後の値に対する表示カーブ. 0 <= x <= 1
+		float curve(float x) const {
+			switch (_config.curve) {
+			case DisplayCurve::sRGB:
+				return x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+			case DisplayCurve::Gamma22:
+			default:
+				return std::pow(x, 1.0f / 2.2f);
+			}
+		}
+		static uint8_t quantize(float v) {
+			return (uint8_t)glm::clamp(v * 256.0f, 0.0f, 255.99999f);
+		}
+
+		// n 個の float -> n 個の 8bit
+		void apply(const float *src, uint8_t *dst, int n) const {
+			using namespace display_transform_detail;
+			float scale = std::exp2(_config.exposure);
+			float x[kChunk];
+			for (int i = 0; i < n; i += kChunk) {
+				int m = std::min((int)kChunk, n - i);
+				prepare<Lane>(src + i, x, m, scale, _config.reinhard);
+				for (int j = 0; j < m; ++j) {
+					dst[i + j] = _lut[lut_index(x[j])];
+				}
+			}
+		}
+
+		// width * height の RGB. 行ごとに並列
+		void apply(const glm::vec3 *src, int width, int height, uint8_t *dst) const {
+			static_assert(sizeof(glm::vec3) == sizeof(float) * 3, "glm::vec3 must be packed");
+			tbb::parallel_for(tbb::blocked_range<int>(0, height), [&](const tbb::blocked_range<int> &range) {
+				for (int y = range.begin(); y < range.end(); ++y) {
+					std::size_t offset = (std::size_t)y * width;
+					apply(&src[offset].x, dst + offset * 3, width * 3);
+				}
+			});
+		}
+	private:
+		DisplayTransformConfig _config;
+		std::vector<uint8_t> _lut;
+	};
+}
\ No newline at end of file
@@ -3,10 +3,14 @@
 #include <glm/glm.hpp>
 #include "alias_method.hpp"
 #include "assertion.hpp"
+#include "image2d.hpp"
+#include "texture_cache.hpp"
+#include "envmap_table_cache.hpp"
 #include "cube_section.hpp"
 #include "cubic_bezier.hpp"
 #include "linear_transform.hpp"
 #include "lambertian_sampler.hpp"
+#include "fast_math.hpp"
 
 namespace rt {
 	class EnvironmentMap {
@@ -101,8 +105,8 @@ namespace rt {
 		Real z = rd.y;
 		Real x = rd.z;
 		Real y = rd.x;
-		*theta = std::atan2(std::sqrt(x * x + y * y) , z);
-		*phi = std::atan2(y, x);
+		*theta = math::atan2(std::sqrt(x * x + y * y) , z);
+		*phi = math::atan2(y, x);
 		if (*phi < Real(0.0f)) {
 			*phi += glm::two_pi<Real>();
 		}
@@ -136,6 +140,113 @@ namespace rt {
 		return r < 0 ? r + m : r;
 	}
 
+	// the texture coordinate of rd on a latlong envmap, false if rd is degenerated
+	inline bool latlong_uv(const glm::vec3 &rd, float *u, float *v) {
+		float theta;
+		float phi;
+		if (cartesian_to_polar_always_positive(rd, &theta, &phi) == false) {
+			return false;
+		}
+
+		RT_ASSERT(0.0 <= phi && phi <= glm::two_pi<float>());
+
+		// 1.0f - is clockwise order envmap
+		*u = 1.0f - phi / (2.0f * glm::pi<float>());
+
+		// 1.0f - is texture coordinate problem
+		*v = 1.0f - theta / glm::pi<float>();
+		return true;
+	}
+	inline glm::vec3 latlong_radiance(const Image2D &texture, const glm::vec3 &rd) {
+		float u, v;
+		if (latlong_uv(rd, &u, &v) == false) {
+			return glm::vec3(0.0);
+		}
+		return texture.sample_repeat(u, v);
+	}
+	inline glm::vec3 latlong_radiance(const TextureCache &textures, int texture, const glm::vec3 &rd) {
+		float u, v;
+		if (latlong_uv(rd, &u, &v) == false) {
+			return glm::vec3(0.0);
+		}
+		return textures.sample_repeat(texture, u, v);
+	}
+
+	/*
+	Equal-Area Octahedral Mapping (y up)
+	"Fast Equal-Area Mapping of the (Hemi)Sphere using SIMD", Petrik Clarberg
+
+	(u, v) = [-1, 1]^2
+	the center of the square is +y, the corners are -y.
+	every region of the square covers a solid angle proportional to its area,
+	so each texel of a N x N octahedral map covers exactly 4π / (N * N) [sr]
+	*/
+	template <class Real>
+	glm::tvec3<Real> equal_area_octahedral_to_sphere(Real u, Real v) {
+		Real abs_u = std::abs(u);
+		Real abs_v = std::abs(v);
+		Real signed_distance = Real(1.0) - (abs_u + abs_v);
+		Real r = Real(1.0) - std::abs(signed_distance);
+		Real phi = (r == Real(0.0) ? Real(1.0) : (abs_v - abs_u) / r + Real(1.0)) * glm::quarter_pi<Real>();
+		Real y = std::copysign(Real(1.0) - r * r, signed_distance);
+		Real r_xz = r * std::sqrt(std::max(Real(2.0) - r * r, Real(0.0)));
+		Real x = std::copysign(std::cos(phi) * r_xz, u);
+		Real z = std::copysign(std::sin(phi) * r_xz, v);
+		return glm::tvec3<Real>(x, y, z);
+	}
+	template <class Real>
+	glm::tvec2<Real> sphere_to_equal_area_octahedral(const glm::tvec3<Real> &d) {
+		Real r = std::sqrt(std::max(Real(1.0) - std::abs(d.y), Real(0.0)));
+
+		// 0 ~ 1 on the first quadrant
+		Real phi = std::atan2(std::abs(d.z), std::abs(d.x)) * glm::two_over_pi<Real>();
+		Real v = phi * r;
+		Real u = r - v;
+		if (d.y < Real(0.0)) {
+			Real u_upper = u;
+			u = Real(1.0) - v;
+			v = Real(1.0) - u_upper;
+		}
+		return glm::tvec2<Real>(std::copysign(u, d.x), std::copysign(v, d.z));
+	}
+
+	enum class EnvmapLayout {
+		LatLong,
+		EqualAreaOctahedral,
+	};
+
+	// keeps the texel count of the lat-long image
+	inline int equal_area_octahedral_resolution(const Image2D &latlong) {
+		double texels = (double)latlong.width() * latlong.height();
+		return std::max((int)std::ceil(std::sqrt(texels)), 1);
+	}
+
+	// resample a lat-long image into a size x size equal-area octahedral image of the same texel format
+	inline std::shared_ptr<Image2D> resample_equal_area_octahedral(const Image2D &latlong, int size) {
+		auto octahedral = std::shared_ptr<Image2D>(new Image2D());
+		octahedral->resize(size, size, latlong.format());
+
+		// 2x2 stratified supersampling per texel
+		constexpr int kSS = 2;
+		tbb::parallel_for(tbb::blocked_range<int>(0, size), [&](const tbb::blocked_range<int> &range) {
+			for (int y = range.begin(); y < range.end(); ++y) {
+				for (int x = 0; x < size; ++x) {
+					glm::vec4 sum(0.0f);
+					for (int sy = 0; sy < kSS; ++sy) {
+						for (int sx = 0; sx < kSS; ++sx) {
+							float u = (x + (sx + 0.5f) / kSS) / size * 2.0f - 1.0f;
+							float v = (y + (sy + 0.5f) / kSS) / size * 2.0f - 1.0f;
+							glm::vec3 rd = equal_area_octahedral_to_sphere(u, v);
+							sum += glm::vec4(latlong_radiance(latlong, rd), 1.0f);
+						}
+					}
+					octahedral->set_texel(x, y, sum / float(kSS * kSS));
+				}
+			}
+		});
+		return octahedral;
+	}
+
 	class IDirectionWeight {
 	public:
 		virtual ~IDirectionWeight() {}
@@ -148,6 +259,85 @@ namespace rt {
 		}
 	};
 
+	/*
+	 Importance of the envmap on a grid that can be coarser than the texture.
+	 power is ∫Y dω of each cell, summed directly from the full resolution texels.
+	 the sampling tables are made from this grid only, so their memory and build time
+	 scale with the importance resolution, not with the image.
+	*/
+	struct EnvmapImportance {
+		int width = 0;
+		int height = 0;
+		std::vector<double> power;
+	};
+
+	// texel_solid_angle(y) is the solid angle of a texel on the row y of the texture
+	// Texture is Image2D or TextureCacheLevel
+	template <class Texture, class TexelSolidAngle>
+	inline std::vector<double> reduce_importance(const Texture &texture, int w, int h, TexelSolidAngle texel_solid_angle) {
+		int W = texture.width();
+		int H = texture.height();
+		RT_ASSERT(0 < w && w <= W);
+		RT_ASSERT(0 < h && h <= H);
+
+		// the first fine index of a coarse cell ( floor(fine * coarse / fine_n) == cell )
+		auto first_fine = [](int cell, int coarse_n, int fine_n) {
+			return (int)(((int64_t)cell * fine_n + coarse_n - 1) / coarse_n);
+		};
+
+		std::vector<double> power(w * h);
+		tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int> &range) {
+			for (int cy = range.begin(); cy < range.end(); ++cy) {
+				double *row_power = power.data() + cy * w;
+				for (int y = first_fine(cy, h, H), end_y = first_fine(cy + 1, h, H); y < end_y; ++y) {
+					double sr = texel_solid_angle(y);
+					for (int x = 0; x < W; ++x) {
+						int cx = (int)((int64_t)x * w / W);
+						glm::vec4 radiance = texture.texel(x, y);
+						float Y = 0.2126f * radiance.x + 0.7152f * radiance.y + 0.0722f * radiance.z;
+						row_power[cx] += Y * sr;
+					}
+				}
+			}
+		});
+		return power;
+	}
+
+	// importance_width <= 0 means the texture resolution
+	template <class Texture>
+	inline EnvmapImportance latlong_importance(const Texture &texture, int importance_width) {
+		int W = texture.width();
+		int H = texture.height();
+
+		EnvmapImportance importance;
+		importance.width = importance_width <= 0 ? W : glm::clamp(importance_width, 1, W);
+		importance.height = glm::clamp((int)std::lround((double)importance.width * H / W), 1, H);
+
+		EnvmapCoordinateSystem<double> envCoord(W, H);
+		importance.power = reduce_importance(texture, importance.width, importance.height, [&](int y) {
+			double beg_theta, end_theta;
+			envCoord.index_to_theta_range(y, &beg_theta, &end_theta);
+			return solid_angle_sliced_sphere(beg_theta, end_theta) / W;
+		});
+		return importance;
+	}
+
+	// importance_size <= 0 means the texture resolution
+	inline EnvmapImportance octahedral_importance(const Image2D &texture, int importance_size) {
+		int N = texture.width();
+		RT_ASSERT(texture.width() == texture.height());
+
+		EnvmapImportance importance;
+		importance.width = importance_size <= 0 ? N : glm::clamp(importance_size, 1, N);
+		importance.height = importance.width;
+
+		double sr = 4.0 * glm::pi<double>() / ((double)N * N);
+		importance.power = reduce_importance(texture, importance.width, importance.height, [sr](int y) {
+			return sr;
+		});
+		return importance;
+	}
+
 	class ImageEnvmap : public EnvironmentMap {
 	public:
 		struct EnvmapFragment {
@@ -157,22 +347,40 @@ namespace rt {
 			double end_phi = 0.0;
 		};
 
-		ImageEnvmap(std::shared_ptr<Image2D> texture, const IDirectionWeight &direction_weight) {
-			_texture = texture;
+		ImageEnvmap(std::shared_ptr<Image2D> texture, const IDirectionWeight &direction_weight)
+			:ImageEnvmap(texture, build_table(latlong_importance(*texture, 0), direction_weight)) {
+		}
+
+		// the pdf is defined on the importance grid, the radiance is fetched from the full resolution texture.
+		ImageEnvmap(std::shared_ptr<Image2D> texture, const EnvmapImportance &importance, const IDirectionWeight &direction_weight)
+			:ImageEnvmap(texture, build_table(importance, direction_weight)) {
+		}
 
-			EnvmapCoordinateSystem<double> envCoord(_texture->width(), _texture->height());
+		// radiance is fetched through textures, the texture doesn't have to be resident.
+		ImageEnvmap(std::shared_ptr<const TextureCache> textures, int texture, EnvmapSamplingTable table)
+			:ImageEnvmap(std::shared_ptr<Image2D>(), std::move(table)) {
+			_textures = textures;
+			_textureIndex = texture;
+		}
+
+		// table is made by build_table() or loaded from EnvmapTableCache
+		ImageEnvmap(std::shared_ptr<Image2D> texture, EnvmapSamplingTable table) {
+			_texture = texture;
+			_table = std::move(table);
+			_width = _table.width;
+			_height = _table.height;
 
-			const Image2D &image = *_texture;
+			EnvmapCoordinateSystem<double> envCoord(_width, _height);
 
 			// Setup Fragments
-			_fragments.resize(image.width() * image.height());
+			_fragments.resize(_width * _height);
 
-			for (int y = 0; y < image.height(); ++y) {
+			for (int y = 0; y < _height; ++y) {
 				double beg_theta, end_theta;
 				envCoord.index_to_theta_range(y, &beg_theta, &end_theta);
 				double beg_y = std::cos(end_theta);
 				double end_y = std::cos(beg_theta);
-				for (int x = 0; x < image.width(); ++x) {
+				for (int x = 0; x < _width; ++x) {
 					double beg_phi;
 					double end_phi;
 					envCoord.index_to_phi_range(x, &beg_phi, &end_phi);
@@ -181,81 +389,70 @@ namespace rt {
 					fragment.end_y = end_y;
 					fragment.beg_phi = beg_phi;
 					fragment.end_phi = end_phi;
-					_fragments[y * image.width() + x] = fragment;
+					_fragments[y * _width + x] = fragment;
 				}
 			}
 
-			// Compute SolidAngle
-			std::vector<double> fragment_solid_angles(image.height());
-			for (int y = 0; y < image.height(); ++y) {
-				double beg_theta, end_theta;
-				envCoord.index_to_theta_range(y, &beg_theta, &end_theta);
-				fragment_solid_angles[y] = solid_angle_sliced_sphere(beg_theta, end_theta) / _texture->width();
-			}
+			_envCoordF = std::unique_ptr<EnvmapCoordinateSystem<float>>(new EnvmapCoordinateSystem<float>(_width, _height));
+		}
+
+		static EnvmapSamplingTable build_table(const EnvmapImportance &importance, const IDirectionWeight &direction_weight) {
+			EnvmapSamplingTable table;
+			table.width = importance.width;
+			table.height = importance.height;
+
+			int w = table.width;
+			int h = table.height;
+			EnvmapCoordinateSystem<double> envCoord(w, h);
 
 			// Selection Weight
-			std::vector<double> weights(image.width() * image.height());
-			for (int y = 0; y < image.height(); ++y) {
-				auto a_fragment = _fragments[y * image.width()];
-				auto sr = fragment_solid_angles[y];
+			std::vector<double> weights(w * h);
+			for (int y = 0; y < h; ++y) {
+				double beg_theta, end_theta;
+				envCoord.index_to_theta_range(y, &beg_theta, &end_theta);
 
-				auto theta = (std::acos(a_fragment.beg_y) + std::acos(a_fragment.end_y)) * 0.5;
-				for (int x = 0; x < image.width(); ++x) {
-					int index = y * image.width() + x;
-					auto fragment = _fragments[index];
-					auto phi = (fragment.beg_phi + fragment.end_phi) * 0.5;
+				auto theta = (beg_theta + end_theta) * 0.5;
+				for (int x = 0; x < w; ++x) {
+					double beg_phi, end_phi;
+					envCoord.index_to_phi_range(x, &beg_phi, &end_phi);
+					auto phi = (beg_phi + end_phi) * 0.5;
 
+					int index = y * w + x;
 					glm::dvec3 direction = polar_to_cartesian(theta, phi);
-					glm::vec4 radiance = image(x, y);
-					float Y = 0.2126f * radiance.x + 0.7152f * radiance.y + 0.0722f * radiance.z;
-					double weight = Y * sr * direction_weight.weight(direction);
-					weights[index] = weight;
+					weights[index] = importance.power[index] * direction_weight.weight(direction);
 				}
 			}
-			_aliasMethod.prepare(weights);
+			table.aliasMethod.prepare(weights);
 
-			// Precomputed PDF
-			_pdf.resize(image.width() * image.height());
-			for (int iy = 0; iy < image.height(); ++iy) {
-				double beg_theta, end_theta;
-				envCoord.index_to_theta_range(iy, &beg_theta, &end_theta);
-				double sr = solid_angle_sliced_sphere(beg_theta, end_theta) / _texture->width();
-				
-				for (int ix = 0; ix < image.width(); ++ix) {
-					int index = iy * image.width() + ix;
-					double p = _aliasMethod.probability(index);
-					_pdf[index] = p * (1.0 / sr);
-				}
+			Kahan<double> w_sum;
+			for (double v : weights) {
+				w_sum += v;
 			}
+			double one_over_weight_sum = 1.0 / w_sum.get();
 
-			_pdf.resize(image.width() * image.height());
-			for (int y = 0; y < image.height(); ++y) {
-				auto sr = fragment_solid_angles[y];
-				for (int x = 0; x < image.width(); ++x) {
-					int index = y * image.width() + x;
-					double p = _aliasMethod.probability(index);
-					_pdf[index] = p * (1.0 / sr);
+			// Precomputed PDF
+			table.pdf.resize(w * h);
+			for (int y = 0; y < h; ++y) {
+				double beg_theta, end_theta;
+				envCoord.index_to_theta_range(y, &beg_theta, &end_theta);
+				double sr = solid_angle_sliced_sphere(beg_theta, end_theta) / w;
+				for (int x = 0; x < w; ++x) {
+					int index = y * w + x;
+					double p = weights[index] * one_over_weight_sum;
+					table.pdf[index] = p * (1.0 / sr);
 				}
 			}
-
-			_envCoordF = std::unique_ptr<EnvmapCoordinateSystem<float>>(new EnvmapCoordinateSystem<float>(_texture->width(), _texture->height()));
+			return table;
+		}
+		const EnvmapSamplingTable &table() const {
+			return _table;
 		}
 
 		virtual glm::vec3 radiance(const glm::vec3 &rd) const override {
-			float theta;
-			float phi;
-			if (cartesian_to_polar_always_positive(rd, &theta, &phi) == false) {
-				return glm::vec3(0.0);
+			if (_textures) {
+				return latlong_radiance(*_textures, _textureIndex, rd);
 			}
-
-			RT_ASSERT(0.0 <= phi && phi <= glm::two_pi<float>());
-
-			// 1.0f - is clockwise order envmap
-			float u = 1.0f - phi / (2.0f * glm::pi<float>());
-			float v = theta / glm::pi<float>();
-
-			// 1.0f - is texture coordinate problem
-			return _texture->sample_repeat(u, 1.0f - v);
+			return latlong_radiance(*_texture, rd);
 		}
 		float pdf(const glm::vec3 &rd, const glm::vec3 &n) const {
 			float theta;
@@ -264,28 +461,128 @@ namespace rt {
 				return 0.0f;
 			}
 
-			int ix = _envCoordF->phi_to_x(phi);
-			int iy = _envCoordF->theta_to_y(theta);
-			return _pdf[iy * _texture->width() + ix];
+			int ix = glm::clamp(_envCoordF->phi_to_x(phi), 0, _width - 1);
+			int iy = glm::clamp(_envCoordF->theta_to_y(theta), 0, _height - 1);
+			return _table.pdf[iy * _width + ix];
 		}
 		virtual glm::vec3 sample(PeseudoRandom *random, const glm::vec3 &n, float *pdf) const override {
-			int index = _aliasMethod.sample(random->uniform_integer(), random->uniform());
+			int index = _table.aliasMethod.sample(random->uniform_integer(), random->uniform());
 			auto fragment = _fragments[index];
 			float y   = glm::mix(fragment.beg_y, fragment.end_y, random->uniform());
 			float phi = glm::mix(fragment.beg_phi, fragment.end_phi, random->uniform());
+			float sinPhi, cosPhi;
+			math::sincos(phi, &sinPhi, &cosPhi);
 			glm::vec3 point_on_cylinder = {
-				std::sin(phi),
+				sinPhi,
 				y,
-				std::cos(phi)
+				cosPhi
 			};
-			*pdf = _pdf[index];
+			*pdf = _table.pdf[index];
 			return project_cylinder_to_sphere(point_on_cylinder);
 		}
+		int _width = 0;
+		int _height = 0;
 		std::unique_ptr<EnvmapCoordinateSystem<float>> _envCoordF;
 		std::shared_ptr<Image2D> _texture;
-		std::vector<double> _pdf;
+		std::shared_ptr<const TextureCache> _textures;
+		int _textureIndex = 0;
 		std::vector<EnvmapFragment> _fragments;
-		AliasMethod<double> _aliasMethod;
+		EnvmapSamplingTable _table;
+	};
+
+	/*
+	 Envmap stored in the equal-area octahedral layout.
+	 radiance() is a few multiplies and one fetch, and every texel has the same solid angle.
+	 the texture must be made by resample_equal_area_octahedral()
+	*/
+	class OctahedralImageEnvmap : public EnvironmentMap {
+	public:
+		OctahedralImageEnvmap(std::shared_ptr<Image2D> texture, const IDirectionWeight &direction_weight)
+			:OctahedralImageEnvmap(texture, build_table(octahedral_importance(*texture, 0), direction_weight)) {
+		}
+		OctahedralImageEnvmap(std::shared_ptr<Image2D> texture, const EnvmapImportance &importance, const IDirectionWeight &direction_weight)
+			:OctahedralImageEnvmap(texture, build_table(importance, direction_weight)) {
+		}
+
+		// table is made by build_table() or loaded from EnvmapTableCache
+		OctahedralImageEnvmap(std::shared_ptr<Image2D> texture, EnvmapSamplingTable table) {
+			RT_ASSERT(texture->width() == texture->height());
+			RT_ASSERT(table.width == table.height);
+			_texture = texture;
+			_table = std::move(table);
+			_size = texture->width();
+			_importanceSize = _table.width;
+		}
+
+		static EnvmapSamplingTable build_table(const EnvmapImportance &importance, const IDirectionWeight &direction_weight) {
+			RT_ASSERT(importance.width == importance.height);
+
+			EnvmapSamplingTable table;
+			table.width = importance.width;
+			table.height = importance.height;
+
+			int n = table.width;
+
+			// Selection Weight
+			std::vector<double> weights(n * n);
+			for (int y = 0; y < n; ++y) {
+				for (int x = 0; x < n; ++x) {
+					int index = y * n + x;
+					double u = (x + 0.5) / n * 2.0 - 1.0;
+					double v = (y + 0.5) / n * 2.0 - 1.0;
+					glm::dvec3 direction = equal_area_octahedral_to_sphere(u, v);
+					weights[index] = importance.power[index] * direction_weight.weight(direction);
+				}
+			}
+			table.aliasMethod.prepare(weights);
+
+			Kahan<double> w_sum;
+			for (double v : weights) {
+				w_sum += v;
+			}
+			double one_over_weight_sum = 1.0 / w_sum.get();
+
+			// Precomputed PDF
+			// solid angles of all cells are the same.
+			double one_over_sr = (double)n * n / (4.0 * glm::pi<double>());
+			table.pdf.resize(n * n);
+			for (int i = 0; i < table.pdf.size(); ++i) {
+				table.pdf[i] = weights[i] * one_over_weight_sum * one_over_sr;
+			}
+			return table;
+		}
+		const EnvmapSamplingTable &table() const {
+			return _table;
+		}
+
+		virtual glm::vec3 radiance(const glm::vec3 &rd) const override {
+			return _texture->texel(to_index(rd, _size));
+		}
+		float pdf(const glm::vec3 &rd, const glm::vec3 &n) const override {
+			return _table.pdf[to_index(rd, _importanceSize)];
+		}
+		virtual glm::vec3 sample(PeseudoRandom *random, const glm::vec3 &n, float *pdf) const override {
+			int index = _table.aliasMethod.sample(random->uniform_integer(), random->uniform());
+			int x = index % _importanceSize;
+			int y = index / _importanceSize;
+			float u = (x + random->uniform()) / _importanceSize * 2.0f - 1.0f;
+			float v = (y + random->uniform()) / _importanceSize * 2.0f - 1.0f;
+			*pdf = _table.pdf[index];
+			return equal_area_octahedral_to_sphere(u, v);
+		}
+	private:
+		static int to_index(const glm::vec3 &rd, int size) {
+			glm::vec2 uv = sphere_to_equal_area_octahedral(rd);
+			int x = (int)((uv.x * 0.5f + 0.5f) * size);
+			int y = (int)((uv.y * 0.5f + 0.5f) * size);
+			x = glm::clamp(x, 0, size - 1);
+			y = glm::clamp(y, 0, size - 1);
+			return y * size + x;
+		}
+		int _size = 0;
+		int _importanceSize = 0;
+		std::shared_ptr<Image2D> _texture;
+		EnvmapSamplingTable _table;
 	};
 
 	class SixAxisDirectionWeight : public IDirectionWeight {
@@ -312,13 +609,63 @@ namespace rt {
 	};
 	class SixAxisImageEnvmap : public EnvironmentMap {
 	public:
-		SixAxisImageEnvmap(std::shared_ptr<Image2D> texture) {
-			_cubeEnvmap[0] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_XPlus )));
-			_cubeEnvmap[1] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_XMinus)));
-			_cubeEnvmap[2] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_YPlus )));
-			_cubeEnvmap[3] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_YMinus)));
-			_cubeEnvmap[4] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_ZPlus )));
-			_cubeEnvmap[5] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, SixAxisDirectionWeight(CubeSection_ZMinus)));
+		// importance_resolution is the width of the grid for the sampling tables, <= 0 means the texture resolution.
+		/*
+		 cache: if not null, the sampling tables are loaded from / stored to the disk.
+		 the importance grid is only computed when some table is missing.
+		*/
+		SixAxisImageEnvmap(std::shared_ptr<Image2D> texture, EnvmapLayout layout = EnvmapLayout::LatLong, int importance_resolution = 0, const EnvmapTableCache *cache = nullptr) {
+			bool octahedral = layout == EnvmapLayout::EqualAreaOctahedral;
+
+			std::shared_ptr<Image2D> envTexture = texture;
+			if (octahedral) {
+				envTexture = resample_equal_area_octahedral(*texture, equal_area_octahedral_resolution(*texture));
+			}
+
+			std::unique_ptr<EnvmapImportance> importance;
+			for (int i = 0; i < 6; ++i) {
+				char key[64];
+				snprintf(key, sizeof(key), "%s/%d/%d/%d/axis%d", octahedral ? "octahedral" : "latlong", (int)texture->format(), envTexture->width(), importance_resolution, i);
+
+				EnvmapSamplingTable table = load_table(cache, key, i, octahedral, [&]() -> const EnvmapImportance & {
+					if (!importance) {
+						importance = std::unique_ptr<EnvmapImportance>(new EnvmapImportance(
+							octahedral ? octahedral_importance(*envTexture, importance_resolution) : latlong_importance(*envTexture, importance_resolution)
+						));
+					}
+					return *importance;
+				});
+
+				if (octahedral) {
+					_cubeEnvmap[i] = std::shared_ptr<OctahedralImageEnvmap>(new OctahedralImageEnvmap(envTexture, std::move(table)));
+				}
+				else {
+					_cubeEnvmap[i] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(envTexture, std::move(table)));
+				}
+			}
+		}
+		/*
+		 latlong envmap whose radiance is fetched through textures, so the texture is not kept resident.
+		 the tables are the same as the ones of the resident texture, the texels are only walked when some table is missing.
+		*/
+		SixAxisImageEnvmap(std::shared_ptr<const TextureCache> textures, int texture, int importance_resolution = 0, const EnvmapTableCache *cache = nullptr) {
+			const ITileSource &source = textures->source(texture);
+
+			std::unique_ptr<EnvmapImportance> importance;
+			for (int i = 0; i < 6; ++i) {
+				char key[64];
+				snprintf(key, sizeof(key), "latlong/%d/%d/%d/axis%d", (int)source.format(), source.width(), importance_resolution, i);
+
+				EnvmapSamplingTable table = load_table(cache, key, i, false, [&]() -> const EnvmapImportance & {
+					if (!importance) {
+						importance = std::unique_ptr<EnvmapImportance>(new EnvmapImportance(
+							latlong_importance(TextureCacheLevel(*textures, texture), importance_resolution)
+						));
+					}
+					return *importance;
+				});
+				_cubeEnvmap[i] = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(textures, texture, std::move(table)));
+			}
 		}
 		virtual glm::vec3 radiance(const glm::vec3 &rd) const override {
 			return _cubeEnvmap[0]->radiance(rd);
@@ -373,6 +720,25 @@ namespace rt {
 			// return _cubeEnvmap[cube_section(n)]->sample(random, n);
 		}
 	private:
-		std::shared_ptr<ImageEnvmap> _cubeEnvmap[6];
+		// importance() is called only when the table of the axis is not in the cache
+		template <class Importance>
+		static EnvmapSamplingTable load_table(const EnvmapTableCache *cache, const char *key, int axis, bool octahedral, Importance importance) {
+			static const CubeSection sections[6] = {
+				CubeSection_XPlus, CubeSection_XMinus,
+				CubeSection_YPlus, CubeSection_YMinus,
+				CubeSection_ZPlus, CubeSection_ZMinus,
+			};
+			EnvmapSamplingTable table;
+			if (cache == nullptr || cache->load(key, &table) == false) {
+				SixAxisDirectionWeight weight(sections[axis]);
+				table = octahedral ? OctahedralImageEnvmap::build_table(importance(), weight) : ImageEnvmap::build_table(importance(), weight);
+				if (cache) {
+					cache->store(key, table);
+				}
+			}
+			return table;
+		}
+
+		std::shared_ptr<EnvironmentMap> _cubeEnvmap[6];
 	};
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+﻿#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "alias_method.hpp"
+#include "mapped_file.hpp"
+
+namespace rt {
+	// everything that importance sampling of an envmap needs, on a width x height grid
+	struct EnvmapSamplingTable {
+		int width = 0;
+		int height = 0;
+		CompactAliasMethod aliasMethod;
+		std::vector<double> pdf;
+	};
+
+	/*
+	 Binary cache of EnvmapSamplingTable next to the texture: "<texture>.<hash>.envtable"
+	 the key is made of the texture path, its mtime and size, and the table parameters given by the caller.
+	 the full key is stored in the file, so a hash collision or a stale file is just a miss.
+	*/
+	class EnvmapTableCache {
+	public:
+		enum {
+			kVersion = 2,
+		};
+
+		EnvmapTableCache(std::filesystem::path texture_path) :_texturePath(texture_path) {
+			std::string identity = file_identity(texture_path);
+			if (identity.empty()) {
+				return;
+			}
+			std::ostringstream s;
+			s << identity
+				<< "|" << (int)kVersion
+				<< "|" << sizeof(CompactAliasMethod::Bucket);
+			_textureKey = s.str();
+		}
+
+		bool enabled() const {
+			return _textureKey.empty() == false;
+		}
+
+		// if succeeded return true
+		bool load(const std::string &table_key, EnvmapSamplingTable *table) const {
+			if (enabled() == false) {
+				return false;
+			}
+			std::string key = _textureKey + "|" + table_key;
+
+			MappedFile file;
+			if (file.open(path_for(key)) == false) {
+				return false;
+			}
+
+			const uint8_t *p = file.data();
+			const uint8_t *end = file.data() + file.size();
+			Header header;
+			if ((std::size_t)(end - p) < sizeof(Header)) {
+				return false;
+			}
+			memcpy(&header, p, sizeof(Header));
+			p += sizeof(Header);
+
+			if (memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kVersion) {
+				return false;
+			}
+			uint64_t N = (uint64_t)header.width * header.height;
+			uint64_t expected = sizeof(Header) + padded(header.keyBytes)
+				+ N * (sizeof(CompactAliasMethod::Bucket) + sizeof(double));
+			if (header.entries != N || file.size() != expected) {
+				return false;
+			}
+			if (header.keyBytes != key.size() || memcmp(p, key.data(), key.size()) != 0) {
+				return false;
+			}
+			p += padded(header.keyBytes);
+
+			table->width = header.width;
+			table->height = header.height;
+			table->aliasMethod.buckets.resize(N);
+			table->pdf.resize(N);
+
+			auto read = [&p](void *dst, std::size_t bytes) {
+				memcpy(dst, p, bytes);
+				p += bytes;
+			};
+			read(table->aliasMethod.buckets.data(), N * sizeof(CompactAliasMethod::Bucket));
+			read(table->pdf.data(), N * sizeof(double));
+			RT_ASSERT(p == end);
+			return true;
+		}
+
+		void store(const std::string &table_key, const EnvmapSamplingTable &table) const {
+			if (enabled() == false) {
+				return;
+			}
+			std::string key = _textureKey + "|" + table_key;
+
+			uint64_t N = (uint64_t)table.width * table.height;
+			RT_ASSERT(table.aliasMethod.buckets.size() == N);
+			RT_ASSERT(table.pdf.size() == N);
+
+			Header header;
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.version = kVersion;
+			header.keyBytes = (uint32_t)key.size();
+			header.width = table.width;
+			header.height = table.height;
+			header.entries = N;
+
+			bool ok = write_file_atomic(path_for(key), [&](FILE *fp) {
+				const char zeros[8] = {};
+				bool ok = true;
+				ok = ok && fwrite(&header, sizeof(Header), 1, fp) == 1;
+				ok = ok && fwrite(key.data(), 1, key.size(), fp) == key.size();
+				ok = ok && fwrite(zeros, 1, padded(header.keyBytes) - key.size(), fp) == padded(header.keyBytes) - key.size();
+				ok = ok && fwrite(table.aliasMethod.buckets.data(), sizeof(CompactAliasMethod::Bucket), N, fp) == N;
+				ok = ok && fwrite(table.pdf.data(), sizeof(double), N, fp) == N;
+				return ok;
+			});
+			if (ok == false) {
+				printf("failed to write envmap table cache for %s\n", _texturePath.string().c_str());
+			}
+		}
+	private:
+		static constexpr char kMagic[8] = { 'R', 'T', 'E', 'N', 'V', 'T', 'B', 'L' };
+		struct Header {
+			char magic[8];
+			uint32_t version = 0;
+			uint32_t keyBytes = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			uint64_t entries = 0;
+		};
+		static std::size_t padded(std::size_t bytes) {
+			return (bytes + 7) & ~std::size_t(7);
+		}
+
+		// FNV-1a
+		std::filesystem::path path_for(const std::string &key) const {
+			uint64_t h = 14695981039346656037ull;
+			for (char c : key) {
+				h ^= (uint8_t)c;
+				h *= 1099511628211ull;
+			}
+			char name[32];
+			snprintf(name, sizeof(name), ".%016llx.envtable", (unsigned long long)h);
+			std::filesystem::path path = _texturePath;
+			path += name;
+			return path;
+		}
+
+		std::filesystem::path _texturePath;
+		std::string _textureKey;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,119 @@
+﻿#pragma once
+
+#include <atomic>
+#include <memory>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "assertion.hpp"
+#include "envmap.hpp"
+
+namespace rt {
+	/*
+	 A world space grid over the scene bounds that learns online how often the sky is visible
+	 from each cell for each direction bin.
+	 the direction bins are the cells of an equal-area octahedral map, so every bin covers the same solid angle.
+	*/
+	class EnvmapVisibilityCache {
+	public:
+		enum {
+			kDirectionResolution = 8,
+			kDirectionBins = kDirectionResolution * kDirectionResolution,
+		};
+
+		EnvmapVisibilityCache(const EnvironmentMap *envmap, glm::vec3 lower, glm::vec3 upper, int resolution)
+			:_lower(lower), _upper(upper), _resolution(resolution) {
+			RT_ASSERT(0 < resolution);
+
+			glm::vec3 size = glm::max(upper - lower, glm::vec3(1.0e-6f));
+			_toCell = glm::vec3((float)resolution) / size;
+
+			int counters = resolution * resolution * resolution * kDirectionBins;
+			_visible = std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[counters]());
+			_total = std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[counters]());
+
+			// ∫Y dω of each bin, doesn't depend on the position.
+			constexpr int kSS = 16;
+			double sr = 4.0 * glm::pi<double>() / ((double)kDirectionBins * kSS * kSS);
+			for (int bin = 0; bin < kDirectionBins; ++bin) {
+				double power = 0.0;
+				for (int sy = 0; sy < kSS; ++sy) {
+					for (int sx = 0; sx < kSS; ++sx) {
+						glm::vec3 rd = direction_in_bin(bin, (sx + 0.5f) / kSS, (sy + 0.5f) / kSS);
+						glm::vec3 L = envmap->radiance(rd);
+						power += (0.2126f * L.x + 0.7152f * L.y + 0.0722f * L.z) * sr;
+					}
+				}
+				_binPower[bin] = (float)power;
+			}
+		}
+
+		EnvmapVisibilityCache(const EnvmapVisibilityCache &) = delete;
+		void operator=(const EnvmapVisibilityCache &) = delete;
+
+		// -1 if p is outside of the grid
+		int cell_index(const glm::vec3 &p) const {
+			glm::ivec3 c = glm::ivec3(glm::floor((p - _lower) * _toCell));
+			if (glm::any(glm::lessThan(c, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(c, glm::ivec3(_resolution)))) {
+				return -1;
+			}
+			return (c.z * _resolution + c.y) * _resolution + c.x;
+		}
+
+		// a ray from o toward rd has escaped (visible) or hit something
+		void record(const glm::vec3 &o, const glm::vec3 &rd, bool visible) {
+			int cell = cell_index(o);
+			if (cell < 0) {
+				return;
+			}
+			int index = cell * kDirectionBins + direction_bin(rd);
+			if (visible) {
+				_visible[index].fetch_add(1, std::memory_order_relaxed);
+			}
+			_total[index].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// estimated probability that the sky is visible. never zero so that every bin can be sampled.
+		float visibility(int cell, int bin) const {
+			if (cell < 0) {
+				return 1.0f;
+			}
+			int index = cell * kDirectionBins + bin;
+			float visible = (float)_visible[index].load(std::memory_order_relaxed);
+			float total = (float)_total[index].load(std::memory_order_relaxed);
+			return (visible + 1.0f) / (total + 2.0f);
+		}
+
+		float bin_power(int bin) const {
+			return _binPower[bin];
+		}
+
+		static int direction_bin(const glm::vec3 &rd) {
+			glm::vec2 uv = sphere_to_equal_area_octahedral(rd);
+			int x = glm::clamp((int)((uv.x * 0.5f + 0.5f) * kDirectionResolution), 0, kDirectionResolution - 1);
+			int y = glm::clamp((int)((uv.y * 0.5f + 0.5f) * kDirectionResolution), 0, kDirectionResolution - 1);
+			return y * kDirectionResolution + x;
+		}
+
+		// (u, v) = [0, 1)^2 maps uniformly onto the solid angle of the bin
+		static glm::vec3 direction_in_bin(int bin, float u, float v) {
+			int x = bin % kDirectionResolution;
+			int y = bin / kDirectionResolution;
+			float ou = (x + u) / kDirectionResolution * 2.0f - 1.0f;
+			float ov = (y + v) / kDirectionResolution * 2.0f - 1.0f;
+			return equal_area_octahedral_to_sphere(ou, ov);
+		}
+
+		static float bin_solid_angle() {
+			return 4.0f * glm::pi<float>() / kDirectionBins;
+		}
+	private:
+		glm::vec3 _lower;
+		glm::vec3 _upper;
+		glm::vec3 _toCell;
+		int _resolution = 0;
+		float _binPower[kDirectionBins];
+		std::unique_ptr<std::atomic<uint32_t>[]> _visible;
+		std::unique_ptr<std::atomic<uint32_t>[]> _total;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,405 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#include <emmintrin.h>
+#define RT_FAST_MATH_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RT_FAST_MATH_AVX2 1
+#endif
+
+/*
+ RT_FAST_MATH = 1 : rt::math:: functions use the approximations below for float
+ RT_FAST_MATH = 0 : rt::math:: functions are std::
+ double always goes to std::
+*/
+#ifndef RT_FAST_MATH
+#define RT_FAST_MATH 1
+#endif
+
+namespace rt {
+	/*
+	 Fast float transcendental functions, scalar and SSE2 (4 wide) / AVX2 (8 wide).
+	 every width runs the same code (the kernels are templates over the lane type),
+	 range reduction + minimax polynomials after Cephes.
+
+	 error bounds (checked in the unit test)
+	   fast_sincos  |x| <= 8192        abs error <= 1.5e-7
+	   fast_atan2   finite              abs error <= 3.5e-7 rad, the sign of zero is handled like std::atan2
+	   fast_acos    x is clamped to [-1, 1]  abs error <= 3.5e-7 rad
+	   fast_exp     -87.3 <= x <= 88.7  rel error <= 1.5e-7, 0 below and +inf above
+	   fast_log     normal x > 0        abs error <= 1.0e-7 for x in [0.5, 2], rel error <= 1.5e-7 elsewhere
+	                0 -> -inf, x < 0 -> NaN, +inf -> +inf
+	 NaN inputs are not handled.
+	*/
+	namespace fast_math_detail {
+		constexpr float kPi = 3.14159265358979323846f;
+		constexpr float kHalfPi = 1.57079632679489661923f;
+		constexpr float kQuarterPi = 0.78539816339744830962f;
+
+		template <class V>
+		inline void sincos_kernel(V x, V *s, V *c) {
+			// x = q * pi / 2 + r, |r| <= pi / 4. pi / 2 in 3 parts (Cody-Waite)
+			V q = vround(x * V(0.63661977236758134308f));
+			V r = x - q * V(1.5703125f);
+			r = r - q * V(4.8375129699707031e-4f);
+			r = r - q * V(7.5497899548918821e-8f);
+
+			V z = r * r;
+			V sr = r + r * z * (V(-1.6666654611e-1f) + z * (V(8.3321608736e-3f) + z * V(-1.9515295891e-4f)));
+			V cr = V(1.0f) - V(0.5f) * z + z * z * (V(4.166664568298827e-2f) + z * (V(-1.388731625493765e-3f) + z * V(2.443315711809948e-5f)));
+
+			auto swap = bit_test(q, 0);
+			V s0 = select(swap, cr, sr);
+			V c0 = select(swap, sr, cr);
+			*s = select(bit_test(q, 1), -s0, s0);
+			*c = select(bit_test(q + V(1.0f), 1), -c0, c0);
+		}
+
+		template <class V>
+		inline V atan2_kernel(V y, V x) {
+			V ax = vabs(x);
+			V ay = vabs(y);
+			V mx = vmax(ax, ay);
+			V mn = vmin(ax, ay);
+			V a = select(V(0.0f) < mx, mn / vmax(mx, V(std::numeric_limits<float>::min())), V(0.0f));
+
+			// [0, 1] -> [-tan(pi/8), tan(pi/8)]
+			auto big = V(0.41421356237309504880f) < a;
+			V t = select(big, (a - V(1.0f)) / (a + V(1.0f)), a);
+			V z = t * t;
+			V r = (((V(8.05374449538e-2f) * z - V(1.38776856032e-1f)) * z + V(1.99777106478e-1f)) * z - V(3.33329491539e-1f)) * z * t + t;
+			r = r + select(big, V(kQuarterPi), V(0.0f));
+
+			r = select(ax < ay, V(kHalfPi) - r, r);
+			r = select(x < V(0.0f), V(kPi) - r, r);
+			// x is -0.0
+			r = select(is_negative_zero(x), V(kPi), r);
+			return vcopysign(r, y);
+		}
+
+		template <class V>
+		inline V acos_kernel(V x) {
+			x = vmin(vmax(x, V(-1.0f)), V(1.0f));
+			V ax = vabs(x);
+
+			// asin(s) on [0, 0.5]
+			auto big = V(0.5f) < ax;
+			V z = select(big, V(0.5f) * (V(1.0f) - ax), ax * ax);
+			V s = select(big, vsqrt(z), ax);
+			V p = ((((V(4.2163199048e-2f) * z + V(2.4181311049e-2f)) * z + V(4.5470025998e-2f)) * z + V(7.4953002686e-2f)) * z + V(1.6666752422e-1f)) * z * s + s;
+
+			// acos(|x|)
+			V r = select(big, p + p, V(kHalfPi) - p);
+			return select(x < V(0.0f), V(kPi) - r, r);
+		}
+
+		template <class V>
+		inline V exp_kernel(V x) {
+			V xc = vmin(vmax(x, V(-87.33654f)), V(88.72283f));
+
+			// x = n * ln2 + r
+			V n = vround(xc * V(1.44269504088896341f));
+			V r = xc - n * V(0.693359375f);
+			r = r - n * V(-2.12194440e-4f);
+
+			V p = ((((V(1.9875691500e-4f) * r + V(1.3981999507e-3f)) * r + V(8.3334519073e-3f)) * r + V(4.1665795894e-2f)) * r + V(1.6666665459e-1f)) * r + V(5.0000001201e-1f);
+			V y = p * r * r + r + V(1.0f);
+
+			// n can be 128
+			auto over = V(127.0f) < n;
+			y = y * pow2i(vmin(n, V(127.0f))) * select(over, V(2.0f), V(1.0f));
+
+			y = select(x < V(-87.33654f), V(0.0f), y);
+			y = select(V(88.72283f) < x, V(std::numeric_limits<float>::infinity()), y);
+			return y;
+		}
+
+		template <class V>
+		inline V log_kernel(V x) {
+			// x = m * 2^e, m = [0.5, 1)
+			V e;
+			V m = decompose(x, &e);
+
+			auto small = m < V(0.70710678118654752440f);
+			e = e - select(small, V(1.0f), V(0.0f));
+			m = select(small, m + m - V(1.0f), m - V(1.0f));
+
+			V z = m * m;
+			V p = V(7.0376836292e-2f);
+			p = p * m + V(-1.1514610310e-1f);
+			p = p * m + V(1.1676998740e-1f);
+			p = p * m + V(-1.2420140846e-1f);
+			p = p * m + V(1.4249322787e-1f);
+			p = p * m + V(-1.6668057665e-1f);
+			p = p * m + V(2.0000714765e-1f);
+			p = p * m + V(-2.4999993993e-1f);
+			p = p * m + V(3.3333331174e-1f);
+
+			V y = p * m * z;
+			y = y + e * V(-2.12194440e-4f);
+			y = y - V(0.5f) * z;
+			V r = m + y + e * V(0.693359375f);
+
+			r = select(x == V(std::numeric_limits<float>::infinity()), x, r);
+			r = select(x == V(0.0f), V(-std::numeric_limits<float>::infinity()), r);
+			r = select(x < V(0.0f), V(std::numeric_limits<float>::quiet_NaN()), r);
+			return r;
+		}
+
+		// scalar lane
+		struct F1 {
+			float v;
+			F1() {}
+			F1(float x) :v(x) {}
+			enum { width = 1 };
+			static F1 load(const float *p) { return *p; }
+			void store(float *p) const { *p = v; }
+		};
+		inline F1 operator+(F1 a, F1 b) { return a.v + b.v; }
+		inline F1 operator-(F1 a, F1 b) { return a.v - b.v; }
+		inline F1 operator*(F1 a, F1 b) { return a.v * b.v; }
+		inline F1 operator/(F1 a, F1 b) { return a.v / b.v; }
+		inline F1 operator-(F1 a) { return -a.v; }
+		inline bool operator<(F1 a, F1 b) { return a.v < b.v; }
+		inline bool operator==(F1 a, F1 b) { return a.v == b.v; }
+		inline F1 select(bool m, F1 a, F1 b) { return m ? a : b; }
+		inline F1 vmin(F1 a, F1 b) { return std::min(a.v, b.v); }
+		inline F1 vmax(F1 a, F1 b) { return std::max(a.v, b.v); }
+		inline F1 vabs(F1 a) { return std::fabs(a.v); }
+		inline F1 vsqrt(F1 a) { return std::sqrt(a.v); }
+		inline F1 vround(F1 a) { return std::floor(a.v + 0.5f); }
+		inline F1 vcopysign(F1 a, F1 b) { return std::copysign(a.v, b.v); }
+		inline bool is_negative_zero(F1 a) { return a.v == 0.0f && std::signbit(a.v); }
+		inline bool bit_test(F1 q, int bit) { return ((int32_t)q.v >> bit) & 1; }
+		inline F1 pow2i(F1 n) {
+			uint32_t bits = (uint32_t)((int32_t)n.v + 127) << 23;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return f;
+		}
+		inline F1 decompose(F1 x, F1 *e) {
+			uint32_t bits;
+			memcpy(&bits, &x.v, sizeof(bits));
+			*e = (float)((int32_t)((bits >> 23) & 0xFF) - 126);
+			bits = (bits & 0x807FFFFFu) | 0x3F000000u;
+			float m;
+			memcpy(&m, &bits, sizeof(m));
+			return m;
+		}
+
+#if defined(RT_FAST_MATH_SSE2)
+		struct F4 {
+			__m128 v;
+			F4() {}
+			F4(__m128 x) :v(x) {}
+			F4(float x) :v(_mm_set1_ps(x)) {}
+			enum { width = 4 };
+			static F4 load(const float *p) { return _mm_loadu_ps(p); }
+			void store(float *p) const { _mm_storeu_ps(p, v); }
+		};
+		struct M4 {
+			__m128 v;
+		};
+		inline F4 operator+(F4 a, F4 b) { return _mm_add_ps(a.v, b.v); }
+		inline F4 operator-(F4 a, F4 b) { return _mm_sub_ps(a.v, b.v); }
+		inline F4 operator*(F4 a, F4 b) { return _mm_mul_ps(a.v, b.v); }
+		inline F4 operator/(F4 a, F4 b) { return _mm_div_ps(a.v, b.v); }
+		inline F4 operator-(F4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+		inline M4 operator<(F4 a, F4 b) { return M4{ _mm_cmplt_ps(a.v, b.v) }; }
+		inline M4 operator==(F4 a, F4 b) { return M4{ _mm_cmpeq_ps(a.v, b.v) }; }
+		inline F4 select(M4 m, F4 a, F4 b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+		inline F4 vmin(F4 a, F4 b) { return _mm_min_ps(a.v, b.v); }
+		inline F4 vmax(F4 a, F4 b) { return _mm_max_ps(a.v, b.v); }
+		inline F4 vabs(F4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+		inline F4 vsqrt(F4 a) { return _mm_sqrt_ps(a.v); }
+		inline F4 vround(F4 a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)); }
+		inline F4 vcopysign(F4 a, F4 b) {
+			__m128 sign = _mm_set1_ps(-0.0f);
+			return _mm_or_ps(_mm_andnot_ps(sign, a.v), _mm_and_ps(sign, b.v));
+		}
+		inline M4 is_negative_zero(F4 a) {
+			return M4{ _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_castps_si128(a.v), _mm_set1_epi32((int)0x80000000u))) };
+		}
+		inline M4 bit_test(F4 q, int bit) {
+			__m128i b = _mm_set1_epi32(1 << bit);
+			__m128i qi = _mm_and_si128(_mm_cvtps_epi32(q.v), b);
+			return M4{ _mm_castsi128_ps(_mm_cmpeq_epi32(qi, b)) };
+		}
+		inline F4 pow2i(F4 n) {
+			__m128i e = _mm_add_epi32(_mm_cvtps_epi32(n.v), _mm_set1_epi32(127));
+			return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+		}
+		inline F4 decompose(F4 x, F4 *e) {
+			__m128i bits = _mm_castps_si128(x.v);
+			__m128i exponent = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xFF)), _mm_set1_epi32(126));
+			*e = _mm_cvtepi32_ps(exponent);
+			bits = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32((int)0x807FFFFFu)), _mm_set1_epi32(0x3F000000));
+			return _mm_castsi128_ps(bits);
+		}
+#endif
+
+#if defined(RT_FAST_MATH_AVX2)
+		struct F8 {
+			__m256 v;
+			F8() {}
+			F8(__m256 x) :v(x) {}
+			F8(float x) :v(_mm256_set1_ps(x)) {}
+			enum { width = 8 };
+			static F8 load(const float *p) { return _mm256_loadu_ps(p); }
+			void store(float *p) const { _mm256_storeu_ps(p, v); }
+		};
+		struct M8 {
+			__m256 v;
+		};
+		inline F8 operator+(F8 a, F8 b) { return _mm256_add_ps(a.v, b.v); }
+		inline F8 operator-(F8 a, F8 b) { return _mm256_sub_ps(a.v, b.v); }
+		inline F8 operator*(F8 a, F8 b) { return _mm256_mul_ps(a.v, b.v); }
+		inline F8 operator/(F8 a, F8 b) { return _mm256_div_ps(a.v, b.v); }
+		inline F8 operator-(F8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+		inline M8 operator<(F8 a, F8 b) { return M8{ _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+		inline M8 operator==(F8 a, F8 b) { return M8{ _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+		inline F8 select(M8 m, F8 a, F8 b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+		inline F8 vmin(F8 a, F8 b) { return _mm256_min_ps(a.v, b.v); }
+		inline F8 vmax(F8 a, F8 b) { return _mm256_max_ps(a.v, b.v); }
+		inline F8 vabs(F8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+		inline F8 vsqrt(F8 a) { return _mm256_sqrt_ps(a.v); }
+		inline F8 vround(F8 a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+		inline F8 vcopysign(F8 a, F8 b) {
+			__m256 sign = _mm256_set1_ps(-0.0f);
+			return _mm256_or_ps(_mm256_andnot_ps(sign, a.v), _mm256_and_ps(sign, b.v));
+		}
+		inline M8 is_negative_zero(F8 a) {
+			return M8{ _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_castps_si256(a.v), _mm256_set1_epi32((int)0x80000000u))) };
+		}
+		inline M8 bit_test(F8 q, int bit) {
+			__m256i b = _mm256_set1_epi32(1 << bit);
+			__m256i qi = _mm256_and_si256(_mm256_cvtps_epi32(q.v), b);
+			return M8{ _mm256_castsi256_ps(_mm256_cmpeq_epi32(qi, b)) };
+		}
+		inline F8 pow2i(F8 n) {
+			__m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n.v), _mm256_set1_epi32(127));
+			return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+		}
+		inline F8 decompose(F8 x, F8 *e) {
+			__m256i bits = _mm256_castps_si256(x.v);
+			__m256i exponent = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xFF)), _mm256_set1_epi32(126));
+			*e = _mm256_cvtepi32_ps(exponent);
+			bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32((int)0x807FFFFFu)), _mm256_set1_epi32(0x3F000000));
+			return _mm256_castsi256_ps(bits);
+		}
+#endif
+	}
+
+	inline void fast_sincos(float x, float *s, float *c) {
+		fast_math_detail::F1 fs, fc;
+		fast_math_detail::sincos_kernel<fast_math_detail::F1>(x, &fs, &fc);
+		*s = fs.v;
+		*c = fc.v;
+	}
+	inline float fast_sin(float x) {
+		float s, c;
+		fast_sincos(x, &s, &c);
+		return s;
+	}
+	inline float fast_cos(float x) {
+		float s, c;
+		fast_sincos(x, &s, &c);
+		return c;
+	}
+	inline float fast_atan2(float y, float x) {
+		return fast_math_detail::atan2_kernel<fast_math_detail::F1>(y, x).v;
+	}
+	inline float fast_atan(float x) {
+		return fast_atan2(x, 1.0f);
+	}
+	inline float fast_acos(float x) {
+		return fast_math_detail::acos_kernel<fast_math_detail::F1>(x).v;
+	}
+	inline float fast_exp(float x) {
+		return fast_math_detail::exp_kernel<fast_math_detail::F1>(x).v;
+	}
+	inline float fast_log(float x) {
+		return fast_math_detail::log_kernel<fast_math_detail::F1>(x).v;
+	}
+
+#if defined(RT_FAST_MATH_SSE2)
+	inline void fast_sincos(__m128 x, __m128 *s, __m128 *c) {
+		fast_math_detail::F4 fs, fc;
+		fast_math_detail::sincos_kernel<fast_math_detail::F4>(x, &fs, &fc);
+		*s = fs.v;
+		*c = fc.v;
+	}
+	inline __m128 fast_atan2(__m128 y, __m128 x) {
+		return fast_math_detail::atan2_kernel<fast_math_detail::F4>(y, x).v;
+	}
+	inline __m128 fast_acos(__m128 x) {
+		return fast_math_detail::acos_kernel<fast_math_detail::F4>(x).v;
+	}
+	inline __m128 fast_exp(__m128 x) {
+		return fast_math_detail::exp_kernel<fast_math_detail::F4>(x).v;
+	}
+	inline __m128 fast_log(__m128 x) {
+		return fast_math_detail::log_kernel<fast_math_detail::F4>(x).v;
+	}
+#endif
+
+#if defined(RT_FAST_MATH_AVX2)
+	inline void fast_sincos(__m256 x, __m256 *s, __m256 *c) {
+		fast_math_detail::F8 fs, fc;
+		fast_math_detail::sincos_kernel<fast_math_detail::F8>(x, &fs, &fc);
+		*s = fs.v;
+		*c = fc.v;
+	}
+	inline __m256 fast_atan2(__m256 y, __m256 x) {
+		return fast_math_detail::atan2_kernel<fast_math_detail::F8>(y, x).v;
+	}
+	inline __m256 fast_acos(__m256 x) {
+		return fast_math_detail::acos_kernel<fast_math_detail::F8>(x).v;
+	}
+	inline __m256 fast_exp(__m256 x) {
+		return fast_math_detail::exp_kernel<fast_math_detail::F8>(x).v;
+	}
+	inline __m256 fast_log(__m256 x) {
+		return fast_math_detail::log_kernel<fast_math_detail::F8>(x).v;
+	}
+#endif
+
+	// the switch. hot paths call these.
+	namespace math {
+#if RT_FAST_MATH
+		inline void sincos(float x, float *s, float *c) { fast_sincos(x, s, c); }
+		inline float sin(float x) { return fast_sin(x); }
+		inline float cos(float x) { return fast_cos(x); }
+		inline float atan2(float y, float x) { return fast_atan2(y, x); }
+		inline float atan(float x) { return fast_atan(x); }
+		inline float acos(float x) { return fast_acos(x); }
+		inline float exp(float x) { return fast_exp(x); }
+		inline float log(float x) { return fast_log(x); }
+#else
+		inline void sincos(float x, float *s, float *c) { *s = std::sin(x); *c = std::cos(x); }
+		inline float sin(float x) { return std::sin(x); }
+		inline float cos(float x) { return std::cos(x); }
+		inline float atan2(float y, float x) { return std::atan2(y, x); }
+		inline float atan(float x) { return std::atan(x); }
+		inline float acos(float x) { return std::acos(x); }
+		inline float exp(float x) { return std::exp(x); }
+		inline float log(float x) { return std::log(x); }
+#endif
+		inline void sincos(double x, double *s, double *c) { *s = std::sin(x); *c = std::cos(x); }
+		inline double sin(double x) { return std::sin(x); }
+		inline double cos(double x) { return std::cos(x); }
+		inline double atan2(double y, double x) { return std::atan2(y, x); }
+		inline double atan(double x) { return std::atan(x); }
+		inline double acos(double x) { return std::acos(x); }
+		inline double exp(double x) { return std::exp(x); }
+		inline double log(double x) { return std::log(x); }
+	}
+}
\ No newline at end of file
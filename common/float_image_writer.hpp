@@ -0,0 +1,342 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <tbb/tbb.h>
+
+#include "mapped_file.hpp"
+
+namespace rt {
+	/*
+	 書き出す 1 層 (beauty, sample count, variance など).
+	 read(x, y, n, dst) は (x, y) から右へ n ピクセル分を, チャンネルを交互に並べて dst に書く.
+	 書き出しはタイルか行ごとに read() を呼ぶだけなので, 画像全体のコピーは作らない
+	*/
+	struct ImageLayer {
+		// 空なら beauty. EXR のチャンネル名は "name.R" のようになる
+		std::string name;
+		std::vector<std::string> channels;
+		std::function<void(int x, int y, int n, float *dst)> read;
+	};
+
+	/*
+	 Portable Float Map. 1 チャンネル ("Pf") か 3 チャンネル ("PF"), little endian.
+	 下の行から書く決まりなので, 1 行ずつ下から read() する
+	*/
+	inline bool write_pfm(const std::filesystem::path &path, int width, int height, const ImageLayer &layer) {
+		int channels = (int)layer.channels.size();
+		if (channels != 1 && channels != 3) {
+			return false;
+		}
+		return write_file_atomic(path, [&](FILE *fp) {
+			bool ok = 0 < fprintf(fp, "%s\n%d %d\n-1.0\n", channels == 3 ? "PF" : "Pf", width, height);
+			std::vector<float> row(width * channels);
+			for (int y = height - 1; 0 <= y && ok; --y) {
+				layer.read(0, y, width, row.data());
+				ok = fwrite(row.data(), sizeof(float), row.size(), fp) == row.size();
+			}
+			return ok;
+		});
+	}
+
+	namespace exr_detail {
+		struct Channel {
+			std::string name;
+			int layer = 0;
+			int component = 0;
+		};
+
+		class HeaderWriter {
+		public:
+			void attribute(const char *name, const char *type, const void *value, int bytes) {
+				append(name, strlen(name) + 1);
+				append(type, strlen(type) + 1);
+				append(&bytes, sizeof(int32_t));
+				append(value, bytes);
+			}
+			void append(const void *p, std::size_t bytes) {
+				const uint8_t *b = (const uint8_t *)p;
+				_bytes.insert(_bytes.end(), b, b + bytes);
+			}
+			const std::vector<uint8_t> &bytes() const {
+				return _bytes;
+			}
+		private:
+			std::vector<uint8_t> _bytes;
+		};
+	}
+
+	/*
+	 タイル分割, 無圧縮, FLOAT の OpenEXR (single part, ONE_LEVEL).
+	 タイルの行ごとに, その行のタイルを並列に read() して詰め, 順に書く. 追加のメモリは width * tileSize ピクセル分.
+	 最後にオフセット表を埋める. 書き込みは write_file_atomic()
+	 https://openexr.com/en/latest/OpenEXRFileLayout.html
+	*/
+	inline bool write_exr(const std::filesystem::path &path, int width, int height, const std::vector<ImageLayer> &layers, int tileSize = 64) {
+		using namespace exr_detail;
+		if (width <= 0 || height <= 0 || tileSize <= 0) {
+			return false;
+		}
+
+		// チャンネルは名前順
+		std::vector<Channel> channels;
+		int componentsPerPixel = 0;
+		std::vector<int> layerOffsets;
+		for (int i = 0; i < layers.size(); ++i) {
+			layerOffsets.push_back(componentsPerPixel);
+			for (int j = 0; j < layers[i].channels.size(); ++j) {
+				Channel c;
+				c.name = layers[i].name.empty() ? layers[i].channels[j] : layers[i].name + "." + layers[i].channels[j];
+				c.layer = i;
+				c.component = j;
+				channels.push_back(c);
+			}
+			componentsPerPixel += (int)layers[i].channels.size();
+		}
+		std::sort(channels.begin(), channels.end(), [](const Channel &a, const Channel &b) {
+			return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+		});
+
+		HeaderWriter header;
+		const uint8_t magic[4] = { 0x76, 0x2f, 0x31, 0x01 };
+		const int32_t version = 2 | 0x200 /* tiled */;
+		header.append(magic, 4);
+		header.append(&version, 4);
+		{
+			HeaderWriter chlist;
+			for (const Channel &c : channels) {
+				const int32_t pixelType = 2; // FLOAT
+				const uint8_t linearAndReserved[4] = {};
+				const int32_t sampling[2] = { 1, 1 };
+				chlist.append(c.name.c_str(), c.name.size() + 1);
+				chlist.append(&pixelType, 4);
+				chlist.append(linearAndReserved, 4);
+				chlist.append(sampling, 8);
+			}
+			chlist.append("", 1);
+			header.attribute("channels", "chlist", chlist.bytes().data(), (int)chlist.bytes().size());
+		}
+		const uint8_t compression = 0; // NO_COMPRESSION
+		header.attribute("compression", "compression", &compression, 1);
+		const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+		header.attribute("dataWindow", "box2i", window, 16);
+		header.attribute("displayWindow", "box2i", window, 16);
+		const uint8_t lineOrder = 0; // INCREASING_Y
+		header.attribute("lineOrder", "lineOrder", &lineOrder, 1);
+		const float pixelAspectRatio = 1.0f;
+		header.attribute("pixelAspectRatio", "float", &pixelAspectRatio, 4);
+		const float screenWindowCenter[2] = { 0.0f, 0.0f };
+		header.attribute("screenWindowCenter", "v2f", screenWindowCenter, 8);
+		const float screenWindowWidth = 1.0f;
+		header.attribute("screenWindowWidth", "float", &screenWindowWidth, 4);
+		{
+			uint8_t tiledesc[9];
+			const uint32_t size[2] = { (uint32_t)tileSize, (uint32_t)tileSize };
+			memcpy(tiledesc, size, 8);
+			tiledesc[8] = 0; // ONE_LEVEL, ROUND_DOWN
+			header.attribute("tiles", "tiledesc", tiledesc, 9);
+		}
+		header.append("", 1);
+
+		int tilesX = (width + tileSize - 1) / tileSize;
+		int tilesY = (height + tileSize - 1) / tileSize;
+
+		return write_file_atomic(path, [&](FILE *fp) {
+			bool ok = fwrite(header.bytes().data(), 1, header.bytes().size(), fp) == header.bytes().size();
+
+			// オフセット表は後で埋める. ftell は Windows で 32bit なので自分で数える
+			uint64_t tableAt = header.bytes().size();
+			std::vector<uint64_t> offsets(tilesX * tilesY);
+			ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), fp) == offsets.size();
+			uint64_t position = tableAt + sizeof(uint64_t) * offsets.size();
+
+			// 1 行分のタイル. [tile header : 5 * int32][scanline ごとに, チャンネルごとに tileWidth 個の float]
+			std::vector<std::vector<uint8_t>> chunks(tilesX);
+			for (int ty = 0; ty < tilesY && ok; ++ty) {
+				tbb::parallel_for(tbb::blocked_range<int>(0, tilesX), [&](const tbb::blocked_range<int> &range) {
+					std::vector<float> pixels;
+					for (int tx = range.begin(); tx < range.end(); ++tx) {
+						int x0 = tx * tileSize;
+						int y0 = ty * tileSize;
+						int w = std::min(tileSize, width - x0);
+						int h = std::min(tileSize, height - y0);
+						int32_t dataSize = w * h * (int)channels.size() * sizeof(float);
+						const int32_t tileHeader[5] = { tx, ty, 0, 0, dataSize };
+
+						std::vector<uint8_t> &chunk = chunks[tx];
+						chunk.resize(sizeof(tileHeader) + dataSize);
+						memcpy(chunk.data(), tileHeader, sizeof(tileHeader));
+						float *dst = (float *)(chunk.data() + sizeof(tileHeader));
+
+						pixels.resize(w * componentsPerPixel);
+						for (int y = y0; y < y0 + h; ++y) {
+							for (int i = 0; i < layers.size(); ++i) {
+								// 層ごとに交互に並んだものを一旦 pixels の該当範囲に
+								layers[i].read(x0, y, w, pixels.data() + layerOffsets[i] * w);
+							}
+							for (const Channel &c : channels) {
+								int n = (int)layers[c.layer].channels.size();
+								const float *src = pixels.data() + layerOffsets[c.layer] * w;
+								for (int x = 0; x < w; ++x) {
+									*dst++ = src[x * n + c.component];
+								}
+							}
+						}
+					}
+				});
+				for (int tx = 0; tx < tilesX && ok; ++tx) {
+					offsets[ty * tilesX + tx] = position;
+					ok = fwrite(chunks[tx].data(), 1, chunks[tx].size(), fp) == chunks[tx].size();
+					position += chunks[tx].size();
+				}
+			}
+
+			ok = ok && fseek(fp, (long)tableAt, SEEK_SET) == 0;
+			ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), fp) == offsets.size();
+			return ok;
+		});
+	}
+
+	/*
+	 ImageLayer を別のスレッドの write_exr() へ stripRows 行ずつ渡す, 上限つきの待ち行列.
+	 読む側のスレッド (レンダースレッドなど) が produce() で source を上から読んで詰め,
+	 書く側は layers() を write_exr(..., tileSize = stripRows) に渡して, 終わったら close() する.
+	 持つのは capacity 帯までで, 満ちると produce() は空くのを待つ. 画像全体のコピーは作らない.
+	 layers() は上の帯から順に読まれる前提なので, 下から読む write_pfm() には使えない
+	*/
+	class LayerStream {
+	public:
+		LayerStream(const std::vector<ImageLayer> &source, int width, int height, int stripRows, int capacity = 4)
+			:_source(source), _width(width), _height(height), _stripRows(stripRows), _capacity(capacity) {
+			for (const ImageLayer &layer : _source) {
+				_layerOffsets.push_back(_componentsPerPixel);
+				_componentsPerPixel += (int)layer.channels.size();
+			}
+		}
+		LayerStream(const LayerStream &) = delete;
+		void operator=(const LayerStream &) = delete;
+
+		/*
+		 読む側のスレッドで. afterStrip(y0, y1) は帯を読み終えるごとに呼ばれる (out-of-core のタイルを戻すなど).
+		 close() された後は読まずに返る
+		*/
+		void produce(const std::function<void(int y0, int y1)> &afterStrip = std::function<void(int, int)>()) {
+			for (int y0 = 0; y0 < _height; y0 += _stripRows) {
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_popped.wait(lock, [&]() { return _closed || _strips.size() < _capacity; });
+					if (_closed) {
+						return;
+					}
+				}
+
+				// 帯の中は [層][行][x * channels + c]
+				int y1 = std::min(y0 + _stripRows, _height);
+				std::vector<float> strip((std::size_t)_width * (y1 - y0) * _componentsPerPixel);
+				tbb::parallel_for(tbb::blocked_range<int>(y0, y1), [&](const tbb::blocked_range<int> &range) {
+					for (int y = range.begin(); y < range.end(); ++y) {
+						for (int i = 0; i < _source.size(); ++i) {
+							_source[i].read(0, y, _width, strip.data() + at(i, y0, y1, y, 0));
+						}
+					}
+				});
+				if (afterStrip) {
+					afterStrip(y0, y1);
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_strips.emplace_back(std::move(strip));
+				}
+				_pushed.notify_all();
+			}
+		}
+
+		// 書く側のスレッドで. source と同じ名前とチャンネル
+		std::vector<ImageLayer> layers() {
+			std::vector<ImageLayer> layers;
+			for (int i = 0; i < _source.size(); ++i) {
+				ImageLayer layer;
+				layer.name = _source[i].name;
+				layer.channels = _source[i].channels;
+				layer.read = [this, i](int x, int y, int n, float *dst) {
+					int y0 = y - y % _stripRows;
+					int y1 = std::min(y0 + _stripRows, _height);
+					const float *strip = acquire(y / _stripRows);
+					int channels = (int)_source[i].channels.size();
+					memcpy(dst, strip + at(i, y0, y1, y, x), sizeof(float) * n * channels);
+				};
+				layers.push_back(layer);
+			}
+			return layers;
+		}
+
+		// 書く側が終えたら, 失敗していても呼ぶこと. 待っている produce() を返す
+		void close() {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_closed = true;
+				_strips.clear();
+			}
+			_popped.notify_all();
+		}
+	private:
+		std::size_t at(int layer, int y0, int y1, int y, int x) const {
+			return (std::size_t)_width * (y1 - y0) * _layerOffsets[layer] + ((std::size_t)(y - y0) * _width + x) * _source[layer].channels.size();
+		}
+
+		/*
+		 index 番目の帯が来るまで待つ. それより前の帯はもう読まれないので捨てる.
+		 deque の要素は push_back() で動かず, 捨てるのは次の帯を読むときだけなので, ロックの外で読んでよい
+		*/
+		const float *acquire(int index) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			bool popped = false;
+			for (;;) {
+				while (_firstStrip < index && _strips.empty() == false) {
+					_strips.pop_front();
+					_firstStrip++;
+					popped = true;
+				}
+				if (_firstStrip == index && _strips.empty() == false) {
+					break;
+				}
+				if (popped) {
+					_popped.notify_all();
+					popped = false;
+				}
+				_pushed.wait(lock);
+			}
+			const float *strip = _strips.front().data();
+			lock.unlock();
+			if (popped) {
+				_popped.notify_all();
+			}
+			return strip;
+		}
+
+		std::vector<ImageLayer> _source;
+		std::vector<int> _layerOffsets;
+		int _componentsPerPixel = 0;
+		int _width = 0;
+		int _height = 0;
+		int _stripRows = 0;
+		std::size_t _capacity = 0;
+
+		std::mutex _mutex;
+		std::condition_variable _pushed;
+		std::condition_variable _popped;
+		std::deque<std::vector<float>> _strips;
+		int _firstStrip = 0;
+		bool _closed = false;
+	};
+}
\ No newline at end of file
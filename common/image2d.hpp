@@ -4,45 +4,108 @@
 #include <vector>
 #include <glm/glm.hpp>
 #include "stb_image.h"
+#include "assertion.hpp"
+#include "texel_format.hpp"
+#include "radiance_hdr.hpp"
 
 namespace rt {
+	/*
+	 texels are stored in one of TexelFormat.
+	 data() / operator() / sample() give references, so they are only for RGBA32F.
+	 texel() / set_texel() work for every format.
+	*/
 	class Image2D {
 	public:
-		void resize(int w, int h) {
+		void resize(int w, int h, TexelFormat format = TexelFormat::RGBA32F) {
 			_width = w;
 			_height = h;
+			_format = format;
 			_values.clear();
-			_values.resize(_width * _height);
+			_rgb16f.clear();
+			_rgbe.clear();
+			_rgb9e5.clear();
+			_values.shrink_to_fit();
+			_rgb16f.shrink_to_fit();
+			_rgbe.shrink_to_fit();
+			_rgb9e5.shrink_to_fit();
+
+			int n = _width * _height;
+			switch (_format) {
+			case TexelFormat::RGBA32F:
+				_values.resize(n);
+				break;
+			case TexelFormat::RGB16F:
+				_rgb16f.resize(n, TexelRGB16F{ 0, 0, 0 });
+				break;
+			case TexelFormat::RGBE:
+				_rgbe.resize(n, TexelRGBE{ 0, 0, 0, 0 });
+				break;
+			case TexelFormat::RGB9E5:
+				_rgb9e5.resize(n, 0u);
+				break;
+			}
 		}
 		// if succeeded return true
-		bool load(const char *filename) {
-			_values.clear();
+		bool load(const char *filename, TexelFormat format = TexelFormat::RGBA32F) {
+			resize(0, 0, format);
+
+			// .hdr is decoded from RGBE scanlines straight into the storage.
+			if (format != TexelFormat::RGBA32F) {
+				bool ok = read_radiance_hdr(filename, [&](int w, int h) {
+					resize(w, h, format);
+				}, [&](int y, const TexelRGBE *row) {
+					int base = y * _width;
+					if (_format == TexelFormat::RGBE) {
+						std::copy(row, row + _width, _rgbe.begin() + base);
+						return;
+					}
+					for (int x = 0; x < _width; ++x) {
+						set_texel(base + x, glm::vec4(decode_rgbe(row[x]), 1.0f));
+					}
+				});
+				if (ok) {
+					return true;
+				}
+				resize(0, 0, format);
+			}
 
 			int compornent_count;
-			std::unique_ptr<float, decltype(&stbi_image_free)> bitmap(stbi_loadf(filename, &_width, &_height, &compornent_count, 4), stbi_image_free);
+			int channels = format == TexelFormat::RGBA32F ? 4 : 3;
+			int w, h;
+			std::unique_ptr<float, decltype(&stbi_image_free)> bitmap(stbi_loadf(filename, &w, &h, &compornent_count, channels), stbi_image_free);
 			float* pixels = bitmap.get();
 			if (pixels == nullptr) {
 				return false;
 			}
 
-			_values.resize(_width * _height);
+			resize(w, h, format);
 			for (int i = 0, n = _width * _height; i < n; ++i) {
-				int index = i * 4;
-				_values[i] = glm::vec4(pixels[index], pixels[index + 1], pixels[index + 2], pixels[index + 3]);
+				int index = i * channels;
+				glm::vec4 value(pixels[index], pixels[index + 1], pixels[index + 2], channels == 4 ? pixels[index + 3] : 1.0f);
+				set_texel(i, value);
 			}
 			return true;
 		}
 
 		void clamp_rgb(float min_value, float max_value) {
-			for (int i = 0; i < _values.size(); ++i) {
-				_values[i].x = glm::clamp(_values[i].x, min_value, max_value);
-				_values[i].y = glm::clamp(_values[i].y, min_value, max_value);
-				_values[i].z = glm::clamp(_values[i].z, min_value, max_value);
+			for (int i = 0, n = _width * _height; i < n; ++i) {
+				glm::vec4 value = texel(i);
+				value.x = glm::clamp(value.x, min_value, max_value);
+				value.y = glm::clamp(value.y, min_value, max_value);
+				value.z = glm::clamp(value.z, min_value, max_value);
+				set_texel(i, value);
 			}
 		}
 
 		bool has_area() const {
-			return !_values.empty();
+			return 0 < _width && 0 < _height;
+		}
+		TexelFormat format() const {
+			return _format;
+		}
+		// memory of the texels
+		std::size_t bytes() const {
+			return (std::size_t)_width * _height * texel_bytes(_format);
 		}
 		int width() const {
 			return _width;
@@ -51,24 +114,82 @@ namespace rt {
 			return _height;
 		}
 		glm::vec4 *data() {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values.data();
 		}
 		const glm::vec4 *data() const {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values.data();
 		}
 		glm::vec4 &operator()(int x, int y) {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values[y * _width + x];
 		}
 		const glm::vec4 &operator()(int x, int y) const {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values[y * _width + x];
 		}
 		glm::vec4 &sample(int x, int y) {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values[y * _width + x];
 		}
 		const glm::vec4 &sample(int x, int y) const {
+			RT_ASSERT(_format == TexelFormat::RGBA32F);
 			return _values[y * _width + x];
 		}
 
+		// decoded texel. alpha is 1 except RGBA32F
+		glm::vec4 texel(int index) const {
+			switch (_format) {
+			case TexelFormat::RGB16F:
+				return glm::vec4(decode_rgb16f(_rgb16f[index]), 1.0f);
+			case TexelFormat::RGBE:
+				return glm::vec4(decode_rgbe(_rgbe[index]), 1.0f);
+			case TexelFormat::RGB9E5:
+				return glm::vec4(decode_rgb9e5(_rgb9e5[index]), 1.0f);
+			default:
+				break;
+			}
+			return _values[index];
+		}
+		glm::vec4 texel(int x, int y) const {
+			return texel(y * _width + x);
+		}
+		void set_texel(int index, const glm::vec4 &value) {
+			switch (_format) {
+			case TexelFormat::RGB16F:
+				_rgb16f[index] = encode_rgb16f(glm::vec3(value));
+				break;
+			case TexelFormat::RGBE:
+				_rgbe[index] = encode_rgbe(glm::vec3(value));
+				break;
+			case TexelFormat::RGB9E5:
+				_rgb9e5[index] = encode_rgb9e5(glm::vec3(value));
+				break;
+			default:
+				_values[index] = value;
+				break;
+			}
+		}
+		void set_texel(int x, int y, const glm::vec4 &value) {
+			set_texel(y * _width + x, value);
+		}
+
+		// the texel as stored, texel_bytes(format()) bytes. the following texels of the row are next to it
+		const uint8_t *encoded_texel(int index) const {
+			switch (_format) {
+			case TexelFormat::RGB16F:
+				return reinterpret_cast<const uint8_t *>(_rgb16f.data() + index);
+			case TexelFormat::RGBE:
+				return reinterpret_cast<const uint8_t *>(_rgbe.data() + index);
+			case TexelFormat::RGB9E5:
+				return reinterpret_cast<const uint8_t *>(_rgb9e5.data() + index);
+			default:
+				break;
+			}
+			return reinterpret_cast<const uint8_t *>(_values.data() + index);
+		}
+
 		/*
 		v
 		^
@@ -84,11 +205,17 @@ namespace rt {
 			x = glm::clamp(x, 0, _width - 1);
 			y = glm::clamp(y, 0, _height - 1);
 
-			return _values[y * _width + x];
+			return texel(y * _width + x);
 		}
 	private:
 		int _width = 0;
 		int _height = 0;
+		TexelFormat _format = TexelFormat::RGBA32F;
+
+		// only the one for _format is used
 		std::vector<glm::vec4> _values;
+		std::vector<TexelRGB16F> _rgb16f;
+		std::vector<TexelRGBE> _rgbe;
+		std::vector<uint32_t> _rgb9e5;
 	};
 }
\ No newline at end of file
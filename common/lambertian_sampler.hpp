@@ -4,27 +4,34 @@
 #include <glm/ext.hpp>
 
 #include "orthonormal_basis.hpp"
+#include "fast_math.hpp"
 
 namespace rt {
 	// p(w) = cosθ / π
 	class CosThetaProportionalSampler {
 	public:
 		static glm::vec3 sample(PeseudoRandom *random, const glm::vec3 &Ng) {
+			// local to global
+			OrthonormalBasis<float> basis(Ng);
+			return basis.localToGlobal(sample_local(random));
+		}
+
+		// z up. z is cosθ
+		static glm::vec3 sample_local(PeseudoRandom *random) {
 			float a = random->uniform();
 			float b = random->uniform();
 			float r = std::sqrt(a);
 			float theta = b * glm::pi<float>() * 2.0f;
 
 			// uniform in xy circle, a = r * r
-			float x = r * cos(theta);
-			float y = r * sin(theta);
+			float sinTheta, cosTheta;
+			math::sincos(theta, &sinTheta, &cosTheta);
+			float x = r * cosTheta;
+			float y = r * sinTheta;
 
 			// unproject to hemisphere
 			float z = std::sqrt(std::max(1.0f - a, 0.0f));
-
-			// local to global
-			OrthonormalBasis<float> basis(Ng);
-			return basis.localToGlobal(glm::vec3(x, y, z));
+			return glm::vec3(x, y, z);
 		}
 		static float pdf(const glm::vec3 &sampled_wi, const glm::vec3 &Ng) {
 			float cosTheta = glm::dot(sampled_wi, Ng);
@@ -0,0 +1,235 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <system_error>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+	/*
+	 memory mapped file
+	   open()   : read only
+	   create() : read write, shared with the file. evict() writes a range back and drops it from memory
+	*/
+	class MappedFile {
+	public:
+		MappedFile() {}
+		~MappedFile() {
+			close();
+		}
+		MappedFile(const MappedFile &) = delete;
+		void operator=(const MappedFile &) = delete;
+
+		// if succeeded return true
+		bool open(const std::filesystem::path &path) {
+			close();
+#if defined(_WIN32)
+			_file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (_file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size;
+			if (GetFileSizeEx(_file, &size) == FALSE || size.QuadPart == 0) {
+				close();
+				return false;
+			}
+			_mapping = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (_mapping == NULL) {
+				close();
+				return false;
+			}
+			_data = (const uint8_t *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+			if (_data == nullptr) {
+				close();
+				return false;
+			}
+			_size = (std::size_t)size.QuadPart;
+#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size == 0) {
+				::close(fd);
+				return false;
+			}
+			void *p = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (p == MAP_FAILED) {
+				return false;
+			}
+			_data = (const uint8_t *)p;
+			_size = (std::size_t)st.st_size;
+#endif
+			return true;
+		}
+
+		// create (or truncate) the file with size bytes of zeros and map it read write. if succeeded return true
+		bool create(const std::filesystem::path &path, std::size_t size) {
+			close();
+			if (size == 0) {
+				return false;
+			}
+#if defined(_WIN32)
+			_file = CreateFileW(path.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (_file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER s;
+			s.QuadPart = (LONGLONG)size;
+			_mapping = CreateFileMappingW(_file, NULL, PAGE_READWRITE, s.HighPart, s.LowPart, NULL);
+			if (_mapping == NULL) {
+				close();
+				return false;
+			}
+			_data = (const uint8_t *)MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 0);
+			if (_data == nullptr) {
+				close();
+				return false;
+			}
+#else
+			int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+				return false;
+			}
+			if (ftruncate(fd, (off_t)size) != 0) {
+				::close(fd);
+				return false;
+			}
+			void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (p == MAP_FAILED) {
+				return false;
+			}
+			_data = (const uint8_t *)p;
+#endif
+			_size = size;
+			_writable = true;
+			return true;
+		}
+
+		// write [offset, offset + bytes) back to the file and let the os drop it from memory. the content stays valid.
+		// offset must be a multiple of the page size
+		void evict(std::size_t offset, std::size_t bytes) {
+			if (_writable == false || bytes == 0) {
+				return;
+			}
+			void *p = (void *)(_data + offset);
+#if defined(_WIN32)
+			FlushViewOfFile(p, bytes);
+			// removes the pages from the working set even though they are not locked
+			VirtualUnlock(p, bytes);
+#else
+			msync(p, bytes, MS_ASYNC);
+			madvise(p, bytes, MADV_DONTNEED);
+#endif
+		}
+
+		void close() {
+#if defined(_WIN32)
+			if (_data) {
+				UnmapViewOfFile(_data);
+			}
+			if (_mapping != NULL) {
+				CloseHandle(_mapping);
+			}
+			if (_file != INVALID_HANDLE_VALUE) {
+				CloseHandle(_file);
+			}
+			_mapping = NULL;
+			_file = INVALID_HANDLE_VALUE;
+#else
+			if (_data) {
+				munmap((void *)_data, _size);
+			}
+#endif
+			_data = nullptr;
+			_size = 0;
+			_writable = false;
+		}
+
+		bool isOpened() const {
+			return _data != nullptr;
+		}
+		const uint8_t *data() const {
+			return _data;
+		}
+		// nullptr unless create()
+		uint8_t *mutableData() {
+			return _writable ? (uint8_t *)_data : nullptr;
+		}
+		std::size_t size() const {
+			return _size;
+		}
+	private:
+		const uint8_t *_data = nullptr;
+		std::size_t _size = 0;
+		bool _writable = false;
+#if defined(_WIN32)
+		HANDLE _file = INVALID_HANDLE_VALUE;
+		HANDLE _mapping = NULL;
+#endif
+	};
+
+	/*
+	 write into "path.tmp" and rename it to path.
+	 a reader never sees a half written file even if the process dies on the way.
+	 write returns false to abort.
+	*/
+	inline bool write_file_atomic(const std::filesystem::path &path, const std::function<bool(FILE *)> &write) {
+		std::filesystem::path tmp = path;
+		tmp += ".tmp";
+
+		FILE *fp = fopen(tmp.string().c_str(), "wb");
+		if (fp == nullptr) {
+			return false;
+		}
+		bool ok = write(fp);
+		ok = fflush(fp) == 0 && ok;
+		ok = fclose(fp) == 0 && ok;
+
+		std::error_code ec;
+		if (ok) {
+			std::filesystem::rename(tmp, path, ec);
+			ok = !ec;
+		}
+		if (ok == false) {
+			std::filesystem::remove(tmp, ec);
+		}
+		return ok;
+	}
+
+	// "absolute path|mtime|size" of a file, empty if it doesn't exist. used as a key of caches derived from the file.
+	inline std::string file_identity(const std::filesystem::path &path) {
+		std::error_code ec;
+		auto mtime = std::filesystem::last_write_time(path, ec);
+		if (ec) {
+			return std::string();
+		}
+		auto bytes = std::filesystem::file_size(path, ec);
+		if (ec) {
+			return std::string();
+		}
+		std::ostringstream s;
+		s << std::filesystem::absolute(path, ec).string()
+			<< "|" << mtime.time_since_epoch().count()
+			<< "|" << bytes;
+		return s.str();
+	}
+}
\ No newline at end of file
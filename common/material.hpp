@@ -7,16 +7,41 @@
 #include "orthonormal_basis.hpp"
 #include "assertion.hpp"
 #include "lambertian_sampler.hpp"
+#include "fast_math.hpp"
+#include "soa_vec3.hpp"
 
 namespace rt {
 	class BxDF;
 
+	// メッシュの頂点法線. 三角形ごとに indices が 3 つ
+	struct ShadingNormals {
+		SoAVec3 N;
+		std::vector<uint32_t> indices;
+
+		bool empty() const {
+			return N.empty();
+		}
+	};
+
 	class ShadingPoint {
 	public:
 		float u = 0.0f;
 		float v = 0.0f;
 		glm::vec3 Ng;
 		const BxDF *bxdf = nullptr;
+
+		const ShadingNormals *normals = nullptr;
+		uint32_t primID = 0;
+
+		// 補間したシェーディング法線. 使うときだけ計算する. 法線が無ければ Ng
+		glm::vec3 Ns() const {
+			if (normals == nullptr) {
+				return Ng;
+			}
+			const uint32_t *index = normals->indices.data() + primID * 3;
+			glm::vec3 n = (1.0f - u - v) * normals->N[index[0]] + u * normals->N[index[1]] + v * normals->N[index[2]];
+			return glm::normalize(n);
+		}
 	};
 
 	enum class GeoScope : uint8_t {
@@ -26,12 +51,40 @@ namespace rt {
 	};
 	static const std::string kGeoScopeKey = "GeoScope";
 
+	// どのローブからサンプルしたか
+	enum class BxDFLobe : uint8_t {
+		None,
+		Diffuse,
+		Glossy,
+	};
+
+	// ShadingQueue が種類ごとにまとめて SIMD で評価するための区別. Other は仮想関数で 1 つずつ
+	enum class BxDFKind : uint8_t {
+		Other,
+		Lambertian,
+		Ward,
+		GGX,
+	};
+	static const int kBxDFKindCount = 4;
+
+	// sample_eval(), evaluate() の結果
+	struct BxDFSample {
+		glm::vec3 wi;
+		glm::vec3 f;
+		float pdf = 0.0f;
+		BxDFLobe lobe = BxDFLobe::None;
+	};
+
 	class BxDF {
 	public:
 		virtual ~BxDF() {}
 
 		virtual BxDF *allocate() const = 0;
 
+		virtual BxDFKind kind() const {
+			return BxDFKind::Other;
+		}
+
 		// evaluate emission
 		virtual glm::vec3 emission(const glm::vec3 &wo, const ShadingPoint &shadingPoint) const {
 			return glm::vec3(0.0f);
@@ -49,6 +102,13 @@ namespace rt {
 
 		// pdf for wi
 		virtual float pdf(const glm::vec3 &wo, const glm::vec3 &sampled_wi, const ShadingPoint &shadingPoint) const = 0;
+
+		// sample wi, and evaluate bxdf and pdf for it, on one local frame.
+		// same as sample(), pdf(), bxdf() with the same random numbers
+		virtual BxDFSample sample_eval(PeseudoRandom *random, const glm::vec3 &wo, const ShadingPoint &shadingPoint) const = 0;
+
+		// bxdf and pdf for given wi at once
+		virtual BxDFSample evaluate(const glm::vec3 &wo, const glm::vec3 &wi, const ShadingPoint &shadingPoint) const = 0;
 	};
 
 	class LambertianBRDF : public BxDF {
@@ -59,12 +119,14 @@ namespace rt {
 		glm::vec3 Le;
 		glm::vec3 R;
 		int BackEmission = 0;
-		std::array<glm::vec3, 3> Nv;
 		int ShadingNormal = 0;
 
 		BxDF *allocate() const override {
 			return new LambertianBRDF(*this);
 		}
+		BxDFKind kind() const override {
+			return BxDFKind::Lambertian;
+		}
 
 		glm::vec3 emission(const glm::vec3 &wo, const ShadingPoint &shadingPoint) const override {
 			if (BackEmission == 0 && glm::dot(shadingPoint.Ng, wo) < 0.0f) {
@@ -80,8 +142,7 @@ namespace rt {
 			}
 
 			if (ShadingNormal) {
-				glm::vec3 Ns = (1.0f - shadingPoint.u - shadingPoint.v) * Nv[0] + shadingPoint.u * Nv[1] + shadingPoint.v * Nv[2];
-				Ns = glm::normalize(Ns);
+				glm::vec3 Ns = shadingPoint.Ns();
 				return glm::abs(glm::dot(Ns, wi) / glm::dot(shadingPoint.Ng, wi)) * glm::vec3(R) * glm::one_over_pi<float>();
 			}
 
@@ -101,6 +162,43 @@ namespace rt {
 			RT_ASSERT(0.0f <= p);
 			return p;
 		}
+		BxDFSample sample_eval(PeseudoRandom *random, const glm::vec3 &wo, const ShadingPoint &shadingPoint) const override {
+			bool isNormalFlipped = glm::dot(wo, shadingPoint.Ng) < 0.0f;
+			OrthonormalBasis<float> basis(isNormalFlipped ? -shadingPoint.Ng : shadingPoint.Ng);
+
+			// z is cosθ
+			glm::vec3 wi_local = CosThetaProportionalSampler::sample_local(random);
+
+			BxDFSample s;
+			s.wi = basis.localToGlobal(wi_local);
+			s.f = reflectance(s.wi, wi_local.z, shadingPoint);
+			s.pdf = wi_local.z * glm::one_over_pi<float>();
+			s.lobe = BxDFLobe::Diffuse;
+			return s;
+		}
+		BxDFSample evaluate(const glm::vec3 &wo, const glm::vec3 &wi, const ShadingPoint &shadingPoint) const override {
+			BxDFSample s;
+			s.wi = wi;
+			s.lobe = BxDFLobe::Diffuse;
+
+			float NoI = glm::dot(shadingPoint.Ng, wi);
+			if (NoI * glm::dot(shadingPoint.Ng, wo) < 0.0f) {
+				s.f = glm::vec3(0.0f);
+				return s;
+			}
+			float cosTheta = std::abs(NoI);
+			s.f = reflectance(wi, cosTheta, shadingPoint);
+			s.pdf = cosTheta * glm::one_over_pi<float>();
+			return s;
+		}
+	private:
+		glm::vec3 reflectance(const glm::vec3 &wi, float absNoI, const ShadingPoint &shadingPoint) const {
+			if (ShadingNormal) {
+				glm::vec3 Ns = shadingPoint.Ns();
+				return std::abs(glm::dot(Ns, wi)) / absNoI * glm::vec3(R) * glm::one_over_pi<float>();
+			}
+			return glm::vec3(R) * glm::one_over_pi<float>();
+		}
 	};
 
 	const static float alpha = 0.6f;
@@ -113,13 +211,18 @@ namespace rt {
 		BxDF *allocate() const override {
 			return new Ward(*this);
 		}
+		BxDFKind kind() const override {
+			return BxDFKind::Ward;
+		}
 
 		template <class Real>
 		glm::tvec3<Real> polar_to_cartesian_z_up(Real theta, Real phi) const {
-			Real sinTheta = std::sin(theta);
-			Real x = sinTheta * std::cos(phi);
-			Real y = sinTheta * std::sin(phi);
-			Real z = std::cos(theta);
+			Real sinTheta, cosTheta, sinPhi, cosPhi;
+			math::sincos(theta, &sinTheta, &cosTheta);
+			math::sincos(phi, &sinPhi, &cosPhi);
+			Real x = sinTheta * cosPhi;
+			Real y = sinTheta * sinPhi;
+			Real z = cosTheta;
 			return glm::tvec3<Real>(x, y, z);
 		};
 
@@ -183,7 +286,7 @@ namespace rt {
 			float cosThetaH2 = sqr(glm::dot(h, Ng));
 			float tanThetaH2 = (1.0f - cosThetaH2) / cosThetaH2;
 			float k0 = rho_s / (glm::pi<float>() * alpha2);
-			float k1 = std::exp(-tanThetaH2 / alpha2);
+			float k1 = math::exp(-tanThetaH2 / alpha2);
 			float k2 = glm::dot(l_add_v, l_add_v) / sqrsqr(glm::dot(l_add_v, Ng));
 			return glm::vec3(k0 * k1 * k2);
 		}
@@ -198,12 +301,12 @@ namespace rt {
 			float u0 = random->uniform();
 			float u1 = random->uniform();
 			float phiH = u0 * 2.0f * glm::pi<float>();
-			float tanThetaH = alpha * std::sqrt(-std::log(u1));
+			float tanThetaH = alpha * std::sqrt(-math::log(u1));
 			//float h_x = tanThetaH * cos(phiH);
 			//float h_y = tanThetaH * sin(phiH);
 			//float h_z = 1.0f;
 			//glm::vec3 h_local = glm::normalize(glm::vec3(h_x, h_y, h_z));
-			float thetaH = std::atan(tanThetaH);
+			float thetaH = math::atan(tanThetaH);
 			glm::vec3 h_local = polar_to_cartesian_z_up<float>(thetaH, phiH);
 			// glm::vec3 h_local = glm::vec3(0, 0, 1);
 
@@ -245,7 +348,7 @@ namespace rt {
 			float tanTheta2 = (1.0f - cosThetaH2) / cosThetaH2;
 
 			float k0 = 1.0f / (4.0f * glm::pi<float>() * alpha2 * glm::dot(h, sampled_wi) * cubic(glm::dot(h, Ng)));
-			float k1 = std::exp(-tanTheta2 / alpha2);
+			float k1 = math::exp(-tanTheta2 / alpha2);
 			float p = k0 * k1;
 			RT_ASSERT(isfinite(p));
 			return p;
@@ -255,9 +358,218 @@ namespace rt {
 			//RT_ASSERT(0.0f <= p);
 			//return p;
 		}
+		BxDFSample sample_eval(PeseudoRandom *random, const glm::vec3 &wo, const ShadingPoint &shadingPoint) const override {
+			glm::vec3 Ng = shadingPoint.Ng;
+			if (glm::dot(wo, Ng) < 0.0f) {
+				Ng = -Ng;
+			}
+
+			float u0 = random->uniform();
+			float u1 = random->uniform();
+			float phiH = u0 * 2.0f * glm::pi<float>();
+			float tanThetaH = alpha * std::sqrt(-math::log(u1));
+			float thetaH = math::atan(tanThetaH);
+			glm::vec3 h_local = polar_to_cartesian_z_up<float>(thetaH, phiH);
+
+			OrthonormalBasis<float> basis(Ng);
+			glm::vec3 h = basis.localToGlobal(h_local);
+
+			BxDFSample s;
+			s.wi = glm::reflect(-wo, h);
+			s.lobe = BxDFLobe::Glossy;
+			RT_ASSERT(isfinite(s.wi.x));
+			RT_ASSERT(isfinite(s.wi.y));
+			RT_ASSERT(isfinite(s.wi.z));
+
+			if (glm::dot(Ng, s.wi) < 0.0f) {
+				s.f = glm::vec3(0.0f);
+				return s;
+			}
+
+			// exp(-tan^2 / alpha^2) is u1, and wi + wo = 2 (h . wo) h
+			float alpha2 = alpha * alpha;
+			float cosThetaH = h_local.z;
+			float cosThetaH2 = cosThetaH * cosThetaH;
+			float HoO = glm::dot(h, wo);
+			s.f = glm::vec3(u1 / (4.0f * glm::pi<float>() * alpha2 * HoO * HoO * cosThetaH2 * cosThetaH2));
+			s.pdf = u1 / (4.0f * glm::pi<float>() * alpha2 * HoO * cosThetaH2 * cosThetaH);
+			RT_ASSERT(isfinite(s.pdf));
+			return s;
+		}
+		BxDFSample evaluate(const glm::vec3 &wo, const glm::vec3 &wi, const ShadingPoint &shadingPoint) const override {
+			BxDFSample s;
+			s.wi = wi;
+			s.lobe = BxDFLobe::Glossy;
+
+			float NoI = glm::dot(shadingPoint.Ng, wi);
+			float NoO = glm::dot(shadingPoint.Ng, wo);
+			if (NoI * NoO < 0.0f) {
+				s.f = glm::vec3(0.0f);
+				return s;
+			}
+			glm::vec3 Ng = NoO < 0.0f ? -shadingPoint.Ng : shadingPoint.Ng;
+
+			float alpha2 = alpha * alpha;
+			glm::vec3 l_add_v = wi + wo;
+			glm::vec3 h = glm::normalize(l_add_v);
+			float cosThetaH = glm::dot(h, Ng);
+			float cosThetaH2 = cosThetaH * cosThetaH;
+			float tanThetaH2 = (1.0f - cosThetaH2) / cosThetaH2;
+			float k1 = math::exp(-tanThetaH2 / alpha2);
+
+			float LoN = glm::dot(l_add_v, Ng);
+			float LoN2 = LoN * LoN;
+			s.f = glm::vec3(k1 * glm::dot(l_add_v, l_add_v) / (glm::pi<float>() * alpha2 * LoN2 * LoN2));
+			s.pdf = k1 / (4.0f * glm::pi<float>() * alpha2 * glm::dot(h, wi) * cosThetaH2 * cosThetaH);
+			RT_ASSERT(isfinite(s.pdf));
+			return s;
+		}
 	};
 
 
+	/*
+	 anisotropic GGX, height correlated smith G2, Schlick fresnel (F0 = Cd)
+	 wi is sampled from the distribution of visible normals.
+	 Heitz, "Sampling the GGX Distribution of Visible Normals", JCGT 2018
+	 roughness is squared to alpha. the tangent frame is OrthonormalBasis of Ng.
+	*/
+	class GGX : public BxDF {
+	public:
+		GGX() {}
+
+		glm::vec3 R = glm::vec3(1.0f);
+		float RoughnessU = 0.3f;
+		float RoughnessV = 0.3f;
+
+		BxDF *allocate() const override {
+			return new GGX(*this);
+		}
+		BxDFKind kind() const override {
+			return BxDFKind::GGX;
+		}
+
+		float alpha_u() const {
+			return std::max(RoughnessU * RoughnessU, 1.0e-3f);
+		}
+		float alpha_v() const {
+			return std::max(RoughnessV * RoughnessV, 1.0e-3f);
+		}
+
+		glm::vec3 bxdf(const glm::vec3 &wo, const glm::vec3 &wi, const ShadingPoint &shadingPoint) const override {
+			return evaluate(wo, wi, shadingPoint).f;
+		}
+		glm::vec3 sample(PeseudoRandom *random, const glm::vec3 &wo, const ShadingPoint &shadingPoint) const override {
+			return sample_eval(random, wo, shadingPoint).wi;
+		}
+		float pdf(const glm::vec3 &wo, const glm::vec3 &sampled_wi, const ShadingPoint &shadingPoint) const override {
+			return evaluate(wo, sampled_wi, shadingPoint).pdf;
+		}
+		BxDFSample sample_eval(PeseudoRandom *random, const glm::vec3 &wo, const ShadingPoint &shadingPoint) const override {
+			float u0 = random->uniform();
+			float u1 = random->uniform();
+
+			bool isNormalFlipped = glm::dot(wo, shadingPoint.Ng) < 0.0f;
+			OrthonormalBasis<float> basis(isNormalFlipped ? -shadingPoint.Ng : shadingPoint.Ng);
+			glm::vec3 wo_local = basis.globalToLocal(wo);
+			wo_local.z = std::max(wo_local.z, 1.0e-6f);
+
+			glm::vec3 h_local = sample_visible_normal(wo_local, u0, u1);
+			glm::vec3 wi_local = glm::reflect(-wo_local, h_local);
+
+			BxDFSample s;
+			s.wi = basis.localToGlobal(wi_local);
+			s.lobe = BxDFLobe::Glossy;
+			if (wi_local.z <= 0.0f) {
+				s.f = glm::vec3(0.0f);
+				return s;
+			}
+			evaluate_local(wo_local, wi_local, h_local, &s);
+			return s;
+		}
+		BxDFSample evaluate(const glm::vec3 &wo, const glm::vec3 &wi, const ShadingPoint &shadingPoint) const override {
+			BxDFSample s;
+			s.wi = wi;
+			s.lobe = BxDFLobe::Glossy;
+			s.f = glm::vec3(0.0f);
+
+			float NoO = glm::dot(shadingPoint.Ng, wo);
+			if (glm::dot(shadingPoint.Ng, wi) * NoO <= 0.0f) {
+				return s;
+			}
+			OrthonormalBasis<float> basis(NoO < 0.0f ? -shadingPoint.Ng : shadingPoint.Ng);
+			glm::vec3 wo_local = basis.globalToLocal(wo);
+			glm::vec3 wi_local = basis.globalToLocal(wi);
+			if (wo_local.z <= 0.0f || wi_local.z <= 0.0f) {
+				return s;
+			}
+			glm::vec3 h_local = glm::normalize(wo_local + wi_local);
+			evaluate_local(wo_local, wi_local, h_local, &s);
+			return s;
+		}
+	private:
+		// D(h)
+		float distribution(const glm::vec3 &h) const {
+			float ax = alpha_u();
+			float ay = alpha_v();
+			float x = h.x / ax;
+			float y = h.y / ay;
+			float k = x * x + y * y + h.z * h.z;
+			return 1.0f / (glm::pi<float>() * ax * ay * k * k);
+		}
+		// smith Λ(v)
+		float lambda(const glm::vec3 &v) const {
+			float ax = alpha_u();
+			float ay = alpha_v();
+			float a2 = (ax * ax * v.x * v.x + ay * ay * v.y * v.y) / (v.z * v.z);
+			return (-1.0f + std::sqrt(1.0f + a2)) * 0.5f;
+		}
+
+		// wo.z > 0
+		glm::vec3 sample_visible_normal(const glm::vec3 &wo, float u0, float u1) const {
+			float ax = alpha_u();
+			float ay = alpha_v();
+
+			// stretch to the hemisphere configuration
+			glm::vec3 Vh = glm::normalize(glm::vec3(ax * wo.x, ay * wo.y, wo.z));
+			float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+			glm::vec3 T1 = 0.0f < lensq ? glm::vec3(-Vh.y, Vh.x, 0.0f) / std::sqrt(lensq) : glm::vec3(1.0f, 0.0f, 0.0f);
+			glm::vec3 T2 = glm::cross(Vh, T1);
+
+			// projected area
+			float r = std::sqrt(u0);
+			float sinPhi, cosPhi;
+			math::sincos(glm::two_pi<float>() * u1, &sinPhi, &cosPhi);
+			float t1 = r * cosPhi;
+			float t2 = r * sinPhi;
+			float s = 0.5f * (1.0f + Vh.z);
+			t2 = (1.0f - s) * std::sqrt(std::max(1.0f - t1 * t1, 0.0f)) + s * t2;
+
+			glm::vec3 Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(1.0f - t1 * t1 - t2 * t2, 0.0f)) * Vh;
+
+			// unstretch
+			return glm::normalize(glm::vec3(ax * Nh.x, ay * Nh.y, std::max(Nh.z, 0.0f)));
+		}
+
+		// wo.z > 0, wi.z > 0
+		void evaluate_local(const glm::vec3 &wo, const glm::vec3 &wi, const glm::vec3 &h, BxDFSample *s) const {
+			float D = distribution(h);
+			float lambda_o = lambda(wo);
+			float lambda_i = lambda(wi);
+			float G1 = 1.0f / (1.0f + lambda_o);
+			float G2 = 1.0f / (1.0f + lambda_o + lambda_i);
+
+			float HoI = std::max(glm::dot(h, wi), 0.0f);
+			float k = 1.0f - HoI;
+			float k2 = k * k;
+			glm::vec3 F = R + (glm::vec3(1.0f) - R) * (k2 * k2 * k);
+
+			s->f = F * (D * G2 / (4.0f * wo.z * wi.z));
+
+			// D_wo(h) / (4 wo.h) = G1 D / (4 wo.z)
+			s->pdf = G1 * D / (4.0f * wo.z);
+		}
+	};
+
 	RTTR_REGISTRATION
 	{
 		using namespace rttr;
@@ -268,11 +580,17 @@ namespace rt {
 		.property("Le", &LambertianBRDF::Le)(metadata(kGeoScopeKey, GeoScope::Primitives))
 		.property("Cd", &LambertianBRDF::R)(metadata(kGeoScopeKey, GeoScope::Primitives))
 		.property("BackEmission", &LambertianBRDF::BackEmission)(metadata(kGeoScopeKey, GeoScope::Primitives))
-		.property("N", &LambertianBRDF::Nv)(metadata(kGeoScopeKey, GeoScope::Vertices))
 		.property("ShadingNormal", &LambertianBRDF::ShadingNormal)(metadata(kGeoScopeKey, GeoScope::Primitives));
 
 		registration::class_<Ward>("Ward")
 		.constructor<>()
 		.method("allocate", &Ward::allocate);
+
+		registration::class_<GGX>("GGX")
+		.constructor<>()
+		.method("allocate", &GGX::allocate)
+		.property("Cd", &GGX::R)(metadata(kGeoScopeKey, GeoScope::Primitives))
+		.property("RoughnessU", &GGX::RoughnessU)(metadata(kGeoScopeKey, GeoScope::Primitives))
+		.property("RoughnessV", &GGX::RoughnessV)(metadata(kGeoScopeKey, GeoScope::Primitives));
 	}
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <numeric>
 
 namespace rt {
 	/*
@@ -8,10 +9,21 @@ namespace rt {
 	template <class Real>
 	class OnlineMean {
 	public:
+		OnlineMean() {}
+		OnlineMean(int n, Real mean) :_n(n), _mean(mean) {}
+
 		void addSample(Real x) {
 			_mean = (x - _mean) / Real(_n + Real(1.0)) + _mean;
 			_n++;
 		}
+		void merge(const OnlineMean<Real> &other) {
+			int n = _n + other._n;
+			if (n == 0) {
+				return;
+			}
+			_mean += (other._mean - _mean) * (Real(other._n) / Real(n));
+			_n = n;
+		}
 		Real mean() const {
 			return _mean;
 		}
@@ -26,12 +38,30 @@ namespace rt {
 	template <class Real>
 	class OnlineVariance {
 	public:
+		OnlineVariance() {}
+		OnlineVariance(int n, Real mean, Real m2) :_mean(n, mean), _m(m2) {}
+
 		void addSample(Real x) {
 			Real mu_pre = _mean.mean();
 			_mean.addSample(x);
 			Real mu_new = _mean.mean();
 			_m += (x - mu_pre) * (x - mu_new);
 		}
+
+		/*
+		 別々に集めた 2 つを合わせる. Chan et al.
+		 https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Parallel_algorithm
+		*/
+		void merge(const OnlineVariance<Real> &other) {
+			int na = _mean.sampleCount();
+			int nb = other._mean.sampleCount();
+			if (na + nb == 0) {
+				return;
+			}
+			Real delta = other._mean.mean() - _mean.mean();
+			_m += other._m + delta * delta * (Real(na) * Real(nb) / Real(na + nb));
+			_mean.merge(other._mean);
+		}
 		Real mean() const {
 			return _mean.mean();
 		}
@@ -41,6 +71,10 @@ namespace rt {
 		int sampleCount() const {
 			return _mean.sampleCount();
 		}
+		// sum of squared differences from the mean
+		Real m2() const {
+			return _m;
+		}
 	private:
 		OnlineMean<Real> _mean;
 		Real _m = Real(0.0);
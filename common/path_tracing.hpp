@@ -11,15 +11,38 @@
 #include "plane_equation.hpp"
 #include "stopwatch.hpp"
 #include "alias_method.hpp"
+#include "envmap_visibility_cache.hpp"
+#include "ray_sort.hpp"
+#include "adaptive_sampling.hpp"
+#include "render_checkpoint.hpp"
+#include "render_split.hpp"
+#include "float_image_writer.hpp"
+#include "tiled_framebuffer.hpp"
+#include "progressive_preview.hpp"
 
 namespace rt {
+	/*
+	 ピクセルごとの積算と乱数の状態. 置き場は TiledFramebuffer で, タイルごとに連続している.
+	 backing を与えるとそのファイルをメモリマップして置く (out-of-core)
+	*/
 	class Image {
 	public:
-		Image(int w, int h) :_w(w), _h(h), _pixels(h * w), _randoms(h * w) {
+		// stream ごとに別の乱数列. 複数プロセスで同じ画像を描くときに使う (RenderSplit)
+		Image(int w, int h, int stream = 0, const std::filesystem::path &backing = std::filesystem::path()) :_w(w), _h(h) {
+			if (_buffer.allocate(w, h, backing) == false) {
+				printf("failed to map %s, the framebuffer stays in memory\n", backing.string().c_str());
+				_buffer.allocate(w, h);
+			}
+
 			Xoshiro128StarStar random;
-			for (int i = 0; i < _randoms.size(); ++i) {
-				_randoms[i] = random;
-				random.jump();
+			for (int i = 0; i < stream; ++i) {
+				random.long_jump();
+			}
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					*_buffer.state(x, y) = random.state();
+					random.jump();
+				}
 			}
 			//for (int i = 0; i < _randoms.size(); ++i) {
 			//	_randoms[i] = PCG32(7, i);
@@ -33,38 +56,108 @@ namespace rt {
 		}
 
 		void add(int x, int y, glm::vec3 c) {
-			int index = y * _w + x;
-			_pixels[index].color += c;
-			_pixels[index].sample++;
+			Pixel *px = _buffer.pixel(x, y);
+			px->color += c;
+			px->sample++;
+			px->luminance.addSample(rt::luminance(c));
 		}
 		void addRays(int x, int y, int nRays) {
-			int index = y * _w + x;
-			_pixels[index].rays += nRays;
+			_buffer.pixel(x, y)->rays += nRays;
 		}
 
+		// 0 のバイト列が初期状態
 		struct Pixel {
 			int sample = 0;
-			glm::vec3 color;
+			glm::vec3 color = glm::vec3(0.0f);
 			uint32_t rays = 0;
+
+			// 適応サンプリングの誤差の見積もり用
+			OnlineVariance<float> luminance;
 		};
 		const Pixel *pixel(int x, int y) const {
-			return _pixels.data() + y * _w + x;
+			return _buffer.pixel(x, y);
 		}
 		Pixel *pixel(int x, int y) {
-			return _pixels.data() + y * _w + x;
+			return _buffer.pixel(x, y);
 		}
 
-		PeseudoRandom *random(int x, int y) {
-			return _randoms.data() + y * _w + x;
+		// 乱数は状態だけを持つ. random() で取り出して使い, 使い終えたら setRandom() で戻す
+		Xoshiro128StarStar random(int x, int y) const {
+			Xoshiro128StarStar random;
+			random.set_state(*_buffer.state(x, y));
+			return random;
+		}
+		void setRandom(int x, int y, const Xoshiro128StarStar &random) {
+			*_buffer.state(x, y) = random.state();
+		}
+		glm::uvec4 randomState(int x, int y) const {
+			return *_buffer.state(x, y);
+		}
+		void setRandomState(int x, int y, const glm::uvec4 &state) {
+			*_buffer.state(x, y) = state;
+		}
+
+		int tileCount() const {
+			return _buffer.tileCount();
+		}
+		PixelWindow tileWindow(int tile) const {
+			return _buffer.tileWindow(tile);
+		}
+		bool outOfCore() const {
+			return _buffer.outOfCore();
+		}
+		void evictTile(int tile) {
+			_buffer.evictTile(tile);
 		}
 	private:
 		int _w = 0;
 		int _h = 0;
-		std::vector<Pixel> _pixels;
-		std::vector<Xoshiro128StarStar> _randoms;
-		// std::vector<PCG32> _randoms;
+		TiledFramebuffer<Pixel> _buffer;
 	};
 
+	// write_exr(), write_pfm() 用. 積算バッファから直接読む. 書き出している間は step() しないこと
+	inline std::vector<ImageLayer> image_layers(const Image *image) {
+		ImageLayer beauty;
+		beauty.channels = { "R", "G", "B" };
+		beauty.read = [image](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				const Image::Pixel *px = image->pixel(x + i, y);
+				glm::vec3 L = px->sample == 0 ? glm::vec3(0.0f) : px->color / (float)px->sample;
+				dst[i * 3 + 0] = L.x;
+				dst[i * 3 + 1] = L.y;
+				dst[i * 3 + 2] = L.z;
+			}
+		};
+		ImageLayer samples;
+		samples.name = "samples";
+		samples.channels = { "Y" };
+		samples.read = [image](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				dst[i] = (float)image->pixel(x + i, y)->sample;
+			}
+		};
+		// 1 サンプルあたりの輝度の分散
+		ImageLayer variance;
+		variance.name = "variance";
+		variance.channels = { "Y" };
+		variance.read = [image](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				dst[i] = image->pixel(x + i, y)->luminance.variance();
+			}
+		};
+		return { beauty, samples, variance };
+	}
+
+	inline AccumulationPixel accumulation_pixel(const Image::Pixel &px) {
+		AccumulationPixel a;
+		a.color = px.color;
+		a.sample = px.sample;
+		a.rays = px.rays;
+		a.luminanceMean = px.luminance.mean();
+		a.luminanceM2 = px.luminance.m2();
+		return a;
+	}
+
 	class SolidAngleSampler {
 	public:
 		virtual float pdf(glm::vec3 wi) const = 0;
@@ -139,8 +232,13 @@ namespace rt {
 			_n = n;
 			_brdf = brdf;
 			_selector.clear();
+			_selector.reserve((int)luminaires->size());
 			_canSample = false;
 
+			// 球面三角形は pdf, sample で最初に必要になったときに作る
+			_triangles.resize(luminaires->size());
+			_triangleReady.assign(luminaires->size(), 0);
+
 			PlaneEquation<float> brdf_plane;
 			brdf_plane.from_point_and_normal(o, n);
 
@@ -208,8 +306,7 @@ namespace rt {
 				float sP = _selector.probability(i);
 				float tmin;
 				if (0.0f < sP && intersect_ray_triangle(_o, wi, luminaires[i].points[0], luminaires[i].points[1], luminaires[i].points[2], &tmin)) {
-					SphericalTriangleSampler<float> sSampler(luminaires[i].points[0], luminaires[i].points[1], luminaires[i].points[2], _o);
-					p += sP * (1.0f / sSampler.solidAngle());
+					p += sP * triangle(i).pdf();
 
 					//float pA = 1.0f / luminaires[i].area;
 					//float pW = pA * (tmin * tmin) / glm::abs(glm::dot(-wi, luminaires[i].Ng));
@@ -232,10 +329,9 @@ namespace rt {
 			const std::vector<Luminaire> &luminaires = *_luminaires;
 			int i = _selector.sample(random);
 
-			SphericalTriangleSampler<float> sSampler(luminaires[i].points[0], luminaires[i].points[1], luminaires[i].points[2], _o);
 			float a = random->uniform();
 			float b = random->uniform();
-			auto wi = sSampler.sample_direction(a, b);
+			auto wi = triangle(i).sample_direction(a, b);
 			
 			//auto sampler = uniform_on_triangle(random->uniform(), random->uniform());
 			//auto p_on_triangle = sampler.evaluate(luminaires[i].points[0], luminaires[i].points[1], luminaires[i].points[2]);
@@ -262,6 +358,15 @@ namespace rt {
 			return _canSample;
 		}
 	private:
+		const SphericalTriangleSampler<float> &triangle(int i) const {
+			if (_triangleReady[i] == 0) {
+				const Luminaire &L = (*_luminaires)[i];
+				_triangles[i] = SphericalTriangleSampler<float>(L.points[0], L.points[1], L.points[2], _o);
+				_triangleReady[i] = 1;
+			}
+			return _triangles[i];
+		}
+
 		const std::vector<Luminaire> *_luminaires = nullptr;
 		bool _canSample = false;
 		glm::vec3 _o;
@@ -269,9 +374,45 @@ namespace rt {
 
 		bool _brdf = true;
 		ValueProportionalSampler<float> _selector;
+		mutable std::vector<SphericalTriangleSampler<float>> _triangles;
+		mutable std::vector<uint8_t> _triangleReady;
 		// std::vector<bool> _sr_sample;
 	};
 
+	// 可視性キャッシュで重み付けした方向ビンを選び、ビンの中は立体角一様にサンプルする
+	class VisibilityGuidedEnvmapSampler : public SolidAngleSampler {
+	public:
+		// the weights are copied here, so sample() and pdf() agree while the cache keeps learning.
+		void prepare(const EnvmapVisibilityCache *cache, glm::vec3 o) {
+			_selector.clear();
+			_selector.reserve(EnvmapVisibilityCache::kDirectionBins);
+			int cell = cache->cell_index(o);
+			for (int bin = 0; bin < EnvmapVisibilityCache::kDirectionBins; ++bin) {
+				_selector.add(cache->bin_power(bin) * cache->visibility(cell, bin));
+			}
+			_canSample = 0.0f < _selector.sumValue();
+		}
+		float pdf(glm::vec3 wi) const {
+			if (_canSample == false) {
+				return 0.0f;
+			}
+			int bin = EnvmapVisibilityCache::direction_bin(wi);
+			return _selector.probability(bin) / EnvmapVisibilityCache::bin_solid_angle();
+		}
+		glm::vec3 sample(PeseudoRandom *random) const {
+			int bin = _selector.sample(random);
+			float u = random->uniform();
+			float v = random->uniform();
+			return EnvmapVisibilityCache::direction_in_bin(bin, u, v);
+		}
+		bool canSample() const {
+			return _canSample;
+		}
+	private:
+		bool _canSample = false;
+		ValueProportionalSampler<float> _selector;
+	};
+
 	class CailSampler {
 	public:
 		CailSampler(glm::vec3 o):_o(o) {
@@ -329,142 +470,266 @@ namespace rt {
 		std::atomic<int> pdf_mismatch;
 	};
 
-	inline glm::vec3 bounce(glm::vec3 Lo, glm::vec3 T, int i, const rt::Scene *scene, glm::vec3 ro, glm::vec3 rd, PeseudoRandom *random, int px, int py, uint32_t *rays) {
+	// bounce() の途中のパス. ro, rd が次に飛ばすレイ
+	struct PathState {
+		glm::vec3 Lo;
+		glm::vec3 T;
+		glm::vec3 ro;
+		glm::vec3 rd;
+		int i = 0;
+		uint32_t rays = 0;
+		int px = 0;
+		int py = 0;
+	};
+
+	// 交差した点. bounce_hit() で作り, bounce_continue() で使う
+	struct PathHit {
+		glm::vec3 p;
+		ShadingPoint shadingPoint;
+		// wo の側に向けた Ng
+		glm::vec3 Ng;
+	};
+
+	/*
+	 bounce_shade() の前半. path->ro, path->rd の交差の結果を見て, 当たらなければ環境マップを足して false.
+	 当たったら *pathHit を作って true. この後 random->uniform() < 0.5f なら BxDF を sample_eval() して bounce_continue() に渡す.
+	 ストリームではこの間の sample_eval() を ShadingQueue でまとめる
+	*/
+	inline bool bounce_hit(PathState *path, bool hit, const HitRecord &hitRecord, const rt::Scene *scene, EnvmapVisibilityCache *visibilityCache, PathHit *pathHit) {
+		glm::vec3 ro = path->ro;
+		glm::vec3 rd = path->rd;
+
+		path->rays++;
+		if (visibilityCache) {
+			visibilityCache->record(ro, rd, hit == false);
+		}
+
+		if (hit == false) {
+			auto env = scene->envmap();
+			glm::vec3 contribution = env->radiance(rd) * path->T;
+			path->Lo += contribution;
+			//if (i == 0) {
+			//	auto env = scene->envmap();
+			//	glm::vec3 contribution = env->radiance(rd) * T;
+			//	Lo += contribution;
+			//}
+			return false;
+		}
+
+		float tmin = hitRecord.t;
+		RT_ASSERT(0.0f <= tmin);
+
+		pathHit->p = ro + rd * tmin;
+		pathHit->shadingPoint = scene->shading_point(hitRecord);
+		bool backside = glm::dot(-rd, pathHit->shadingPoint.Ng) < 0.0f;
+		pathHit->Ng = backside ? -pathHit->shadingPoint.Ng : pathHit->shadingPoint.Ng;
+		return true;
+	}
+
+	// bounce_shade() の後半. sampledBxDF なら sampled が BxDF の sample_eval() の結果, そうでなければ環境マップ側をここでサンプルする.
+	// 続くなら true で, path は次のレイになっている
+	inline bool bounce_continue(PathState *path, const PathHit &pathHit, bool sampledBxDF, const BxDFSample &sampled, const rt::Scene *scene, PeseudoRandom *random, EnvmapVisibilityCache *visibilityCache) {
 		const float kSceneEPS = 1.0e-5f;
 		const float kValueEPS = 1.0e-6f;
 
-		float tmin = 0.0f;
-		ShadingPoint shadingPoint;
+		glm::vec3 &Lo = path->Lo;
+		glm::vec3 &T = path->T;
+		int i = path->i;
+		int px = path->px;
+		int py = path->py;
+
+		glm::vec3 wo = -path->rd;
+		const glm::vec3 &p = pathHit.p;
+		const ShadingPoint &shadingPoint = pathHit.shadingPoint;
+		const glm::vec3 &Ng = pathHit.Ng;
+
+		// Explicit Connection To Envmap
+		//if(true) {
+		//	float sampledPDF;
+		//	auto env = scene->envmap();
+		//	glm::vec3 light_wi = env->sample(random, shadingPoint.Ng, &sampledPDF);
+
+		//	if (env->pdf(light_wi, shadingPoint.Ng) != sampledPDF) {
+		//		radiance_stat::instance().pdf_mismatch++;
+		//	}
+		//	else {
+		//		radiance_stat::instance().pdf_match++;
+		//	}
 
-		glm::vec3 wo = -rd;
+		//	float absCosTheta = glm::abs(glm::dot(shadingPoint.Ng, light_wi));
+		//	ShadingPoint ls;
+		//	float ltmin = std::numeric_limits<float>::max();
+		//	if (scene->intersect(p + 1.0e-4f * light_wi / absCosTheta, light_wi, &ls, &ltmin) == false) {
+		//		glm::vec3 contribution = env->radiance(light_wi) * T * shadingPoint.bxdf->bxdf(wo, light_wi, shadingPoint) * absCosTheta / (float)env->pdf(light_wi, shadingPoint.Ng);
+		//		Lo += contribution;
+		//	}
+		//}
 
-		if (scene->intersect(ro, rd, &shadingPoint, &tmin)) {
-			RT_ASSERT(0.0f <= tmin);
+		// ここはもっと改良したい
+		//static thread_local LuminaireSampler directSampler;
+		//directSampler.prepare(&scene->luminaires(), p, backside ? -shadingPoint.Ng : shadingPoint.Ng, true);
 
-			auto p = ro + rd * (float)tmin;
+		//BxDFSampler bxdfSampler(wo, shadingPoint);
+		//MixtureSampler mixtureSampler(&bxdfSampler, &directSampler, directSampler.canSample() ? 0.5f : 0.0f);
 
-			shadingPoint.Ng = glm::normalize(shadingPoint.Ng);
-			bool backside = glm::dot(wo, shadingPoint.Ng) < 0.0f;
+		//glm::vec3 wi = mixtureSampler.sample(random);
+		//float pdf = mixtureSampler.pdf(wi);
 
-			// Explicit Connection To Envmap
-			//if(true) {
-			//	float sampledPDF;
-			//	auto env = scene->envmap();
-			//	glm::vec3 light_wi = env->sample(random, shadingPoint.Ng, &sampledPDF);
-
-			//	if (env->pdf(light_wi, shadingPoint.Ng) != sampledPDF) {
-			//		radiance_stat::instance().pdf_mismatch++;
-			//	}
-			//	else {
-			//		radiance_stat::instance().pdf_match++;
-			//	}
-
-			//	float absCosTheta = glm::abs(glm::dot(shadingPoint.Ng, light_wi));
-			//	ShadingPoint ls;
-			//	float ltmin = std::numeric_limits<float>::max();
-			//	if (scene->intersect(p + 1.0e-4f * light_wi / absCosTheta, light_wi, &ls, &ltmin) == false) {
-			//		glm::vec3 contribution = env->radiance(light_wi) * T * shadingPoint.bxdf->bxdf(wo, light_wi, shadingPoint) * absCosTheta / (float)env->pdf(light_wi, shadingPoint.Ng);
-			//		Lo += contribution;
-			//	}
-			//}
+		// ナイーヴ
+		//glm::vec3 wi = shadingPoint.bxdf->sample(random, wo, shadingPoint);
+		//float pdf = shadingPoint.bxdf->pdf(wo, wi, shadingPoint);
 
-			// ここはもっと改良したい
-			//static thread_local LuminaireSampler directSampler;
-			//directSampler.prepare(&scene->luminaires(), p, backside ? -shadingPoint.Ng : shadingPoint.Ng, true);
+		glm::vec3 wi;
+		float pdf_brdf;
+		float pdf_env;
 
-			//BxDFSampler bxdfSampler(wo, shadingPoint);
-			//MixtureSampler mixtureSampler(&bxdfSampler, &directSampler, directSampler.canSample() ? 0.5f : 0.0f);
+		// ポータルが見えているなら、環境マップのサンプリングはポータルの立体角に限定する
+		static thread_local LuminaireSampler portalSampler;
+		bool portal = false;
+		if (scene->portals().empty() == false) {
+			portalSampler.prepare(&scene->portals(), p, Ng, true);
+			portal = portalSampler.canSample();
+		}
 
-			//glm::vec3 wi = mixtureSampler.sample(random);
-			//float pdf = mixtureSampler.pdf(wi);
+		// 可視性キャッシュがあるなら、環境マップのサンプリングの半分を見えている方向に寄せる
+		static thread_local VisibilityGuidedEnvmapSampler guidedSampler;
+		bool guided = false;
+		if (portal == false && visibilityCache) {
+			guidedSampler.prepare(visibilityCache, p);
+			guided = guidedSampler.canSample();
+		}
 
-			// ナイーヴ
-			//glm::vec3 wi = shadingPoint.bxdf->sample(random, wo, shadingPoint);
-			//float pdf = shadingPoint.bxdf->pdf(wo, wi, shadingPoint);
+		auto envmap_pdf = [&](glm::vec3 wi) {
+			if (portal) {
+				return portalSampler.pdf(wi);
+			}
+			float p = scene->envmap()->pdf(wi, Ng);
+			if (guided) {
+				p = 0.5f * p + 0.5f * guidedSampler.pdf(wi);
+			}
+			return p;
+		};
 
-			glm::vec3 wi;
-			float pdf_brdf;
-			float pdf_env;
-			auto Ng = backside ? -shadingPoint.Ng : shadingPoint.Ng;
-			if (random->uniform() < 0.5f) {
-				wi = shadingPoint.bxdf->sample(random, wo, shadingPoint);
-				pdf_brdf = shadingPoint.bxdf->pdf(wo, wi, shadingPoint);
-				pdf_env = scene->envmap()->pdf(wi, Ng);
+		glm::vec3 bxdf;
+		if (sampledBxDF) {
+			wi = sampled.wi;
+			bxdf = sampled.f;
+			pdf_brdf = sampled.pdf;
+			pdf_env = envmap_pdf(wi);
+		}
+		else {
+			if (portal) {
+				wi = portalSampler.sample(random);
+			}
+			else if (guided && random->uniform() < 0.5f) {
+				wi = guidedSampler.sample(random);
 			}
 			else {
-				wi = scene->envmap()->sample(random, Ng, &pdf_env);
-				pdf_brdf = shadingPoint.bxdf->pdf(wo, wi, shadingPoint);
+				float pdf_sampled;
+				wi = scene->envmap()->sample(random, Ng, &pdf_sampled);
 			}
+			pdf_env = envmap_pdf(wi);
+			BxDFSample s = shadingPoint.bxdf->evaluate(wo, wi, shadingPoint);
+			bxdf = s.f;
+			pdf_brdf = s.pdf;
+		}
 
-			float pdf = 0.5f * pdf_brdf + 0.5f * pdf_env;
+		float pdf = 0.5f * pdf_brdf + 0.5f * pdf_env;
 
-			//glm::vec3 wi;
-			//float pdf;
-			//auto Ng = backside ? -shadingPoint.Ng : shadingPoint.Ng;
-			//wi = scene->envmap()->sample(random, Ng, &pdf);
+		//glm::vec3 wi;
+		//float pdf;
+		//auto Ng = backside ? -shadingPoint.Ng : shadingPoint.Ng;
+		//wi = scene->envmap()->sample(random, Ng, &pdf);
 
-			glm::vec3 bxdf = shadingPoint.bxdf->bxdf(wo, wi, shadingPoint);
-			glm::vec3 emission = shadingPoint.bxdf->emission(wo, shadingPoint);
+		glm::vec3 emission = shadingPoint.bxdf->emission(wo, shadingPoint);
 
-			float NoI = glm::dot(shadingPoint.Ng, wi);
-			float cosTheta = std::abs(NoI);
+		float NoI = glm::dot(shadingPoint.Ng, wi);
+		float cosTheta = std::abs(NoI);
 
-			glm::vec3 contribution = emission * T;
+		glm::vec3 contribution = emission * T;
 
-			RT_ASSERT(0.0f <= bxdf.x);
-			RT_ASSERT(0.0f <= bxdf.y);
-			RT_ASSERT(0.0f <= bxdf.z);
+		RT_ASSERT(0.0f <= bxdf.x);
+		RT_ASSERT(0.0f <= bxdf.y);
+		RT_ASSERT(0.0f <= bxdf.z);
 
-			Lo += contribution;
+		Lo += contribution;
 
-			if (1.0e-6f < pdf) {
-				T *= bxdf * cosTheta / pdf;
-			}
-			else {
-				T = glm::vec3(0.0f);
-			}
+		if (1.0e-6f < pdf) {
+			T *= bxdf * cosTheta / pdf;
+		}
+		else {
+			T = glm::vec3(0.0f);
+		}
 
-			RT_ASSERT(glm::abs(glm::length2(wi) - 1.0f) < 1.0e-5f);
-			RT_ASSERT(glm::abs(glm::length2(wo) - 1.0f) < 1.0e-5f);
-			RT_ASSERT(glm::abs(glm::length2(shadingPoint.Ng) - 1.0f) < 1.0e-5f);
+		RT_ASSERT(glm::abs(glm::length2(wi) - 1.0f) < 1.0e-5f);
+		RT_ASSERT(glm::abs(glm::length2(wo) - 1.0f) < 1.0e-5f);
+		RT_ASSERT(glm::abs(glm::length2(shadingPoint.Ng) - 1.0f) < 1.0e-5f);
 
-			// ロシアンルーレット
-			float max_compornent = glm::compMax(T);
-			if (0.0f <= max_compornent == false) {
-				std::cout << px << "," << py << std::endl;
-			}
-			// RT_ASSERT(0.0f <= max_compornent);
+		// ロシアンルーレット
+		float max_compornent = glm::compMax(T);
+		if (0.0f <= max_compornent == false) {
+			std::cout << px << "," << py << std::endl;
+		}
+		// RT_ASSERT(0.0f <= max_compornent);
+
+		// TODO Tはcontinue_pを含んでしまう？
+		// いや、でも合ってる気がする
+		// https://docs.google.com/file/d/0B8g97JkuSSBwUENiWTJXeGtTOHFmSm51UC01YWtCZw/edit?pli=1
+		float continue_p = i < 12 ? 1.0f : glm::min(max_compornent, 1.0f);
+		if (continue_p < random->uniform()) {
+			return false;
+		}
+		T /= continue_p;
 
-			// TODO Tはcontinue_pを含んでしまう？
-			// いや、でも合ってる気がする
-			// https://docs.google.com/file/d/0B8g97JkuSSBwUENiWTJXeGtTOHFmSm51UC01YWtCZw/edit?pli=1
-			float continue_p = i < 12 ? 1.0f : glm::min(max_compornent, 1.0f);
-			if (continue_p < random->uniform()) {
-				return Lo;
-			}
-			T /= continue_p;
+		// バイアスする方向は潜り込むときは逆転する
+		// が、必ずしもNoIだけで決めていいかどうか微妙なところがある気がするが・・・
+		path->ro = p + wi * kSceneEPS + (0.0f < NoI ? shadingPoint.Ng : -shadingPoint.Ng) * kSceneEPS;
+		path->rd = wi;
 
-			// バイアスする方向は潜り込むときは逆転する
-			// が、必ずしもNoIだけで決めていいかどうか微妙なところがある気がするが・・・
-			ro = p + wi * kSceneEPS + (0.0f < NoI ? shadingPoint.Ng : -shadingPoint.Ng) * kSceneEPS;
-			rd = wi;
+		if (i == 1) {
+			return false;
+		}
+		path->i = i + 1;
+		return true;
+	}
 
-			if (i == 1) {
-				return Lo;
-			}
-			return bounce(Lo, T, i + 1, scene, ro, rd, random, px, py, rays);
+	// path->ro, path->rd の交差の結果でパスを 1 つ進める. 続くなら true で, path は次のレイになっている
+	inline bool bounce_shade(PathState *path, bool hit, const HitRecord &hitRecord, const rt::Scene *scene, PeseudoRandom *random, EnvmapVisibilityCache *visibilityCache) {
+		PathHit pathHit;
+		if (bounce_hit(path, hit, hitRecord, scene, visibilityCache, &pathHit) == false) {
+			return false;
 		}
-		else {
-			auto env = scene->envmap();
-			glm::vec3 contribution = env->radiance(rd) * T;
-			Lo += contribution;
-			//if (i == 0) {
-			//	auto env = scene->envmap();
-			//	glm::vec3 contribution = env->radiance(rd) * T;
-			//	Lo += contribution;
-			//}
-			return Lo;
+		BxDFSample sampled;
+		bool sampledBxDF = random->uniform() < 0.5f;
+		if (sampledBxDF) {
+			sampled = pathHit.shadingPoint.bxdf->sample_eval(random, -path->rd, pathHit.shadingPoint);
 		}
+		return bounce_continue(path, pathHit, sampledBxDF, sampled, scene, random, visibilityCache);
+	}
+
+	// 終わるまで 1 本ずつ交差判定して進める
+	inline void bounce_path(PathState *path, const rt::Scene *scene, PeseudoRandom *random, EnvmapVisibilityCache *visibilityCache) {
+		for (;;) {
+			HitRecord hitRecord;
+			bool hit = scene->intersect(path->ro, path->rd, &hitRecord);
+			if (bounce_shade(path, hit, hitRecord, scene, random, visibilityCache) == false) {
+				break;
+			}
+		}
+	}
+
+	inline glm::vec3 bounce(glm::vec3 Lo, glm::vec3 T, int i, const rt::Scene *scene, glm::vec3 ro, glm::vec3 rd, PeseudoRandom *random, int px, int py, uint32_t *rays, EnvmapVisibilityCache *visibilityCache) {
+		PathState path;
+		path.Lo = Lo;
+		path.T = T;
+		path.ro = ro;
+		path.rd = rd;
+		path.i = i;
+		path.px = px;
+		path.py = py;
+		bounce_path(&path, scene, random, visibilityCache);
+		*rays = path.rays;
+		return path.Lo;
 	}
 	inline glm::vec3 radiance(const rt::Scene *scene, glm::vec3 ro, glm::vec3 rd, PeseudoRandom *random, int px, int py, uint32_t *rays) {
 		// const float kSceneEPS = scene.adaptiveEps();
@@ -483,18 +748,18 @@ namespace rt {
 
 		constexpr int kDepth = 20;
 		for (int i = 0; i < kDepth; ++i) {
-			float tmin = 0.0f;
-			ShadingPoint shadingPoint;
+			HitRecord hitRecord;
 
 			glm::vec3 wo = -rd;
 
 			shoot++;
-			if (scene->intersect(ro, rd, &shadingPoint, &tmin)) {
+			if (scene->intersect(ro, rd, &hitRecord)) {
+				float tmin = hitRecord.t;
 				RT_ASSERT(0.0f <= tmin);
 
-				auto p = ro + rd * (float)tmin;
+				auto p = ro + rd * tmin;
 
-				shadingPoint.Ng = glm::normalize(shadingPoint.Ng);
+				ShadingPoint shadingPoint = scene->shading_point(hitRecord);
 				bool backside = glm::dot(wo, shadingPoint.Ng) < 0.0f;
 
 				// Explicit Connection To Envmap
@@ -530,10 +795,11 @@ namespace rt {
 				//float pdf = mixtureSampler.pdf(wi);
 
 				// ナイーヴ
-				glm::vec3 wi = shadingPoint.bxdf->sample(random, wo, shadingPoint);
-				float pdf = shadingPoint.bxdf->pdf(wo, wi, shadingPoint);
+				BxDFSample s = shadingPoint.bxdf->sample_eval(random, wo, shadingPoint);
+				glm::vec3 wi = s.wi;
+				float pdf = s.pdf;
+				glm::vec3 bxdf = s.f;
 
-				glm::vec3 bxdf = shadingPoint.bxdf->bxdf(wo, wi, shadingPoint);
 				glm::vec3 emission = shadingPoint.bxdf->emission(wo, shadingPoint);
 				
 				float NoI = glm::dot(shadingPoint.Ng, wi);
@@ -604,86 +870,291 @@ namespace rt {
 
 	class PTRenderer {
 	public:
-		PTRenderer(std::shared_ptr<rt::Scene> scene)
+		// framebufferFile を与えると画素をそのファイルに置き, 描き終えたタイルから追い出す
+		PTRenderer(std::shared_ptr<rt::Scene> scene, RenderSplit split = RenderSplit(), const std::filesystem::path &framebufferFile = std::filesystem::path())
 			: _scene(scene)
-			, _image(scene->camera()->resolution_x, scene->camera()->resolution_y) {
+			, _image(scene->camera()->resolution_x, scene->camera()->resolution_y, split.process, framebufferFile)
+			, _split(split) {
 			_badSampleNanCount = 0;
 			_badSampleInfCount = 0;
 			_badSampleNegativeCount = 0;
 			_badSampleFireflyCount = 0;
 
 			_cpuTimer = Stopwatch();
+
+			glm::vec3 lower, upper;
+			_scene->bounds(&lower, &upper);
+			_visibilityCache = std::unique_ptr<EnvmapVisibilityCache>(new EnvmapVisibilityCache(_scene->envmap(), lower, upper, 16));
+
+			int w = _image.width();
+			int h = _image.height();
+			_displayScale = 1;
+			while (_displayScale < kTileSize && kDisplayMaxPixels < (std::size_t)preview_extent(w, _displayScale) * preview_extent(h, _displayScale)) {
+				_displayScale *= 2;
+			}
+			_display.resize((std::size_t)displayWidth() * displayHeight());
+			_tiles.resize(_image.tileCount());
+			refreshTileStatistics();
 		}
 		void step() {
-			_steps++;
+			if (cancelled()) {
+				return;
+			}
 
-			auto to = [](houdini_alembic::Vector3f p) {
-				return glm::vec3(p.x, p.y, p.z);
-			};
-			auto camera = _scene->camera();
-			glm::vec3 object_o =
-				to(camera->eye) + to(camera->forward) * camera->focusDistance
-				+ to(camera->left) * camera->objectPlaneWidth * 0.5f
+			// 前の step までを保存
+			if (_checkpointPath.empty() == false && _checkpointIntervalSeconds <= _checkpointTimer.elapsed()) {
+				if (saveCheckpoint(_checkpointPath, _checkpointKey) == false) {
+					printf("failed to write checkpoint %s\n", _checkpointPath.string().c_str());
+				}
+				_checkpointTimer = Stopwatch();
+			}
 
-				+ to(camera->up) * camera->objectPlaneHeight * 0.5f;
-			glm::vec3 rVector = to(camera->right) * camera->objectPlaneWidth;
-			glm::vec3 dVector = to(camera->down) * camera->objectPlaneHeight;
+			updateAdaptiveSampling();
+			if (converged()) {
+				return;
+			}
+			_steps++;
+
+			glm::vec3 eye, object_o, rVector, dVector;
+			objectPlane(&eye, &object_o, &rVector, &dVector);
 
 			float step_x = 1.0f / _image.width();
 			float step_y = 1.0f / _image.height();
 
-			tbb::parallel_for(tbb::blocked_range<int>(0, _image.height()), [&](const tbb::blocked_range<int> &range) {
-				// serial_for(tbb::blocked_range<int>(0, _image.height()), [&](const tbb::blocked_range<int> &range) {
-				for (int y = range.begin(); y < range.end(); ++y) {
-					for (int x = 0; x < _image.width(); ++x) {
-						//if (x != 264 || y != 263) {
-						//	continue;
-						//}
+			EnvmapVisibilityCache *visibilityCache = _useVisibilityCache ? _visibilityCache.get() : nullptr;
 
-						PeseudoRandom *random = _image.random(x, y);
-						glm::vec3 o;
-						glm::vec3 d;
+			auto camera_ray = [&](int x, int y, PeseudoRandom *random, glm::vec3 *o, glm::vec3 *d) {
+				*o = eye;
 
-						o = to(camera->eye);
+				float u = random->uniform();
+				float v = random->uniform();
+				glm::vec3 p_objectPlane =
+					object_o
+					+ rVector * (step_x * (x + u))
+					+ dVector * (step_y * (y + v));
 
-						float u = random->uniform();
-						float v = random->uniform();
+				*d = glm::normalize(p_objectPlane - *o);
+			};
+			auto add_sample = [&](int x, int y, glm::vec3 r, uint32_t rays) {
+				for (int i = 0; i < r.length(); ++i) {
+					if (glm::isnan(r[i])) {
+						_badSampleNanCount++;
+						r[i] = 0.0f;
+					}
+					else if (glm::isfinite(r[i]) == false) {
+						_badSampleInfCount++;
+						r[i] = 0.0f;
+					}
+					else if (r[i] < 0.0f) {
+						_badSampleNegativeCount++;
+						r[i] = 0.0f;
+					}
+					if (1000000.0f < r[i]) {
+						_badSampleFireflyCount++;
+						r[i] = 0.0f;
+					}
+				}
+				_image.add(x, y, r);
+				_image.addRays(x, y, rays);
+			};
+
+			if (_rayOrder != RayOrder::PerPixel) {
+				step_stream(camera_ray, add_sample, visibilityCache);
+				return;
+			}
+
+			// タイルの順に描く. out-of-core なら描き終えたタイルはファイルへ戻す
+			PixelWindow window = renderWindow();
+			tbb::parallel_for(tbb::blocked_range<int>(0, _image.tileCount(), 1), [&](const tbb::blocked_range<int> &range) {
+				// serial_for(tbb::blocked_range<int>(0, _image.tileCount(), 1), [&](const tbb::blocked_range<int> &range) {
+				for (int tile = range.begin(); tile < range.end(); ++tile) {
+					PixelWindow tileWindow = _image.tileWindow(tile).intersection(window);
+					uint64_t tileRays = 0;
+					for (int y = tileWindow.y0; y < tileWindow.y1; ++y) {
+						for (int x = tileWindow.x0; x < tileWindow.x1; ++x) {
+							//if (x != 264 || y != 263) {
+							//	continue;
+							//}
+
+							// サンプルごとにピクセルの乱数から split() した列を使う. step_stream() も同じ
+							Xoshiro128StarStar pixelRandom = _image.random(x, y);
+							for (int j = 0, n = sampleCount(x, y); j < n; ++j) {
+								Xoshiro128StarStar random = pixelRandom.split();
+								glm::vec3 o;
+								glm::vec3 d;
+								camera_ray(x, y, &random, &o, &d);
+
+								uint32_t rays;
+								// auto r = radiance(_scene.get(), o, d, &random, x, y, &rays);
+								auto r = bounce(glm::vec3(0.0f), glm::vec3(1.0f), 0, _scene.get(), o, d, &random, x, y, &rays, visibilityCache);
+								add_sample(x, y, r, rays);
+								tileRays += rays;
+							}
+							_image.setRandom(x, y, pixelRandom);
+						}
+					}
+					if (tileWindow.empty() == false) {
+						_tiles[tile].rays += tileRays;
+						updateTileStatistics(tile);
+					}
+					if (_image.outOfCore()) {
+						_image.evictTile(tile);
+					}
+				}
+			}, _cancel);
+		}
+		int stepCount() const {
+			return _steps;
+		}
+
+		/*
+		 1/scale の解像度で 1 サンプルずつ描いて radiance (preview_extent() の大きさ) に返す. 拡大は upsample_preview().
+		 積算バッファ, 乱数の状態, 統計には触らない. cancel() されたら途中で返るので cancelled() を見ること
+		*/
+		void renderPreview(int scale, std::vector<glm::vec3> *radiance) {
+			int w = _image.width();
+			int h = _image.height();
+			int pw = preview_extent(w, scale);
+			int ph = preview_extent(h, scale);
+			radiance->resize(pw * ph);
+
+			glm::vec3 eye, object_o, rVector, dVector;
+			objectPlane(&eye, &object_o, &rVector, &dVector);
+			float step_x = 1.0f / w;
+			float step_y = 1.0f / h;
+
+			EnvmapVisibilityCache *visibilityCache = _useVisibilityCache ? _visibilityCache.get() : nullptr;
+
+			tbb::parallel_for(tbb::blocked_range<int>(0, ph), [&](const tbb::blocked_range<int> &range) {
+				for (int j = range.begin(); j < range.end(); ++j) {
+					for (int i = 0; i < pw; ++i) {
+						// ピクセルの乱数は使わない. 下見ごとに別の列
+						Xoshiro128StarStar random((uint32_t)(j * pw + i) * 32 + scale);
+
+						// 受け持つ scale x scale のブロックのどこか
+						int x = i * scale;
+						int y = j * scale;
+						float u = random.uniform() * std::min(scale, w - x);
+						float v = random.uniform() * std::min(scale, h - y);
 						glm::vec3 p_objectPlane =
 							object_o
 							+ rVector * (step_x * (x + u))
 							+ dVector * (step_y * (y + v));
+						glm::vec3 o = eye;
+						glm::vec3 d = glm::normalize(p_objectPlane - o);
 
-						d = glm::normalize(p_objectPlane - o);
 						uint32_t rays;
-						// auto r = radiance(_scene.get(), o, d, random, x, y, &rays);
-						auto r = bounce(glm::vec3(0.0f), glm::vec3(1.0f), 0, _scene.get(), o, d, random, x, y, &rays);
-
-						for (int i = 0; i < r.length(); ++i) {
-							if (glm::isnan(r[i])) {
-								_badSampleNanCount++;
-								r[i] = 0.0f;
-							}
-							else if (glm::isfinite(r[i]) == false) {
-								_badSampleInfCount++;
-								r[i] = 0.0f;
-							}
-							else if (r[i] < 0.0f) {
-								_badSampleNegativeCount++;
-								r[i] = 0.0f;
-							}
-							if (1000000.0f < r[i]) {
-								_badSampleFireflyCount++;
-								r[i] = 0.0f;
+						glm::vec3 r = bounce(glm::vec3(0.0f), glm::vec3(1.0f), 0, _scene.get(), o, d, &random, x, y, &rays, visibilityCache);
+						for (int k = 0; k < r.length(); ++k) {
+							if (glm::isfinite(r[k]) == false || r[k] < 0.0f || 1000000.0f < r[k]) {
+								r[k] = 0.0f;
 							}
 						}
-						_image.add(x, y, r);
-						_image.addRays(x, y, rays);
+						(*radiance)[j * pw + i] = r;
 					}
 				}
-			});
+			}, _cancel);
 		}
-		int stepCount() const {
-			return _steps;
+
+		/*
+		 別のスレッドから呼べる. 走っている step() は残りの行を飛ばして返り, resetCancel() までの step() は何もしない.
+		 打ち切られた step() でも, 描いたピクセルのサンプル数と乱数の状態は正しいまま
+		*/
+		void cancel() {
+			_cancel.cancel_group_execution();
+		}
+		bool cancelled() const {
+			return _cancel.is_group_execution_cancelled();
+		}
+		// step() が走っていないときに呼ぶこと
+		void resetCancel() {
+			_cancel.reset();
+		}
+
+		// 適応サンプリングで全ピクセルが targetError 以下になった
+		bool converged() const {
+			return _adaptive.enabled && _adaptiveActivePixels == 0;
+		}
+		// _adaptive を変えたら呼ぶ. 収束した後は step() が呼ばれないので, converged() はこれで見直す
+		void refreshAdaptiveSampling() {
+			updateAdaptiveSampling();
+		}
+		/*
+		 途中経過 (画素, ピクセルごとの乱数の状態, step 数, bad sample の数) の保存と再開.
+		 key はシーンを区別する文字列で, 違えば loadCheckpoint() は失敗する.
+		 再開すると乱数は保存した時点の続きになるので, 止めずに描いた場合と同じ結果になる
+		*/
+		bool saveCheckpoint(const std::filesystem::path &path, const std::string &key) const {
+			static_assert(std::is_trivially_copyable<Image::Pixel>::value, "Image::Pixel is written as raw bytes");
+
+			int w = _image.width();
+			int h = _image.height();
+			RenderCounters counters;
+			counters.steps = _steps;
+			counters.badSampleNan = _badSampleNanCount.load();
+			counters.badSampleInf = _badSampleInfCount.load();
+			counters.badSampleNegative = _badSampleNegativeCount.load();
+			counters.badSampleFirefly = _badSampleFireflyCount.load();
+			return RenderCheckpoint::write(path, key, w, h, counters, sizeof(Image::Pixel),
+				[&](int y, uint8_t *row) {
+					for (int x = 0; x < w; ++x) {
+						memcpy(row + x * sizeof(Image::Pixel), _image.pixel(x, y), sizeof(Image::Pixel));
+					}
+				},
+				[&](int y, glm::uvec4 *row) {
+					for (int x = 0; x < w; ++x) {
+						row[x] = _image.randomState(x, y);
+					}
+				});
+		}
+		bool loadCheckpoint(const std::filesystem::path &path, const std::string &key) {
+			int w = _image.width();
+			int h = _image.height();
+			RenderCheckpoint checkpoint;
+			if (checkpoint.open(path, key, w, h, sizeof(Image::Pixel)) == false) {
+				return false;
+			}
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					memcpy(_image.pixel(x, y), checkpoint.pixels() + ((std::size_t)y * w + x) * sizeof(Image::Pixel), sizeof(Image::Pixel));
+					_image.setRandomState(x, y, checkpoint.randomState((std::size_t)y * w + x));
+				}
+			}
+			const RenderCounters &counters = checkpoint.counters();
+			_steps = counters.steps;
+			_badSampleNanCount = counters.badSampleNan;
+			_badSampleInfCount = counters.badSampleInf;
+			_badSampleNegativeCount = counters.badSampleNegative;
+			_badSampleFireflyCount = counters.badSampleFirefly;
+
+			_adaptiveActivePixels = -1;
+			_checkpointTimer = Stopwatch();
+			refreshTileStatistics();
+			return true;
+		}
+
+		// まだサンプルしているピクセル数. 適応サンプリングが動いていなければ描く範囲の全ピクセル
+		int adaptiveActivePixels() const {
+			PixelWindow window = renderWindow();
+			return _adaptiveActivePixels < 0 ? window.width() * window.height() : _adaptiveActivePixels;
+		}
+
+		const RenderSplit &split() const {
+			return _split;
+		}
+		// このプロセスが描く範囲
+		PixelWindow renderWindow() const {
+			return _split.window(_image.width(), _image.height());
+		}
+
+		// 描く範囲の積算結果を書き出す. 他のプロセスの分と merge_accumulations() でまとめる
+		bool writeAccumulation(const std::filesystem::path &path, const std::string &key) const {
+			PixelWindow window = renderWindow();
+			return RenderAccumulation::write(path, key, _image.width(), _image.height(), _split.process, window, _steps, [&](int y, AccumulationPixel *row) {
+				for (int x = window.x0; x < window.x1; ++x) {
+					row[x - window.x0] = accumulation_pixel(*_image.pixel(x, y));
+				}
+			});
 		}
 
 		int badSampleNanCount() const {
@@ -699,18 +1170,34 @@ namespace rt {
 			return _badSampleFireflyCount.load();
 		}
 
-		uint32_t getRaysPerSecond() const {
+		uint64_t getRaysPerSecond() const {
 			return _raysPerSecond;
 		}
 
+		// step() でタイルごとに数えた, この PTRenderer が飛ばしたレイの数から. 画素は読まない
 		void measureRaysPerSecond() {
-			uint32_t rays = 0;
-			for (int y = 0 ; y < _image.height(); ++y) {
-				for (int x = 0; x < _image.width(); ++x) {
-					rays += _image.pixel(x, y)->rays;
-				}
+			uint64_t rays = 0;
+			for (const TileStatistics &tile : _tiles) {
+				rays += tile.rays;
 			}
-			_raysPerSecond = rays / _cpuTimer.elapsed();
+			_raysPerSecond = (uint64_t)(rays / _cpuTimer.elapsed());
+		}
+
+		/*
+		 表示用の縮小画像. 縦横 1/displayScale() で, 1 画素は displayScale() x displayScale() のブロックの color / sample の平均.
+		 step() が描き終えたタイルから更新するので, 読むときに積算バッファには触らない. step() の合間に読むこと
+		*/
+		const std::vector<glm::vec3> &display() const {
+			return _display;
+		}
+		int displayScale() const {
+			return _displayScale;
+		}
+		int displayWidth() const {
+			return preview_extent(_image.width(), _displayScale);
+		}
+		int displayHeight() const {
+			return preview_extent(_image.height(), _displayScale);
 		}
 
 		std::shared_ptr<rt::Scene> _scene;
@@ -722,6 +1209,297 @@ namespace rt {
 		std::atomic<int> _badSampleFireflyCount;
 
 		Stopwatch _cpuTimer;
-		uint32_t _raysPerSecond = 0;
+		uint64_t _raysPerSecond = 0;
+
+		bool _useVisibilityCache = false;
+		std::unique_ptr<EnvmapVisibilityCache> _visibilityCache;
+
+		// 2 回目以降のレイの渡し方. 速さを比べるための切り替え
+		RayOrder _rayOrder = RayOrder::PerPixel;
+
+		AdaptiveSamplingConfig _adaptive;
+
+		// 空でなければ step() の中で _checkpointIntervalSeconds ごとに saveCheckpoint() する
+		std::filesystem::path _checkpointPath;
+		std::string _checkpointKey;
+		double _checkpointIntervalSeconds = 300.0;
+	private:
+		// 乱数列が決まるのでコンストラクタでだけ与える
+		RenderSplit _split;
+
+		Stopwatch _checkpointTimer;
+
+		// oneTBB の is_group_execution_cancelled() は const でない
+		mutable tbb::task_group_context _cancel;
+
+		// カメラの位置と, 画像の左上の角から右端, 下端へのベクトル (焦点面上)
+		void objectPlane(glm::vec3 *eye, glm::vec3 *object_o, glm::vec3 *rVector, glm::vec3 *dVector) const {
+			auto to = [](houdini_alembic::Vector3f p) {
+				return glm::vec3(p.x, p.y, p.z);
+			};
+			auto camera = _scene->camera();
+			*eye = to(camera->eye);
+			*object_o =
+				to(camera->eye) + to(camera->forward) * camera->focusDistance
+				+ to(camera->left) * camera->objectPlaneWidth * 0.5f
+
+				+ to(camera->up) * camera->objectPlaneHeight * 0.5f;
+			*rVector = to(camera->right) * camera->objectPlaneWidth;
+			*dVector = to(camera->down) * camera->objectPlaneHeight;
+		}
+
+		// 描く直前のピクセルの誤差と, step の始めに足し合わせた全タイルの AdaptiveErrorSum から
+		int sampleCount(int x, int y) const {
+			if (_adaptiveActivePixels < 0) {
+				return 1;
+			}
+			PixelWindow window = renderWindow();
+			return adaptive_sample_count(relative_error(_image.pixel(x, y)->luminance), _adaptive.targetError, window.width() * window.height(), _adaptive.maxSamplesPerStep, _adaptiveErrorSum);
+		}
+
+		// pilot の後は, 毎 step ピクセル数と同じだけのサンプルを誤差の大きいピクセルに配る
+		void updateAdaptiveSampling() {
+			if (_adaptive.enabled == false || _steps < _adaptive.pilotSteps) {
+				_adaptiveActivePixels = -1;
+				return;
+			}
+
+			// タイルの AdaptiveErrorSum は作ったときの targetError のもの. UI で変わったときだけ読み直す
+			if (_tileErrorTarget != _adaptive.targetError) {
+				refreshTileStatistics();
+			}
+			_adaptiveErrorSum = AdaptiveErrorSum();
+			for (const TileStatistics &tile : _tiles) {
+				_adaptiveErrorSum.merge(tile.errors);
+			}
+			_adaptiveActivePixels = _adaptiveErrorSum.active;
+		}
+
+		/*
+		 タイルの AdaptiveErrorSum と表示用の縮小画像を作り直す. step() で描き終えたタイルから呼ぶので, 画素はまだメモリにある.
+		 範囲外は描かないので誤差 0 として予算を配らない
+		*/
+		void updateTileStatistics(int tile) {
+			PixelWindow tileWindow = _image.tileWindow(tile);
+			PixelWindow window = renderWindow();
+			float target = _adaptive.targetError;
+			AdaptiveErrorSum errors;
+			for (int y = tileWindow.y0; y < tileWindow.y1; ++y) {
+				for (int x = tileWindow.x0; x < tileWindow.x1; ++x) {
+					if (window.contains(x, y)) {
+						errors.add(relative_error(_image.pixel(x, y)->luminance), target);
+					}
+				}
+			}
+			_tiles[tile].errors = errors;
+
+			// kTileSize は _displayScale の倍数なので, ブロックはタイルをまたがない
+			int s = _displayScale;
+			int dw = displayWidth();
+			for (int by = tileWindow.y0; by < tileWindow.y1; by += s) {
+				for (int bx = tileWindow.x0; bx < tileWindow.x1; bx += s) {
+					glm::vec3 sum(0.0f);
+					int n = 0;
+					for (int y = by; y < std::min(by + s, tileWindow.y1); ++y) {
+						for (int x = bx; x < std::min(bx + s, tileWindow.x1); ++x) {
+							const Image::Pixel *px = _image.pixel(x, y);
+							sum += px->sample == 0 ? glm::vec3(0.0f) : px->color / (float)px->sample;
+							n++;
+						}
+					}
+					_display[(std::size_t)(by / s) * dw + bx / s] = sum / (float)n;
+				}
+			}
+		}
+		// 全タイルを読み直す. 作ったとき, loadCheckpoint() の後, targetError が変わったとき
+		void refreshTileStatistics() {
+			_tileErrorTarget = _adaptive.targetError;
+			tbb::parallel_for(tbb::blocked_range<int>(0, _image.tileCount(), 1), [&](const tbb::blocked_range<int> &range) {
+				for (int tile = range.begin(); tile < range.end(); ++tile) {
+					updateTileStatistics(tile);
+					if (_image.outOfCore()) {
+						_image.evictTile(tile);
+					}
+				}
+			});
+		}
+
+		enum {
+			kTileSize = TiledFramebuffer<Image::Pixel>::kTileSize,
+			// 表示用の縮小画像はこの画素数まで. UHD 4K はフル解像度のまま
+			kDisplayMaxPixels = 3840 * 2160,
+		};
+
+		// タイルごとに step() で更新する. 画像全体の統計はこれを足し合わせるだけで, 画素は読まない
+		struct TileStatistics {
+			uint64_t rays = 0;
+			AdaptiveErrorSum errors;
+		};
+		std::vector<TileStatistics> _tiles;
+		float _tileErrorTarget = 0.0f;
+		std::vector<glm::vec3> _display;
+		int _displayScale = 1;
+
+		AdaptiveErrorSum _adaptiveErrorSum;
+		int _adaptiveActivePixels = -1;
+
+		struct PathStream {
+			std::vector<PathState> paths;
+			std::vector<uint32_t> active;
+			std::vector<glm::vec3> ro;
+			std::vector<glm::vec3> rd;
+			std::vector<uint32_t> order;
+			std::vector<HitRecord> hits;
+			std::vector<uint8_t> found;
+			RaySorter sorter;
+			// paths と同じ並び. サンプルごとにピクセルの乱数から split() した列
+			std::vector<Xoshiro128StarStar> randoms;
+
+			// active と同じ並び. 0 : 終わった, 1 : 環境マップ側, 2 : BxDF 側 (queue で sample_eval())
+			std::vector<PathHit> pathHits;
+			std::vector<uint8_t> shading;
+			std::vector<BxDFSample> sampled;
+			std::unique_ptr<ShadingQueue> queue;
+		};
+
+		/*
+		 _rayOrder が Stream, OctantMorton のとき.
+		 1 タイルずつ, カメラレイはピクセル順に 1 本ずつ, 2 回目以降はまとめて Scene::intersect() に渡す.
+		 BxDF の sample_eval() は 1 回ごとに ShadingQueue でマテリアルの種類ごとにまとめる.
+		 乱数は PerPixel と同じくサンプルごとにピクセルの乱数から split() するので, サンプルが乱数を使う順は交差判定の順によらない.
+		 結果は PerPixel と同じ (sample_eval() の fast_math の誤差を除く)
+		*/
+		template <class CameraRay, class AddSample>
+		void step_stream(const CameraRay &camera_ray, const AddSample &add_sample, EnvmapVisibilityCache *visibilityCache) {
+			bool sort = _rayOrder == RayOrder::OctantMorton;
+
+			glm::vec3 lower, upper;
+			_scene->bounds(&lower, &upper);
+
+			PixelWindow window = renderWindow();
+			tbb::parallel_for(tbb::blocked_range<int>(0, _image.tileCount(), 1), [&](const tbb::blocked_range<int> &range) {
+				for (int tile = range.begin(); tile < range.end(); ++tile) {
+					PixelWindow tileWindow = _image.tileWindow(tile).intersection(window);
+					if (tileWindow.empty() == false) {
+						_tiles[tile].rays += step_stream_tile(tileWindow, camera_ray, add_sample, visibilityCache, sort, lower, upper);
+						updateTileStatistics(tile);
+					}
+					if (_image.outOfCore()) {
+						_image.evictTile(tile);
+					}
+				}
+			}, _cancel);
+		}
+
+		// 戻り値はタイルで飛ばしたレイの数
+		template <class CameraRay, class AddSample>
+		uint64_t step_stream_tile(const PixelWindow &tileWindow, const CameraRay &camera_ray, const AddSample &add_sample, EnvmapVisibilityCache *visibilityCache, bool sort, glm::vec3 lower, glm::vec3 upper) {
+			static thread_local PathStream stream;
+			std::vector<PathState> &paths = stream.paths;
+			std::vector<uint32_t> &active = stream.active;
+			std::vector<Xoshiro128StarStar> &randoms = stream.randoms;
+			paths.clear();
+			active.clear();
+			randoms.clear();
+
+			// シーンが変わったら作り直す
+			const MaterialTable *table = &_scene->material_table();
+			if (stream.queue == nullptr || stream.queue->table() != table) {
+				stream.queue.reset(new ShadingQueue(table));
+			}
+
+			// カメラレイはピクセル順に 1 本ずつ交差判定する
+			for (int y = tileWindow.y0; y < tileWindow.y1; ++y) {
+				for (int x = tileWindow.x0; x < tileWindow.x1; ++x) {
+					Xoshiro128StarStar pixelRandom = _image.random(x, y);
+					for (int j = 0, n = sampleCount(x, y); j < n; ++j) {
+						randoms.push_back(pixelRandom.split());
+						PathState path;
+						path.Lo = glm::vec3(0.0f);
+						path.T = glm::vec3(1.0f);
+						path.px = x;
+						path.py = y;
+						camera_ray(x, y, &randoms.back(), &path.ro, &path.rd);
+						active.push_back((uint32_t)paths.size());
+						paths.push_back(path);
+					}
+					_image.setRandom(x, y, pixelRandom);
+				}
+			}
+			stream.hits.resize(active.size());
+			stream.found.resize(active.size());
+			for (int k = 0; k < active.size(); ++k) {
+				const PathState &path = paths[active[k]];
+				stream.found[k] = _scene->intersect(path.ro, path.rd, &stream.hits[k]) ? 1 : 0;
+			}
+
+			for (;;) {
+				// BxDF 側の sample_eval() はマテリアルの種類ごとにまとめる
+				int n = (int)active.size();
+				stream.pathHits.resize(n);
+				stream.shading.resize(n);
+				stream.sampled.resize(n);
+				for (int k = 0; k < n; ++k) {
+					PathState &path = paths[active[k]];
+					if (bounce_hit(&path, stream.found[k] != 0, stream.hits[k], _scene.get(), visibilityCache, &stream.pathHits[k]) == false) {
+						stream.shading[k] = 0;
+						continue;
+					}
+					PeseudoRandom *random = &randoms[active[k]];
+					if (random->uniform() < 0.5f) {
+						float u0 = random->uniform();
+						float u1 = random->uniform();
+						stream.queue->push(k, -path.rd, stream.pathHits[k].shadingPoint, _scene->material_slot(stream.hits[k]), u0, u1);
+						stream.shading[k] = 2;
+					}
+					else {
+						stream.shading[k] = 1;
+					}
+				}
+				stream.queue->sample_eval(stream.sampled.data());
+
+				int m = 0;
+				for (int k = 0; k < n; ++k) {
+					if (stream.shading[k] == 0) {
+						continue;
+					}
+					PathState &path = paths[active[k]];
+					PeseudoRandom *random = &randoms[active[k]];
+					if (bounce_continue(&path, stream.pathHits[k], stream.shading[k] == 2, stream.sampled[k], _scene.get(), random, visibilityCache)) {
+						active[m++] = active[k];
+					}
+				}
+				active.resize(m);
+				if (m == 0) {
+					break;
+				}
+
+				stream.ro.resize(m);
+				stream.rd.resize(m);
+				stream.order.resize(m);
+				stream.hits.resize(m);
+				stream.found.resize(m);
+				for (int k = 0; k < m; ++k) {
+					stream.ro[k] = paths[active[k]].ro;
+					stream.rd[k] = paths[active[k]].rd;
+				}
+				if (sort) {
+					stream.sorter.sort(stream.ro.data(), stream.rd.data(), m, lower, upper, stream.order.data());
+				}
+				else {
+					for (int k = 0; k < m; ++k) {
+						stream.order[k] = k;
+					}
+				}
+				_scene->intersect(m, stream.ro.data(), stream.rd.data(), stream.order.data(), sort, stream.hits.data(), stream.found.data());
+			}
+
+			uint64_t rays = 0;
+			for (const PathState &path : paths) {
+				add_sample(path.px, path.py, path.Lo, path.rays);
+				rays += path.rays;
+			}
+			return rays;
+		}
 	};
 }
\ No newline at end of file
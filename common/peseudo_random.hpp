@@ -117,9 +117,57 @@ namespace rt {
 			s[2] = s2;
 			s[3] = s3;
 		}
+		/*
+		This is the long-jump function for the generator. It is equivalent to
+		2^96 calls to next(); it can be used to generate 2^32 starting points,
+		from each of which jump() will generate 2^32 non-overlapping
+		subsequences for parallel distributed computations.
+		*/
+		void long_jump() {
+			static const uint32_t LONG_JUMP[] = { 0xb523952e, 0x0b6f099f, 0xccf5a0ef, 0x1c580662 };
+
+			uint32_t s0 = 0;
+			uint32_t s1 = 0;
+			uint32_t s2 = 0;
+			uint32_t s3 = 0;
+			for (int i = 0; i < sizeof LONG_JUMP / sizeof *LONG_JUMP; i++)
+				for (int b = 0; b < 32; b++) {
+					if (LONG_JUMP[i] & UINT32_C(1) << b) {
+						s0 ^= s[0];
+						s1 ^= s[1];
+						s2 ^= s[2];
+						s3 ^= s[3];
+					}
+					next();
+				}
+
+			s[0] = s0;
+			s[1] = s1;
+			s[2] = s2;
+			s[3] = s3;
+		}
 		glm::uvec4 state() const {
 			return glm::uvec4(s[0], s[1], s[2], s[3]);
 		}
+		// state() で取ったものを戻す. 同じ続きの列になる
+		void set_state(const glm::uvec4 &state) {
+			s[0] = state.x;
+			s[1] = state.y;
+			s[2] = state.z;
+			s[3] = state.w;
+		}
+		// この列から 64 bit を引いて種にした別の列. 子をどれだけ使っても, この列が進むのはいつも 2 回分
+		Xoshiro128StarStar split() {
+			splitmix64 sp;
+			sp.x = (uint64_t(next()) << 32) | next();
+			uint64_t r0 = sp.next();
+			uint64_t r1 = sp.next();
+			Xoshiro128StarStar child(r0 & 0xFFFFFFFF, (r0 >> 32) & 0xFFFFFFFF, r1 & 0xFFFFFFFF, (r1 >> 32) & 0xFFFFFFFF);
+			if (child.state() == glm::uvec4(0, 0, 0, 0)) {
+				child.s[0] = 1;
+			}
+			return child;
+		}
 	private:
 		uint32_t rotl(const uint32_t x, int k) {
 			return (x << k) | (x >> (32 - k));
@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <tbb/tbb.h>
+#include <glm/glm.hpp>
+
+namespace rt {
+	/*
+	 描き始めの下見. フル解像度の 1 step を待たずに, 粗い解像度から順に 1 サンプルずつ描いて拡大して見せる.
+	 積算バッファには触らないので, その後の結果は下見なしと同じ
+	*/
+	// 縦横それぞれ 1/scale. 粗い順
+	constexpr int kPreviewScales[] = { 16, 8, 4, 2 };
+
+	inline int preview_extent(int extent, int scale) {
+		return (extent + scale - 1) / scale;
+	}
+
+	// src (preview_extent() の大きさ) を width x height に bilinear で拡大する.
+	// src の (i, j) は dst の [i * scale, (i + 1) * scale) x [j * scale, (j + 1) * scale) を描いたもの
+	inline void upsample_preview(const glm::vec3 *src, int scale, int width, int height, glm::vec3 *dst) {
+		int srcWidth = preview_extent(width, scale);
+		int srcHeight = preview_extent(height, scale);
+		float invScale = 1.0f / scale;
+		tbb::parallel_for(tbb::blocked_range<int>(0, height), [&](const tbb::blocked_range<int> &range) {
+			for (int y = range.begin(); y < range.end(); ++y) {
+				float sy = glm::clamp((y + 0.5f) * invScale - 0.5f, 0.0f, (float)(srcHeight - 1));
+				int y0 = std::min((int)sy, srcHeight - 1);
+				int y1 = std::min(y0 + 1, srcHeight - 1);
+				float ty = sy - y0;
+				const glm::vec3 *row0 = src + y0 * srcWidth;
+				const glm::vec3 *row1 = src + y1 * srcWidth;
+				for (int x = 0; x < width; ++x) {
+					float sx = glm::clamp((x + 0.5f) * invScale - 0.5f, 0.0f, (float)(srcWidth - 1));
+					int x0 = std::min((int)sx, srcWidth - 1);
+					int x1 = std::min(x0 + 1, srcWidth - 1);
+					float tx = sx - x0;
+					glm::vec3 a = glm::mix(row0[x0], row0[x1], tx);
+					glm::vec3 b = glm::mix(row1[x0], row1[x1], tx);
+					dst[y * width + x] = glm::mix(a, b, ty);
+				}
+			}
+		});
+	}
+}
\ No newline at end of file
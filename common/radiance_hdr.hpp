@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "texel_format.hpp"
+
+namespace rt {
+	/*
+	 Radiance .hdr reader that hands out raw RGBE scanlines.
+	 it lets the caller convert each row straight into its own storage,
+	 no full resolution float buffer is made.
+	 only "-Y h +X w" (same as stb_image) is supported. if false is returned, use another loader.
+	*/
+	inline bool read_radiance_hdr(const char *filename,
+		const std::function<void(int width, int height)> &on_header,
+		const std::function<void(int y, const TexelRGBE *row)> &on_scanline) {
+		std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(filename, "rb"), fclose);
+		if (!fp) {
+			return false;
+		}
+
+		auto read_line = [&fp](std::string *line) {
+			line->clear();
+			int c;
+			while ((c = fgetc(fp.get())) != EOF && c != '\n') {
+				line->push_back((char)c);
+			}
+			return c != EOF || line->empty() == false;
+		};
+
+		std::string line;
+		if (read_line(&line) == false || (line != "#?RADIANCE" && line != "#?RGBE")) {
+			return false;
+		}
+		bool valid_format = false;
+		for (;;) {
+			if (read_line(&line) == false) {
+				return false;
+			}
+			if (line.empty()) {
+				break;
+			}
+			if (line == "FORMAT=32-bit_rle_rgbe") {
+				valid_format = true;
+			}
+		}
+		if (valid_format == false) {
+			return false;
+		}
+
+		int width, height;
+		if (read_line(&line) == false || sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2) {
+			return false;
+		}
+		if (width <= 0 || height <= 0) {
+			return false;
+		}
+		on_header(width, height);
+
+		std::vector<TexelRGBE> row(width);
+		std::vector<uint8_t> channels(width * 4);
+		for (int y = 0; y < height; ++y) {
+			uint8_t head[4];
+			if (fread(head, 1, 4, fp.get()) != 4) {
+				return false;
+			}
+
+			bool rle = 8 <= width && width < 0x8000 && head[0] == 2 && head[1] == 2 && (head[2] & 0x80) == 0;
+			if (rle == false) {
+				// flat scanline
+				memcpy(row.data(), head, 4);
+				if (1 < width && fread(row.data() + 1, 4, width - 1, fp.get()) != (size_t)(width - 1)) {
+					return false;
+				}
+				// old style run length ( 1, 1, 1, n ) is not supported
+				for (int x = 0; x < width; ++x) {
+					if (row[x].r == 1 && row[x].g == 1 && row[x].b == 1) {
+						return false;
+					}
+				}
+				on_scanline(y, row.data());
+				continue;
+			}
+
+			if (((head[2] << 8) | head[3]) != width) {
+				return false;
+			}
+
+			// 4 channels are stored separately
+			for (int c = 0; c < 4; ++c) {
+				uint8_t *dst = channels.data() + c * width;
+				int x = 0;
+				while (x < width) {
+					int count = fgetc(fp.get());
+					if (count == EOF) {
+						return false;
+					}
+					if (128 < count) {
+						count -= 128;
+						int value = fgetc(fp.get());
+						if (value == EOF || width - x < count) {
+							return false;
+						}
+						memset(dst + x, value, count);
+					}
+					else {
+						if (count == 0 || width - x < count || fread(dst + x, 1, count, fp.get()) != (size_t)count) {
+							return false;
+						}
+					}
+					x += count;
+				}
+			}
+			for (int x = 0; x < width; ++x) {
+				row[x].r = channels[x];
+				row[x].g = channels[width + x];
+				row[x].b = channels[width * 2 + x];
+				row[x].e = channels[width * 3 + x];
+			}
+			on_scanline(y, row.data());
+		}
+		return true;
+	}
+}
\ No newline at end of file
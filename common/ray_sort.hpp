@@ -0,0 +1,87 @@
+﻿#pragma once
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+namespace rt {
+	// PTRenderer が 2 回目以降のレイをどう Embree に渡すか
+	enum class RayOrder : uint8_t {
+		PerPixel,     // ピクセルごとに bounce() (今まで通り)
+		Stream,       // タイル内をまとめて rtcIntersect1M, 並べ替えなし
+		OctantMorton, // まとめて, 方向の象限 + 始点の Morton 順に並べ替える
+	};
+
+	// 下位 9 bit を 3 bit おきに広げる
+	inline uint32_t morton_expand_bits_9(uint32_t v) {
+		v &= 0x1FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+	inline uint32_t morton_code_9(uint32_t x, uint32_t y, uint32_t z) {
+		return morton_expand_bits_9(x) | (morton_expand_bits_9(y) << 1) | (morton_expand_bits_9(z) << 2);
+	}
+
+	/*
+	 30 bit key = [direction octant : 3][morton code of the origin : 27]
+	 origin is quantized to 512^3 in the scene bounds
+	*/
+	inline uint32_t ray_sort_key(const glm::vec3 &ro, const glm::vec3 &rd, const glm::vec3 &lower, const glm::vec3 &invExtent) {
+		uint32_t octant = (rd.x < 0.0f ? 1u : 0u) | (rd.y < 0.0f ? 2u : 0u) | (rd.z < 0.0f ? 4u : 0u);
+		glm::vec3 q = glm::clamp((ro - lower) * invExtent, glm::vec3(0.0f), glm::vec3(1.0f)) * 511.0f;
+		return (octant << 27) | morton_code_9((uint32_t)q.x, (uint32_t)q.y, (uint32_t)q.z);
+	}
+
+	// ray_sort_key() の順に並べた添字を作る. 10 bit x 3 回の LSD radix sort なので安定
+	class RaySorter {
+	public:
+		enum {
+			kRadixBits = 10,
+			kRadixSize = 1 << kRadixBits,
+			kPasses = 3,
+		};
+
+		void sort(const glm::vec3 *ro, const glm::vec3 *rd, int n, const glm::vec3 &lower, const glm::vec3 &upper, uint32_t *order) {
+			glm::vec3 extent = glm::max(upper - lower, glm::vec3(1.0e-6f));
+			glm::vec3 invExtent = glm::vec3(1.0f) / extent;
+
+			_keys.resize(n);
+			_keysTmp.resize(n);
+			_indices.resize(n);
+			_indicesTmp.resize(n);
+			for (int i = 0; i < n; ++i) {
+				_keys[i] = ray_sort_key(ro[i], rd[i], lower, invExtent);
+				_indices[i] = i;
+			}
+
+			for (int pass = 0; pass < kPasses; ++pass) {
+				int shift = pass * kRadixBits;
+				uint32_t offsets[kRadixSize] = {};
+				for (int i = 0; i < n; ++i) {
+					offsets[(_keys[i] >> shift) & (kRadixSize - 1)]++;
+				}
+				uint32_t sum = 0;
+				for (int d = 0; d < kRadixSize; ++d) {
+					uint32_t c = offsets[d];
+					offsets[d] = sum;
+					sum += c;
+				}
+				for (int i = 0; i < n; ++i) {
+					uint32_t dst = offsets[(_keys[i] >> shift) & (kRadixSize - 1)]++;
+					_keysTmp[dst] = _keys[i];
+					_indicesTmp[dst] = _indices[i];
+				}
+				std::swap(_keys, _keysTmp);
+				std::swap(_indices, _indicesTmp);
+			}
+			std::copy(_indices.begin(), _indices.end(), order);
+		}
+	private:
+		std::vector<uint32_t> _keys;
+		std::vector<uint32_t> _keysTmp;
+		std::vector<uint32_t> _indices;
+		std::vector<uint32_t> _indicesTmp;
+	};
+}
\ No newline at end of file
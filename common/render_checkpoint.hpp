@@ -0,0 +1,141 @@
+﻿#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "mapped_file.hpp"
+#include "assertion.hpp"
+
+namespace rt {
+	// PTRenderer の画素以外の途中経過
+	struct RenderCounters {
+		int32_t steps = 0;
+		int32_t badSampleNan = 0;
+		int32_t badSampleInf = 0;
+		int32_t badSampleNegative = 0;
+		int32_t badSampleFirefly = 0;
+	};
+
+	/*
+	 Binary checkpoint of a progressive render
+	   [Header][key, padded to 8 bytes][pixels : width * height * pixelBytes][rng states : width * height * uvec4]
+	 written by write_file_atomic(), so the previous checkpoint stays valid until the new one is complete.
+	 pixels and states are pulled one row at a time, so no full frame copy is made.
+	 read back through MappedFile. the key (scene identity chosen by the caller), the resolution and
+	 the size of a pixel must match, otherwise open() fails and the render starts over.
+	*/
+	class RenderCheckpoint {
+	public:
+		enum {
+			kVersion = 1,
+		};
+
+		// readPixels(y, row) fills width pixels of the row y, readRandomStates(y, row) fills width states
+		static bool write(const std::filesystem::path &path, const std::string &key, int width, int height, const RenderCounters &counters, uint32_t pixelBytes,
+			const std::function<void(int, uint8_t *)> &readPixels, const std::function<void(int, glm::uvec4 *)> &readRandomStates) {
+			Header header;
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.version = kVersion;
+			header.keyBytes = (uint32_t)key.size();
+			header.width = width;
+			header.height = height;
+			header.pixelBytes = pixelBytes;
+			header.counters = counters;
+
+			return write_file_atomic(path, [&](FILE *fp) {
+				const char zeros[8] = {};
+				bool ok = true;
+				ok = ok && fwrite(&header, sizeof(Header), 1, fp) == 1;
+				ok = ok && fwrite(key.data(), 1, key.size(), fp) == key.size();
+				ok = ok && fwrite(zeros, 1, padded(header.keyBytes) - key.size(), fp) == padded(header.keyBytes) - key.size();
+				std::vector<uint8_t> pixels((std::size_t)width * pixelBytes);
+				for (int y = 0; y < height && ok; ++y) {
+					readPixels(y, pixels.data());
+					ok = fwrite(pixels.data(), pixelBytes, width, fp) == (std::size_t)width;
+				}
+				std::vector<glm::uvec4> states(width);
+				for (int y = 0; y < height && ok; ++y) {
+					readRandomStates(y, states.data());
+					ok = fwrite(states.data(), sizeof(glm::uvec4), width, fp) == (std::size_t)width;
+				}
+				return ok;
+			});
+		}
+
+		// if succeeded return true. pixels() stays mapped until close()
+		bool open(const std::filesystem::path &path, const std::string &key, int width, int height, uint32_t pixelBytes) {
+			close();
+			if (_file.open(path) == false) {
+				return false;
+			}
+
+			Header header;
+			if (_file.size() < sizeof(Header)) {
+				close();
+				return false;
+			}
+			memcpy(&header, _file.data(), sizeof(Header));
+
+			uint64_t N = (uint64_t)width * height;
+			uint64_t expected = sizeof(Header) + padded(header.keyBytes) + N * (pixelBytes + sizeof(glm::uvec4));
+			bool ok =
+				memcmp(header.magic, kMagic, sizeof(header.magic)) == 0 &&
+				header.version == kVersion &&
+				header.width == width &&
+				header.height == height &&
+				header.pixelBytes == pixelBytes &&
+				_file.size() == expected &&
+				header.keyBytes == key.size() &&
+				memcmp(_file.data() + sizeof(Header), key.data(), key.size()) == 0;
+			if (ok == false) {
+				close();
+				return false;
+			}
+
+			_counters = header.counters;
+			_pixels = _file.data() + sizeof(Header) + padded(header.keyBytes);
+			_randomStates = _pixels + N * pixelBytes;
+			return true;
+		}
+		void close() {
+			_file.close();
+			_pixels = nullptr;
+			_randomStates = nullptr;
+		}
+
+		const RenderCounters &counters() const {
+			return _counters;
+		}
+		const uint8_t *pixels() const {
+			return _pixels;
+		}
+		glm::uvec4 randomState(std::size_t index) const {
+			glm::uvec4 state;
+			memcpy(&state, _randomStates + index * sizeof(glm::uvec4), sizeof(glm::uvec4));
+			return state;
+		}
+	private:
+		static constexpr char kMagic[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', 'P' };
+		struct Header {
+			char magic[8];
+			uint32_t version = 0;
+			uint32_t keyBytes = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			uint32_t pixelBytes = 0;
+			RenderCounters counters;
+		};
+		static std::size_t padded(std::size_t bytes) {
+			return (bytes + 7) & ~std::size_t(7);
+		}
+
+		MappedFile _file;
+		RenderCounters _counters;
+		const uint8_t *_pixels = nullptr;
+		const uint8_t *_randomStates = nullptr;
+	};
+}
\ No newline at end of file
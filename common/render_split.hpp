@@ -0,0 +1,296 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+#include <tbb/tbb.h>
+#include <glm/glm.hpp>
+
+#include "mapped_file.hpp"
+#include "float_image_writer.hpp"
+#include "online.hpp"
+#include "assertion.hpp"
+
+namespace rt {
+	// [x0, x1) x [y0, y1)
+	struct PixelWindow {
+		int x0 = 0;
+		int y0 = 0;
+		int x1 = 0;
+		int y1 = 0;
+
+		int width() const {
+			return x1 - x0;
+		}
+		int height() const {
+			return y1 - y0;
+		}
+		bool empty() const {
+			return x1 <= x0 || y1 <= y0;
+		}
+		bool contains(int x, int y) const {
+			return x0 <= x && x < x1 && y0 <= y && y < y1;
+		}
+		bool overlaps(const PixelWindow &other) const {
+			return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+		}
+		// 重ならなければ empty()
+		PixelWindow intersection(const PixelWindow &other) const {
+			PixelWindow w;
+			w.x0 = std::max(x0, other.x0);
+			w.y0 = std::max(y0, other.y0);
+			w.x1 = std::max(std::min(x1, other.x1), w.x0);
+			w.y1 = std::max(std::min(y1, other.y1), w.y0);
+			return w;
+		}
+	};
+
+	/*
+	 1 枚の画像を複数のプロセスで分けて描くときの担当.
+	 process ごとに乱数列を long_jump() で 2^96 ずつずらすので, 同じ画素を描いてもサンプルは独立になる.
+	 (ピクセルごとの jump() は 2^64 ずつなので, 2^32 ピクセルまでは重ならない)
+	 crop が空なら画像全体, そうでなければその矩形だけを描く
+	*/
+	struct RenderSplit {
+		int process = 0;
+		PixelWindow crop;
+
+		PixelWindow window(int width, int height) const {
+			PixelWindow w;
+			w.x1 = width;
+			w.y1 = height;
+			if (crop.empty()) {
+				return w;
+			}
+			w.x0 = glm::clamp(crop.x0, 0, width);
+			w.y0 = glm::clamp(crop.y0, 0, height);
+			w.x1 = glm::clamp(crop.x1, w.x0, width);
+			w.y1 = glm::clamp(crop.y1, w.y0, height);
+			return w;
+		}
+	};
+
+	// 合成できる形のピクセル. color は和, 輝度は平均と偏差平方和
+	struct AccumulationPixel {
+		glm::vec3 color = glm::vec3(0.0f);
+		int32_t sample = 0;
+		uint32_t rays = 0;
+		float luminanceMean = 0.0f;
+		float luminanceM2 = 0.0f;
+
+		OnlineVariance<float> luminance() const {
+			return OnlineVariance<float>(sample, luminanceMean, luminanceM2);
+		}
+		void merge(const AccumulationPixel &other) {
+			OnlineVariance<float> v = luminance();
+			v.merge(other.luminance());
+			color += other.color;
+			sample += other.sample;
+			rays += other.rays;
+			luminanceMean = v.mean();
+			luminanceM2 = v.m2();
+		}
+	};
+
+	/*
+	 1 プロセス分の生の積算結果
+	   [Header][key, padded to 8 bytes][pixels : window.width() * window.height() * AccumulationPixel]
+	 window の外は持たない. 書き込みは write_file_atomic(), 読み込みは MappedFile.
+	 key はシーンの識別で, 違うシーンのファイルは merge_accumulations() で弾かれる
+	*/
+	class RenderAccumulation {
+	public:
+		enum {
+			kVersion = 1,
+		};
+
+		// readRow(y, row) は window の y 行目 (画像全体の座標) の window.width() 個を row に書く
+		static bool write(const std::filesystem::path &path, const std::string &key, int width, int height, int process, const PixelWindow &window, int steps, const std::function<void(int, AccumulationPixel *)> &readRow) {
+			Header header;
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.version = kVersion;
+			header.keyBytes = (uint32_t)key.size();
+			header.width = width;
+			header.height = height;
+			header.process = process;
+			header.steps = steps;
+			header.window = window;
+
+			return write_file_atomic(path, [&](FILE *fp) {
+				const char zeros[8] = {};
+				bool ok = true;
+				ok = ok && fwrite(&header, sizeof(Header), 1, fp) == 1;
+				ok = ok && fwrite(key.data(), 1, key.size(), fp) == key.size();
+				ok = ok && fwrite(zeros, 1, padded(header.keyBytes) - key.size(), fp) == padded(header.keyBytes) - key.size();
+				std::vector<AccumulationPixel> row(window.width());
+				for (int y = window.y0; y < window.y1 && ok; ++y) {
+					readRow(y, row.data());
+					ok = fwrite(row.data(), sizeof(AccumulationPixel), row.size(), fp) == row.size();
+				}
+				return ok;
+			});
+		}
+
+		// if succeeded return true
+		bool open(const std::filesystem::path &path) {
+			close();
+			if (_file.open(path) == false) {
+				return false;
+			}
+			if (_file.size() < sizeof(Header)) {
+				close();
+				return false;
+			}
+			memcpy(&_header, _file.data(), sizeof(Header));
+
+			const PixelWindow &w = _header.window;
+			bool ok =
+				memcmp(_header.magic, kMagic, sizeof(_header.magic)) == 0 &&
+				_header.version == kVersion &&
+				0 <= w.x0 && w.x0 <= w.x1 && w.x1 <= _header.width &&
+				0 <= w.y0 && w.y0 <= w.y1 && w.y1 <= _header.height &&
+				_file.size() == sizeof(Header) + padded(_header.keyBytes) + (uint64_t)w.width() * w.height() * sizeof(AccumulationPixel);
+			if (ok == false) {
+				close();
+				return false;
+			}
+			_key.assign((const char *)_file.data() + sizeof(Header), _header.keyBytes);
+			_pixels = _file.data() + sizeof(Header) + padded(_header.keyBytes);
+			return true;
+		}
+		void close() {
+			_file.close();
+			_header = Header();
+			_key.clear();
+			_pixels = nullptr;
+		}
+
+		const std::string &key() const {
+			return _key;
+		}
+		int width() const {
+			return _header.width;
+		}
+		int height() const {
+			return _header.height;
+		}
+		int process() const {
+			return _header.process;
+		}
+		int steps() const {
+			return _header.steps;
+		}
+		const PixelWindow &window() const {
+			return _header.window;
+		}
+
+		// x, y は画像全体の座標. window の中であること
+		AccumulationPixel pixel(int x, int y) const {
+			RT_ASSERT(_header.window.contains(x, y));
+			const PixelWindow &w = _header.window;
+			AccumulationPixel p;
+			memcpy(&p, _pixels + ((std::size_t)(y - w.y0) * w.width() + (x - w.x0)) * sizeof(AccumulationPixel), sizeof(AccumulationPixel));
+			return p;
+		}
+	private:
+		static constexpr char kMagic[8] = { 'R', 'T', 'A', 'C', 'C', 'U', 'M', 'L' };
+		struct Header {
+			char magic[8] = {};
+			uint32_t version = 0;
+			uint32_t keyBytes = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			int32_t process = 0;
+			int32_t steps = 0;
+			PixelWindow window;
+		};
+		static std::size_t padded(std::size_t bytes) {
+			return (bytes + 7) & ~std::size_t(7);
+		}
+
+		MappedFile _file;
+		Header _header;
+		std::string _key;
+		const uint8_t *_pixels = nullptr;
+	};
+
+	/*
+	 開いた積算ファイルを 1 枚 (width * height) にまとめる. 行ごとに並列.
+	 シーンか解像度が違う, または同じ process の window が重なる (同じ乱数列を 2 回足すことになる) と false
+	*/
+	inline bool merge_accumulations(const std::vector<const RenderAccumulation *> &accumulations, int *width, int *height, std::vector<AccumulationPixel> *merged) {
+		if (accumulations.empty()) {
+			return false;
+		}
+		const RenderAccumulation *first = accumulations[0];
+		for (int i = 0; i < accumulations.size(); ++i) {
+			const RenderAccumulation *a = accumulations[i];
+			if (a->key() != first->key() || a->width() != first->width() || a->height() != first->height()) {
+				return false;
+			}
+			for (int j = 0; j < i; ++j) {
+				const RenderAccumulation *b = accumulations[j];
+				if (a->process() == b->process() && a->window().overlaps(b->window())) {
+					return false;
+				}
+			}
+		}
+
+		int w = first->width();
+		int h = first->height();
+		*width = w;
+		*height = h;
+		merged->clear();
+		merged->resize((std::size_t)w * h);
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int> &range) {
+			for (int y = range.begin(); y < range.end(); ++y) {
+				for (const RenderAccumulation *a : accumulations) {
+					const PixelWindow &window = a->window();
+					if (y < window.y0 || window.y1 <= y) {
+						continue;
+					}
+					for (int x = window.x0; x < window.x1; ++x) {
+						(*merged)[(std::size_t)y * w + x].merge(a->pixel(x, y));
+					}
+				}
+			}
+		});
+		return true;
+	}
+
+	// merge_accumulations() の結果を write_exr(), write_pfm() へ. image_layers() と同じ並び
+	inline std::vector<ImageLayer> accumulation_layers(const std::vector<AccumulationPixel> *pixels, int width) {
+		ImageLayer beauty;
+		beauty.channels = { "R", "G", "B" };
+		beauty.read = [pixels, width](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				const AccumulationPixel &px = (*pixels)[(std::size_t)y * width + x + i];
+				glm::vec3 L = px.sample == 0 ? glm::vec3(0.0f) : px.color / (float)px.sample;
+				dst[i * 3 + 0] = L.x;
+				dst[i * 3 + 1] = L.y;
+				dst[i * 3 + 2] = L.z;
+			}
+		};
+		ImageLayer samples;
+		samples.name = "samples";
+		samples.channels = { "Y" };
+		samples.read = [pixels, width](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				dst[i] = (float)(*pixels)[(std::size_t)y * width + x + i].sample;
+			}
+		};
+		ImageLayer variance;
+		variance.name = "variance";
+		variance.channels = { "Y" };
+		variance.read = [pixels, width](int x, int y, int n, float *dst) {
+			for (int i = 0; i < n; ++i) {
+				dst[i] = (*pixels)[(std::size_t)y * width + x + i].luminance().variance();
+			}
+		};
+		return { beauty, samples, variance };
+	}
+}
\ No newline at end of file
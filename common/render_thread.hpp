@@ -0,0 +1,218 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <tbb/tbb.h>
+#include <glm/glm.hpp>
+
+#include "path_tracing.hpp"
+#include "progressive_preview.hpp"
+#include "stopwatch.hpp"
+#include "triple_buffer.hpp"
+
+namespace rt {
+	// UI に渡す画像と統計. radiance は color / sample を PTRenderer::display() の大きさにしたもの
+	struct ImageSnapshot {
+		int width = 0;
+		int height = 0;
+		std::vector<glm::vec3> radiance;
+
+		// 縦横 1/displayScale. 大きな画像でも 3 枚持てるように PTRenderer::kDisplayMaxPixels までに縮める
+		int displayScale = 1;
+
+		int steps = 0;
+		int badSampleNan = 0;
+		int badSampleInf = 0;
+		int badSampleNegative = 0;
+		int badSampleFirefly = 0;
+		uint64_t raysPerSecond = 0;
+		int adaptiveActivePixels = 0;
+		bool converged = false;
+
+		// 0 ならフル解像度の積算. そうでなければ 1/previewScale の下見を拡大したもの
+		int previewScale = 0;
+	};
+
+	// step() の合間に呼ぶこと. 積算バッファは読まないので, out-of-core でも追い出したタイルは戻らない
+	inline void take_snapshot(PTRenderer *renderer, ImageSnapshot *snapshot) {
+		snapshot->width = renderer->displayWidth();
+		snapshot->height = renderer->displayHeight();
+		snapshot->displayScale = renderer->displayScale();
+		snapshot->radiance = renderer->display();
+
+		renderer->measureRaysPerSecond();
+		snapshot->steps = renderer->stepCount();
+		snapshot->badSampleNan = renderer->badSampleNanCount();
+		snapshot->badSampleInf = renderer->badSampleInfCount();
+		snapshot->badSampleNegative = renderer->badSampleNegativeCount();
+		snapshot->badSampleFirefly = renderer->badSampleFireflyCount();
+		snapshot->raysPerSecond = renderer->getRaysPerSecond();
+		snapshot->adaptiveActivePixels = renderer->adaptiveActivePixels();
+		snapshot->converged = renderer->converged();
+		snapshot->previewScale = 0;
+	}
+
+	/*
+	 PTRenderer を専用のスレッドで回す.
+	 描画中の PTRenderer に触ってよいのはこのスレッドだけで, UI からは
+	   - snapshot : _publishIntervalSeconds ごとに TripleBuffer で渡される
+	   - post()   : 設定の変更などを step() の合間に実行してもらう
+	 を使う. stop() は走っている step() を PTRenderer::cancel() で打ち切ってから join し,
+	 _checkpointPath があれば 1 step 以上描いた分を saveCheckpoint() する.
+	 _preview なら, まだ 1 step も描いていない PTRenderer は kPreviewScales の下見を先に 1 枚ずつ渡す
+	*/
+	class RenderThread {
+	public:
+		RenderThread(std::shared_ptr<PTRenderer> renderer) :_renderer(renderer) {
+		}
+		~RenderThread() {
+			stop();
+		}
+		RenderThread(const RenderThread &) = delete;
+		void operator=(const RenderThread &) = delete;
+
+		void start() {
+			if (_thread.joinable()) {
+				return;
+			}
+			_running = true;
+			_thread = std::thread([this]() {
+				run();
+			});
+		}
+		void stop() {
+			if (_thread.joinable() == false) {
+				return;
+			}
+			_running = false;
+			_renderer->cancel();
+			_thread.join();
+			_renderer->resetCancel();
+
+			// 打ち切られた step() でもピクセルと乱数は揃っているので, そのまま保存できる
+			if (_renderer->_checkpointPath.empty() == false && 0 < _renderer->stepCount()) {
+				if (_renderer->saveCheckpoint(_renderer->_checkpointPath, _renderer->_checkpointKey) == false) {
+					printf("failed to write checkpoint %s\n", _renderer->_checkpointPath.string().c_str());
+				}
+			}
+		}
+
+		// UI スレッドから. 新しい snapshot があれば true
+		bool acquire() {
+			return _snapshots.acquire();
+		}
+		const ImageSnapshot &snapshot() const {
+			return _snapshots.front();
+		}
+
+		// 次の step() の前にレンダースレッドで実行される
+		void post(std::function<void(PTRenderer *)> command) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_commands.emplace_back(std::move(command));
+		}
+
+		// 毎 step() の後にレンダースレッドで呼ばれる. start() の前に設定すること
+		std::function<void(PTRenderer *)> _afterStep;
+		double _publishIntervalSeconds = 1.0 / 30.0;
+		bool _preview = true;
+	private:
+		void run() {
+			runCommands();
+			if (_preview && _renderer->stepCount() == 0) {
+				runPreview();
+			}
+
+			Stopwatch publishTimer;
+			bool dirty = true;
+			while (_running) {
+				runCommands();
+
+				// post() で targetError などが変わると収束していなくなることがある
+				if (_renderer->converged()) {
+					_renderer->refreshAdaptiveSampling();
+				}
+				if (_renderer->converged()) {
+					if (dirty) {
+						publish();
+						dirty = false;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					continue;
+				}
+
+				_renderer->step();
+				if (_running == false) {
+					break;
+				}
+				if (_afterStep) {
+					_afterStep(_renderer.get());
+				}
+				dirty = true;
+
+				if (_publishIntervalSeconds <= publishTimer.elapsed()) {
+					publish();
+					dirty = false;
+					publishTimer = Stopwatch();
+				}
+			}
+		}
+		void publish() {
+			take_snapshot(_renderer.get(), &_snapshots.back());
+			_snapshots.publish();
+		}
+		void runPreview() {
+			std::vector<glm::vec3> preview;
+			int displayScale = _renderer->displayScale();
+			for (int scale : kPreviewScales) {
+				// 表示より細かい下見は見えないので描かない
+				if (scale <= displayScale) {
+					continue;
+				}
+				_renderer->renderPreview(scale, &preview);
+				if (_running == false || _renderer->cancelled()) {
+					return;
+				}
+				ImageSnapshot &snapshot = _snapshots.back();
+				snapshot.width = _renderer->displayWidth();
+				snapshot.height = _renderer->displayHeight();
+				snapshot.displayScale = displayScale;
+				snapshot.radiance.resize(snapshot.width * snapshot.height);
+				upsample_preview(preview.data(), scale / displayScale, snapshot.width, snapshot.height, snapshot.radiance.data());
+				snapshot.steps = 0;
+				snapshot.badSampleNan = 0;
+				snapshot.badSampleInf = 0;
+				snapshot.badSampleNegative = 0;
+				snapshot.badSampleFirefly = 0;
+				snapshot.raysPerSecond = 0;
+				snapshot.adaptiveActivePixels = 0;
+				snapshot.converged = false;
+				snapshot.previewScale = scale;
+				_snapshots.publish();
+			}
+		}
+		void runCommands() {
+			std::vector<std::function<void(PTRenderer *)>> commands;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				commands.swap(_commands);
+			}
+			for (auto &command : commands) {
+				command(_renderer.get());
+			}
+		}
+
+		std::shared_ptr<PTRenderer> _renderer;
+		std::thread _thread;
+		std::atomic<bool> _running = false;
+
+		TripleBuffer<ImageSnapshot> _snapshots;
+
+		std::mutex _mutex;
+		std::vector<std::function<void(PTRenderer *)>> _commands;
+	};
+}
\ No newline at end of file
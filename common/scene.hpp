@@ -1,13 +1,16 @@
 ﻿#pragma once
 #include <embree3/rtcore.h>
+#include <future>
 
 #include "houdini_alembic.hpp"
 #include "material.hpp"
+#include "shading_queue.hpp"
 #include "assertion.hpp"
 #include "plane_equation.hpp"
 #include "triangle_util.hpp"
 #include "image2d.hpp"
 #include "envmap.hpp"
+#include "stopwatch.hpp"
 
 namespace rt {
 	inline std::vector<std::unique_ptr<BxDF>> instanciateMaterials(houdini_alembic::PolygonMeshObject *p, const glm::mat3 &xformInverseTransposed) {
@@ -92,6 +95,15 @@ namespace rt {
 		printf("Embree Error [%d] %s\n", code, str);
 	}
 
+	// intersect() の結果. シェーディングに使う情報は Scene::shading_point() で必要なときに取る
+	struct HitRecord {
+		uint32_t geomID = 0;
+		uint32_t primID = 0;
+		float u = 0.0f;
+		float v = 0.0f;
+		float t = 0.0f;
+	};
+
 	struct Luminaire {
 		glm::vec3 points[3];
 		glm::vec3 Ng;
@@ -110,9 +122,21 @@ namespace rt {
 			_embreeScene = std::shared_ptr<RTCSceneTy>(rtcNewScene(_embreeDevice.get()), rtcReleaseScene);
 			rtcSetSceneBuildQuality(_embreeScene.get(), RTC_BUILD_QUALITY_HIGH);
 
+			Stopwatch sw;
+
 			// black envmap
 			_environmentMap = std::shared_ptr<ConstantEnvmap>(new ConstantEnvmap());
-			
+
+			// 先に点を見て、テクスチャの読み込みを始めておく
+			for (auto o : scene->objects) {
+				if (o->visible == false) {
+					continue;
+				}
+				if (auto point = o.as_point()) {
+					addPoint(point);
+				}
+			}
+
 			for (auto o : scene->objects) {
 				if (o->visible == false) {
 					continue;
@@ -127,21 +151,112 @@ namespace rt {
 				if (auto polymesh = o.as_polygonMesh()) {
 					addPolymesh(polymesh);
 				}
-				if (auto point = o.as_point()) {
-					addPoint(point);
-				}
 			}
 			RT_ASSERT(_camera);
+			double geometry_done = sw.elapsed();
 
 			rtcCommitScene(_embreeScene.get());
 			rtcInitIntersectContext(&_context);
+			double bvh_done = sw.elapsed();
+
+			if (_envmapLoading.valid()) {
+				EnvmapLoadResult result = _envmapLoading.get();
+				_environmentMap = result.envmap;
+
+				double wait = sw.elapsed() - bvh_done;
+				printf("scene load: geometry %.3fs, bvh %.3fs, envmap %.3fs (overlapped %.3fs, waited %.3fs), total %.3fs\n",
+					geometry_done, bvh_done - geometry_done,
+					result.seconds, result.seconds - wait, wait, sw.elapsed());
+			}
+			else {
+				printf("scene load: geometry %.3fs, bvh %.3fs, total %.3fs\n",
+					geometry_done, bvh_done - geometry_done, sw.elapsed());
+			}
 		}
 		
 		Scene(const Scene &) = delete;
 		void operator=(const Scene &) = delete;
 
-		bool intersect(const glm::vec3 &ro, const glm::vec3 &rd, ShadingPoint *shadingPoint, float *tmin) const {
+		bool intersect(const glm::vec3 &ro, const glm::vec3 &rd, HitRecord *hit) const {
 			RTCRayHit rayhit;
+			init_rayhit(&rayhit, ro, rd);
+			rtcIntersect1(_embreeScene.get(), &_context, &rayhit);
+			return read_hit(rayhit, hit);
+		}
+
+		/*
+		 n 本まとめて rtcIntersect1M に渡す. k 番目に渡すのは order[k] 番のレイで, 結果は hits[order[k]], found[order[k]] に書く.
+		 coherent なら Embree に並べ替え済みだと伝える
+		*/
+		void intersect(int n, const glm::vec3 *ro, const glm::vec3 *rd, const uint32_t *order, bool coherent, HitRecord *hits, uint8_t *found) const {
+			enum {
+				kChunk = 64,
+			};
+			RTCIntersectContext context;
+			rtcInitIntersectContext(&context);
+			context.flags = coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+			RTCRayHit rayhits[kChunk];
+			for (int base = 0; base < n; base += kChunk) {
+				int count = std::min((int)kChunk, n - base);
+				for (int k = 0; k < count; ++k) {
+					uint32_t index = order[base + k];
+					init_rayhit(&rayhits[k], ro[index], rd[index]);
+				}
+				rtcIntersect1M(_embreeScene.get(), &context, rayhits, count, sizeof(RTCRayHit));
+				for (int k = 0; k < count; ++k) {
+					uint32_t index = order[base + k];
+					found[index] = read_hit(rayhits[k], &hits[index]) ? 1 : 0;
+				}
+			}
+		}
+
+		ShadingPoint shading_point(const HitRecord &hit) const {
+			RT_ASSERT(hit.geomID < _polymeshes.size());
+			const Polymesh *mesh = _polymeshes[hit.geomID].get();
+
+			RT_ASSERT(hit.primID < mesh->materials.size());
+			ShadingPoint shadingPoint;
+			shadingPoint.bxdf = mesh->materials[hit.primID].get();
+			shadingPoint.Ng = mesh->Ng[hit.primID];
+			shadingPoint.u = hit.u;
+			shadingPoint.v = hit.v;
+			shadingPoint.primID = hit.primID;
+			shadingPoint.normals = mesh->normals.empty() ? nullptr : &mesh->normals;
+			return shadingPoint;
+		}
+
+		// ShadingQueue::push() 用
+		MaterialSlot material_slot(const HitRecord &hit) const {
+			return _polymeshes[hit.geomID]->materialSlots[hit.primID];
+		}
+		const MaterialTable &material_table() const {
+			return _materialTable;
+		}
+
+		houdini_alembic::CameraObject *camera() {
+			return _camera;
+		}
+		const std::vector<Luminaire> &luminaires() const {
+			return _luminaires;
+		}
+		const std::vector<Luminaire> &portals() const {
+			return _portals;
+		}
+
+		EnvironmentMap *envmap() const {
+			return _environmentMap.get();
+		}
+
+		void bounds(glm::vec3 *lower, glm::vec3 *upper) const {
+			RTCBounds b;
+			rtcGetSceneBounds(_embreeScene.get(), &b);
+			*lower = glm::vec3(b.lower_x, b.lower_y, b.lower_z);
+			*upper = glm::vec3(b.upper_x, b.upper_y, b.upper_z);
+		}
+	private:
+		static void init_rayhit(RTCRayHit *r, const glm::vec3 &ro, const glm::vec3 &rd) {
+			RTCRayHit &rayhit = *r;
 			rayhit.ray.org_x = ro.x;
 			rayhit.ray.org_y = ro.y;
 			rayhit.ray.org_z = ro.z;
@@ -158,27 +273,17 @@ namespace rt {
 			rayhit.ray.flags = 0;
 			rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
 			rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-			rtcIntersect1(_embreeScene.get(), &_context, &rayhit);
-
+		}
+		static bool read_hit(const RTCRayHit &rayhit, HitRecord *hit) {
 			if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
 				return false;
 			}
 
-			*tmin = rayhit.ray.tfar;
-
-			int index = rayhit.hit.geomID;
-			RT_ASSERT(index < _polymeshes.size());
-			const Polymesh *mesh = _polymeshes[index].get();
-
-			RT_ASSERT(rayhit.hit.primID < mesh->materials.size());
-			shadingPoint->bxdf = mesh->materials[rayhit.hit.primID].get();
-
-			// Houdini (CW) => (CCW)
-			shadingPoint->Ng.x = -rayhit.hit.Ng_x;
-			shadingPoint->Ng.y = -rayhit.hit.Ng_y;
-			shadingPoint->Ng.z = -rayhit.hit.Ng_z;
-			shadingPoint->u = rayhit.hit.u;
-			shadingPoint->v = rayhit.hit.v;
+			hit->geomID = rayhit.hit.geomID;
+			hit->primID = rayhit.hit.primID;
+			hit->u = rayhit.hit.u;
+			hit->v = rayhit.hit.v;
+			hit->t = rayhit.ray.tfar;
 
 			/*
 			https://embree.github.io/api.html
@@ -195,22 +300,18 @@ namespace rt {
 			return true;
 		}
 
-		houdini_alembic::CameraObject *camera() {
-			return _camera;
-		}
-		const std::vector<Luminaire> &luminaires() const {
-			return _luminaires;
-		}
-
-		EnvironmentMap *envmap() const {
-			return _environmentMap.get();
-		}
-	private:
 		class Polymesh {
 		public:
 			std::vector<std::unique_ptr<BxDF>> materials;
+			std::vector<MaterialSlot> materialSlots;
 			std::vector<uint32_t> indices;
 			std::vector<glm::vec3> points;
+
+			// 三角形ごとの単位法線. Houdini (CW) => (CCW) 済み
+			SoAVec3 Ng;
+
+			// 頂点法線 N が無ければ空
+			ShadingNormals normals;
 		};
 
 		void addPoint(houdini_alembic::PointObject *p) {
@@ -225,6 +326,12 @@ namespace rt {
 						r->get(i, glm::value_ptr(env->constant));
 					}
 					_environmentMap = env;
+
+					// 後の点が優先
+					if (_envmapLoading.valid()) {
+						_envmapLoading.wait();
+						_envmapLoading = std::future<EnvmapLoadResult>();
+					}
 				}
 				else if (point_type->get(i) == "ImageEnvmap") {
 					if (auto r = p->points.column_as_string("file")) {
@@ -233,15 +340,72 @@ namespace rt {
 
 						auto absFilePath = _abcDirectory / filePath;
 						
-						auto texture = std::shared_ptr<Image2D>(new Image2D());
-						texture->load(absFilePath.string().c_str());
-						// texture->clamp_rgb(0.0f, 10000.0f);
-						// texture->clamp_rgb(0.0f, 1000.0f);
+						// テクセルの保存形式 "rgbe", "rgb16f", "rgb9e5" (指定なしなら RGBA32F)
+						TexelFormat format = TexelFormat::RGBA32F;
+						if (auto texel_format = p->points.column_as_string("texel_format")) {
+							const std::string &name = texel_format->get(i);
+							if (name == "rgbe") {
+								format = TexelFormat::RGBE;
+							}
+							else if (name == "rgb16f") {
+								format = TexelFormat::RGB16F;
+							}
+							else if (name == "rgb9e5") {
+								format = TexelFormat::RGB9E5;
+							}
+						}
 
+						// octahedral != 0 なら equal-area octahedral に再サンプリングしておく
+						EnvmapLayout layout = EnvmapLayout::LatLong;
+						if (auto octahedral = p->points.column_as_int("octahedral")) {
+							if (octahedral->get(i)) {
+								layout = EnvmapLayout::EqualAreaOctahedral;
+							}
+						}
+
+						// サンプリングテーブルの解像度 (0 ならテクスチャと同じ)
+						int importance_resolution = 0;
+						if (auto resolution = p->points.column_as_int("importance_resolution")) {
+							importance_resolution = resolution->get(i);
+						}
 
-						// UniformDirectionWeight uniform_weight;
-						// _environmentMap = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, uniform_weight));
-						_environmentMap = std::shared_ptr<SixAxisImageEnvmap>(new SixAxisImageEnvmap(texture));
+						// texture_cache_mb > 0 なら latlong のテクスチャは常駐させず, "<file>.tiles" からこの予算でタイルを読む
+						int texture_cache_mb = 0;
+						if (auto budget = p->points.column_as_int("texture_cache_mb")) {
+							texture_cache_mb = budget->get(i);
+						}
+
+						// 読み込みとサンプリングテーブルの構築はジオメトリ変換, BVH 構築と並行して行う
+						if (_envmapLoading.valid()) {
+							_envmapLoading.wait();
+						}
+						_envmapLoading = std::async(std::launch::async, [absFilePath, format, layout, importance_resolution, texture_cache_mb]() {
+							Stopwatch sw;
+							// サンプリングテーブルはテクスチャの隣にキャッシュする
+							EnvmapTableCache cache(absFilePath);
+							EnvmapLoadResult result;
+
+							if (0 < texture_cache_mb && layout == EnvmapLayout::LatLong) {
+								if (auto source = open_tiled_texture(absFilePath, format)) {
+									auto textures = std::shared_ptr<TextureCache>(new TextureCache((std::size_t)texture_cache_mb << 20));
+									int texture = textures->add(source);
+									result.envmap = std::shared_ptr<SixAxisImageEnvmap>(new SixAxisImageEnvmap(textures, texture, importance_resolution, &cache));
+									result.seconds = sw.elapsed();
+									return result;
+								}
+							}
+
+							auto texture = std::shared_ptr<Image2D>(new Image2D());
+							texture->load(absFilePath.string().c_str(), format);
+							// texture->clamp_rgb(0.0f, 10000.0f);
+							// texture->clamp_rgb(0.0f, 1000.0f);
+
+							// UniformDirectionWeight uniform_weight;
+							// _environmentMap = std::shared_ptr<ImageEnvmap>(new ImageEnvmap(texture, uniform_weight));
+							result.envmap = std::shared_ptr<SixAxisImageEnvmap>(new SixAxisImageEnvmap(texture, layout, importance_resolution, &cache));
+							result.seconds = sw.elapsed();
+							return result;
+						});
 					}
 				}
 			}
@@ -273,11 +437,35 @@ namespace rt {
 
 			polymesh->materials = instanciateMaterials(p, xformInverseTransposed);
 
+			auto to_luminaire = [&](int i) {
+				Luminaire L;
+				for (int j = 0; j < 3; ++j) {
+					int index_src = i * 3 + j;
+					RT_ASSERT(index_src < polymesh->indices.size());
+					int index = polymesh->indices[index_src];
+					RT_ASSERT(index < polymesh->points.size());
+					L.points[j] = polymesh->points[index];
+				}
+				L.Ng = triangle_normal_cw(L.points[0], L.points[1], L.points[2]);
+
+				L.plane.from_point_and_normal(L.points[0], L.Ng); 
+				L.center = (L.points[0] + L.points[1] + L.points[2]) / 3.0f;
+				L.area = triangle_area(L.points[0], L.points[1], L.points[2]);
+				RT_ASSERT(0.0f < L.area);
+				return L;
+			};
+
 			// luminaires_sampler, luminaires_backenable を読み込んで、設定
 			auto luminaires_sampler = p->primitives.column_as_int("luminaires_sampler");
 			auto luminaires_backenable = p->primitives.column_as_int("luminaires_backenable");
 
-			std::vector<uint32_t> luminaires_primitive_indices;
+			std::vector<uint32_t> removed_primitive_indices;
+
+			// 残った三角形の角が元の何番目の vertex か
+			std::vector<uint32_t> corners(polymesh->indices.size());
+			for (uint32_t i = 0; i < corners.size(); ++i) {
+				corners[i] = i;
+			}
 
 			if (luminaires_sampler && luminaires_backenable) {
 				RT_ASSERT(luminaires_sampler->rowCount() == p->primitives.rowCount());
@@ -285,36 +473,73 @@ namespace rt {
 
 				for (int i = 0; i < p->primitives.rowCount(); ++i) {
 					if (luminaires_sampler->get(i)) {
-						Luminaire L;
-						for (int j = 0; j < 3; ++j) {
-							int index_src = i * 3 + j;
-							RT_ASSERT(index_src < polymesh->indices.size());
-							int index = polymesh->indices[index_src];
-							RT_ASSERT(index < polymesh->points.size());
-							L.points[j] = polymesh->points[index];
-						}
+						Luminaire L = to_luminaire(i);
 						L.backenable = luminaires_backenable->get(i) != 0;
-						L.Ng = triangle_normal_cw(L.points[0], L.points[1], L.points[2]);
+						_luminaires.emplace_back(L);
 
-						L.plane.from_point_and_normal(L.points[0], L.Ng); 
-						L.center = (L.points[0] + L.points[1] + L.points[2]) / 3.0f;
-						L.area = triangle_area(L.points[0], L.points[1], L.points[2]);
-						RT_ASSERT(0.0f < L.area);
+						removed_primitive_indices.push_back(i);
+					}
+				}
+			}
 
-						_luminaires.emplace_back(L);
+			// portal は窓などの開口部。環境マップのサンプリングをその立体角に限定するために使う
+			if (auto portal = p->primitives.column_as_int("portal")) {
+				RT_ASSERT(portal->rowCount() == p->primitives.rowCount());
 
-						luminaires_primitive_indices.push_back(i);
+				for (int i = 0; i < p->primitives.rowCount(); ++i) {
+					if (portal->get(i)) {
+						Luminaire L = to_luminaire(i);
+						L.backenable = true;
+						_portals.emplace_back(L);
+
+						removed_primitive_indices.push_back(i);
 					}
 				}
 			}
 
-			// luminaires_samplerは衝突しないようにする
-			for (auto it = luminaires_primitive_indices.rbegin(); it != luminaires_primitive_indices.rend(); ++it) {
+			// luminaires_sampler, portal は衝突しないようにする
+			std::sort(removed_primitive_indices.begin(), removed_primitive_indices.end());
+			removed_primitive_indices.erase(std::unique(removed_primitive_indices.begin(), removed_primitive_indices.end()), removed_primitive_indices.end());
+			for (auto it = removed_primitive_indices.rbegin(); it != removed_primitive_indices.rend(); ++it) {
 				uint32_t primitive_index = *it;
 				polymesh->indices.erase(polymesh->indices.begin() + primitive_index * 3, polymesh->indices.begin() + primitive_index * 3 + 3);
+				corners.erase(corners.begin() + primitive_index * 3, corners.begin() + primitive_index * 3 + 3);
 				polymesh->materials.erase(polymesh->materials.begin() + primitive_index);
 			}
 
+			size_t triangleCount = polymesh->indices.size() / 3;
+			polymesh->Ng.reserve(triangleCount);
+			for (size_t i = 0; i < triangleCount; ++i) {
+				const uint32_t *index = polymesh->indices.data() + i * 3;
+				polymesh->Ng.push_back(triangle_geometric_normal_cw(polymesh->points[index[0]], polymesh->points[index[1]], polymesh->points[index[2]]));
+			}
+
+			polymesh->materialSlots.reserve(triangleCount);
+			for (size_t i = 0; i < triangleCount; ++i) {
+				polymesh->materialSlots.push_back(_materialTable.add(polymesh->materials[i].get()));
+			}
+
+			// シェーディング法線は point の N なら頂点で共有, vertex の N なら角ごと
+			auto add_normal = [&](const houdini_alembic::AttributeVector3Column *N, uint32_t i) {
+				glm::vec3 n;
+				N->get(i, glm::value_ptr(n));
+				polymesh->normals.N.push_back(glm::normalize(xformInverseTransposed * n));
+			};
+			if (auto N = p->points.column_as_vector3("N")) {
+				polymesh->normals.N.reserve(N->rowCount());
+				for (uint32_t i = 0; i < N->rowCount(); ++i) {
+					add_normal(N, i);
+				}
+				polymesh->normals.indices = polymesh->indices;
+			}
+			else if (auto N = p->vertices.column_as_vector3("N")) {
+				polymesh->normals.N.reserve(N->rowCount());
+				for (uint32_t i = 0; i < N->rowCount(); ++i) {
+					add_normal(N, i);
+				}
+				polymesh->normals.indices = corners;
+			}
+
 			// add to embree
 			// https://www.slideshare.net/IntelSoftware/embree-ray-tracing-kernels-overview-and-new-features-siggraph-2018-tech-session
 			RTCGeometry g = rtcNewGeometry(_embreeDevice.get(), RTC_GEOMETRY_TYPE_TRIANGLE);
@@ -339,14 +564,22 @@ namespace rt {
 
 		houdini_alembic::CameraObject *_camera = nullptr;
 		std::vector<std::unique_ptr<Polymesh>> _polymeshes;
+		MaterialTable _materialTable;
 
 		std::shared_ptr<RTCDeviceTy> _embreeDevice;
 		std::shared_ptr<RTCSceneTy> _embreeScene;
 
 		std::vector<Luminaire> _luminaires;
+		std::vector<Luminaire> _portals;
 
 		std::shared_ptr<EnvironmentMap> _environmentMap;
 
+		struct EnvmapLoadResult {
+			std::shared_ptr<EnvironmentMap> envmap;
+			double seconds = 0.0;
+		};
+		std::future<EnvmapLoadResult> _envmapLoading;
+
 		mutable RTCIntersectContext _context;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,462 @@
+﻿#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "material.hpp"
+#include "fast_math.hpp"
+#include "soa_vec3.hpp"
+#include "assertion.hpp"
+
+namespace rt {
+	// MaterialTable の中の位置
+	struct MaterialSlot {
+		BxDFKind kind = BxDFKind::Other;
+		uint32_t index = 0;
+	};
+
+	/*
+	 BxDF のパラメータを種類ごとに SoA で並べた表.
+	 シーンの構築時に 1 度だけ作り, ShadingQueue はここから 8 レーン分を gather する.
+	*/
+	class MaterialTable {
+	public:
+		struct LambertianParams {
+			SoAVec3 R;
+			std::vector<float> shadingNormal; // 0 or 1
+		};
+		struct GGXParams {
+			SoAVec3 R;
+			std::vector<float> alphaU;
+			std::vector<float> alphaV;
+		};
+
+		MaterialSlot add(const BxDF *bxdf) {
+			MaterialSlot slot;
+			slot.kind = bxdf->kind();
+			switch (slot.kind) {
+			case BxDFKind::Lambertian: {
+				const LambertianBRDF *lambertian = static_cast<const LambertianBRDF *>(bxdf);
+				slot.index = (uint32_t)lambertian_params.R.size();
+				lambertian_params.R.push_back(lambertian->R);
+				lambertian_params.shadingNormal.push_back(lambertian->ShadingNormal ? 1.0f : 0.0f);
+				break;
+			}
+			case BxDFKind::Ward:
+				// alpha は共通なので数だけ
+				slot.index = ward_count++;
+				break;
+			case BxDFKind::GGX: {
+				const GGX *ggx = static_cast<const GGX *>(bxdf);
+				slot.index = (uint32_t)ggx_params.R.size();
+				ggx_params.R.push_back(ggx->R);
+				ggx_params.alphaU.push_back(ggx->alpha_u());
+				ggx_params.alphaV.push_back(ggx->alpha_v());
+				break;
+			}
+			default:
+				break;
+			}
+			return slot;
+		}
+		bool use_shading_normal(const MaterialSlot &slot) const {
+			return slot.kind == BxDFKind::Lambertian && lambertian_params.shadingNormal[slot.index] != 0.0f;
+		}
+
+		LambertianParams lambertian_params;
+		uint32_t ward_count = 0;
+		GGXParams ggx_params;
+	};
+
+	namespace shading_queue_detail {
+		using namespace fast_math_detail;
+
+#if defined(RT_FAST_MATH_AVX2)
+		using Lane = F8;
+#elif defined(RT_FAST_MATH_SSE2)
+		using Lane = F4;
+#else
+		using Lane = F1;
+#endif
+		enum {
+			kBatchSize = 8,
+		};
+
+		// キューに積む値. SoA の 1 本ずつ
+		enum Input {
+			kNgX, kNgY, kNgZ,
+			kWoX, kWoY, kWoZ,
+			kNsX, kNsY, kNsZ,
+			kU0, kU1,
+			kInputCount,
+		};
+		enum Output {
+			kWiX, kWiY, kWiZ,
+			kFX, kFY, kFZ,
+			kPdf,
+			kOutputCount,
+		};
+		// gather したパラメータ
+		enum Param {
+			kRX, kRY, kRZ,
+			kShadingNormal,
+			kAlphaU = kShadingNormal,
+			kAlphaV,
+			kParamCount,
+		};
+
+		template <class V>
+		struct V3 {
+			V x, y, z;
+		};
+		template <class V>
+		inline V3<V> load3(const float *const *p, int i) {
+			return V3<V>{ V::load(p[i]), V::load(p[i + 1]), V::load(p[i + 2]) };
+		}
+		template <class V>
+		inline void store3(float *const *p, int i, const V3<V> &v) {
+			v.x.store(p[i]);
+			v.y.store(p[i + 1]);
+			v.z.store(p[i + 2]);
+		}
+		template <class V>
+		inline V dot(const V3<V> &a, const V3<V> &b) {
+			return a.x * b.x + a.y * b.y + a.z * b.z;
+		}
+		template <class V>
+		inline V3<V> madd(const V3<V> &a, V s, const V3<V> &b) {
+			return V3<V>{ a.x * s + b.x, a.y * s + b.y, a.z * s + b.z };
+		}
+		template <class V>
+		inline V3<V> scale(const V3<V> &a, V s) {
+			return V3<V>{ a.x * s, a.y * s, a.z * s };
+		}
+
+		// Ng を wo の側に向けたもの
+		template <class V>
+		inline V3<V> facing_normal(const V3<V> &Ng, const V3<V> &wo) {
+			auto flip = dot(Ng, wo) < V(0.0f);
+			return V3<V>{ select(flip, -Ng.x, Ng.x), select(flip, -Ng.y, Ng.y), select(flip, -Ng.z, Ng.z) };
+		}
+		// getOrthonormalBasis() と同じ
+		template <class V>
+		inline void orthonormal_basis(const V3<V> &z, V3<V> *x, V3<V> *y) {
+			V sign = vcopysign(V(1.0f), z.z);
+			V a = V(-1.0f) / (sign + z.z);
+			V b = z.x * z.y * a;
+			*x = V3<V>{ V(1.0f) + sign * z.x * z.x * a, sign * b, -(sign * z.x) };
+			*y = V3<V>{ b, sign + z.y * z.y * a, -z.y };
+		}
+		template <class V>
+		inline V3<V> local_to_global(const V3<V> &x, const V3<V> &y, const V3<V> &z, const V3<V> &v) {
+			return madd(z, v.z, madd(y, v.y, scale(x, v.x)));
+		}
+
+		// LambertianBRDF::sample_eval()
+		template <class V>
+		inline void lambertian_sample_eval(const float *const *in, const float *const *param, float *const *out) {
+			V3<V> Ng = load3<V>(in, kNgX);
+			V3<V> wo = load3<V>(in, kWoX);
+			V3<V> Ns = load3<V>(in, kNsX);
+			V u0 = V::load(in[kU0]);
+			V u1 = V::load(in[kU1]);
+
+			V3<V> n = facing_normal(Ng, wo);
+			V3<V> x, y;
+			orthonormal_basis(n, &x, &y);
+
+			V r = vsqrt(u0);
+			V sinTheta, cosTheta;
+			sincos_kernel<V>(u1 * V(glm::two_pi<float>()), &sinTheta, &cosTheta);
+			V3<V> wi_local = { r * cosTheta, r * sinTheta, vsqrt(vmax(V(1.0f) - u0, V(0.0f))) };
+			V3<V> wi = local_to_global(x, y, n, wi_local);
+
+			V k = select(V(0.0f) < V::load(param[kShadingNormal]), vabs(dot(Ns, wi)) / wi_local.z, V(1.0f)) * V(glm::one_over_pi<float>());
+			store3(out, kWiX, wi);
+			store3(out, kFX, scale(load3<V>(param, kRX), k));
+			(wi_local.z * V(glm::one_over_pi<float>())).store(out[kPdf]);
+		}
+
+		// Ward::sample_eval(). atan と sincos の代わりに cosθh = 1 / sqrt(1 + tan^2)
+		template <class V>
+		inline void ward_sample_eval(const float *const *in, const float *const *param, float *const *out) {
+			V3<V> Ng = load3<V>(in, kNgX);
+			V3<V> wo = load3<V>(in, kWoX);
+			V u0 = V::load(in[kU0]);
+			V u1 = V::load(in[kU1]);
+
+			V3<V> n = facing_normal(Ng, wo);
+			V3<V> x, y;
+			orthonormal_basis(n, &x, &y);
+
+			V tanThetaH = V(alpha) * vsqrt(-log_kernel<V>(vmax(u1, V(std::numeric_limits<float>::min()))));
+			V cosThetaH = V(1.0f) / vsqrt(V(1.0f) + tanThetaH * tanThetaH);
+			V sinThetaH = tanThetaH * cosThetaH;
+			V sinPhi, cosPhi;
+			sincos_kernel<V>(u0 * V(glm::two_pi<float>()), &sinPhi, &cosPhi);
+			V3<V> h = local_to_global(x, y, n, V3<V>{ sinThetaH * cosPhi, sinThetaH * sinPhi, cosThetaH });
+
+			// reflect(-wo, h)
+			V HoO = dot(h, wo);
+			V3<V> wi = madd(h, HoO + HoO, V3<V>{ -wo.x, -wo.y, -wo.z });
+
+			V cosThetaH2 = cosThetaH * cosThetaH;
+			V k = u1 / (V(4.0f * glm::pi<float>() * alpha * alpha) * HoO * cosThetaH2);
+			auto below = dot(n, wi) < V(0.0f);
+			V f = select(below, V(0.0f), k / (HoO * cosThetaH2));
+			store3(out, kWiX, wi);
+			store3(out, kFX, V3<V>{ f, f, f });
+			select(below, V(0.0f), k / cosThetaH).store(out[kPdf]);
+		}
+
+		// GGX::sample_eval()
+		template <class V>
+		inline void ggx_sample_eval(const float *const *in, const float *const *param, float *const *out) {
+			V3<V> Ng = load3<V>(in, kNgX);
+			V3<V> wo = load3<V>(in, kWoX);
+			V u0 = V::load(in[kU0]);
+			V u1 = V::load(in[kU1]);
+			V ax = V::load(param[kAlphaU]);
+			V ay = V::load(param[kAlphaV]);
+
+			V3<V> n = facing_normal(Ng, wo);
+			V3<V> x, y;
+			orthonormal_basis(n, &x, &y);
+			V3<V> o = { dot(wo, x), dot(wo, y), vmax(dot(wo, n), V(1.0e-6f)) };
+
+			// sample_visible_normal()
+			V3<V> Vh = { ax * o.x, ay * o.y, o.z };
+			Vh = scale(Vh, V(1.0f) / vsqrt(dot(Vh, Vh)));
+			V lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+			auto hasT1 = V(0.0f) < lensq;
+			V invLen = V(1.0f) / vsqrt(vmax(lensq, V(std::numeric_limits<float>::min())));
+			V3<V> T1 = { select(hasT1, -Vh.y * invLen, V(1.0f)), select(hasT1, Vh.x * invLen, V(0.0f)), V(0.0f) };
+			V3<V> T2 = { -(Vh.z * T1.y), Vh.z * T1.x, Vh.x * T1.y - Vh.y * T1.x };
+
+			V r = vsqrt(u0);
+			V sinPhi, cosPhi;
+			sincos_kernel<V>(u1 * V(glm::two_pi<float>()), &sinPhi, &cosPhi);
+			V t1 = r * cosPhi;
+			V t2 = r * sinPhi;
+			V s = V(0.5f) * (V(1.0f) + Vh.z);
+			t2 = (V(1.0f) - s) * vsqrt(vmax(V(1.0f) - t1 * t1, V(0.0f))) + s * t2;
+			V3<V> Nh = madd(Vh, vsqrt(vmax(V(1.0f) - t1 * t1 - t2 * t2, V(0.0f))), madd(T2, t2, scale(T1, t1)));
+			V3<V> h = { ax * Nh.x, ay * Nh.y, vmax(Nh.z, V(0.0f)) };
+			h = scale(h, V(1.0f) / vsqrt(dot(h, h)));
+
+			V HoO = dot(h, o);
+			V3<V> i = madd(h, HoO + HoO, V3<V>{ -o.x, -o.y, -o.z });
+			V3<V> wi = local_to_global(x, y, n, i);
+
+			// evaluate_local()
+			V kD = (h.x / ax) * (h.x / ax) + (h.y / ay) * (h.y / ay) + h.z * h.z;
+			V D = V(1.0f) / (V(glm::pi<float>()) * ax * ay * kD * kD);
+			auto lambda = [ax, ay](const V3<V> &v) {
+				V a2 = (ax * ax * v.x * v.x + ay * ay * v.y * v.y) / (v.z * v.z);
+				return (vsqrt(V(1.0f) + a2) - V(1.0f)) * V(0.5f);
+			};
+			V lambda_o = lambda(o);
+			V lambda_i = lambda(i);
+			V G1 = V(1.0f) / (V(1.0f) + lambda_o);
+			V G2 = V(1.0f) / (V(1.0f) + lambda_o + lambda_i);
+
+			V k = V(1.0f) - vmax(dot(h, i), V(0.0f));
+			V k2 = k * k;
+			V fresnel = k2 * k2 * k;
+			V3<V> R = load3<V>(param, kRX);
+			V3<V> F = { R.x + (V(1.0f) - R.x) * fresnel, R.y + (V(1.0f) - R.y) * fresnel, R.z + (V(1.0f) - R.z) * fresnel };
+
+			auto above = V(0.0f) < i.z;
+			V DG2 = select(above, D * G2 / (V(4.0f) * o.z * i.z), V(0.0f));
+			store3(out, kWiX, wi);
+			store3(out, kFX, scale(F, DG2));
+			select(above, G1 * D / (V(4.0f) * o.z), V(0.0f)).store(out[kPdf]);
+		}
+
+		// 決まった乱数を返す. Other の sample_eval() 用
+		struct ReplayRandom : public PeseudoRandom {
+			float u[2];
+			int i = 0;
+
+			float uniform_float() override {
+				RT_ASSERT(i < 2);
+				return u[i++];
+			}
+			uint64_t uniform_integer() override {
+				RT_ASSERT(0);
+				return 0;
+			}
+		};
+	}
+
+	/*
+	 hit をマテリアルの種類ごとのキューに振り分けて, 種類ごとに 8 個ずつ sample_eval() をする.
+	 Lambertian, Ward, GGX は SIMD (AVX2 なら 8 wide, SSE2 なら 4 wide x 2), それ以外は仮想関数.
+	 乱数は push() のときに 2 つ渡す. 各 BxDF::sample_eval() が使う 2 つと同じ順番で,
+	 結果は同じ乱数の sample_eval() と fast_math の誤差の範囲で一致する.
+	 スレッドごとに 1 つ持つこと. flush しても容量は残る.
+	*/
+	class ShadingQueue {
+	public:
+		ShadingQueue(const MaterialTable *table) : _table(table) {}
+
+		const MaterialTable *table() const {
+			return _table;
+		}
+
+		// rayIndex は sample_eval() の results の添字
+		void push(uint32_t rayIndex, const glm::vec3 &wo, const ShadingPoint &shadingPoint, const MaterialSlot &slot, float u0, float u1) {
+			using namespace shading_queue_detail;
+			if (slot.kind == BxDFKind::Other) {
+				OtherEntry e;
+				e.rayIndex = rayIndex;
+				e.wo = wo;
+				e.shadingPoint = shadingPoint;
+				e.u0 = u0;
+				e.u1 = u1;
+				_others.push_back(e);
+				return;
+			}
+
+			Bin &bin = _bins[(int)slot.kind];
+			glm::vec3 Ns = _table->use_shading_normal(slot) ? shadingPoint.Ns() : shadingPoint.Ng;
+			const float values[kInputCount] = {
+				shadingPoint.Ng.x, shadingPoint.Ng.y, shadingPoint.Ng.z,
+				wo.x, wo.y, wo.z,
+				Ns.x, Ns.y, Ns.z,
+				u0, u1
+			};
+			for (int i = 0; i < kInputCount; ++i) {
+				bin.inputs[i].push_back(values[i]);
+			}
+			bin.tableIndices.push_back(slot.index);
+			bin.rayIndices.push_back(rayIndex);
+		}
+
+		std::size_t size() const {
+			std::size_t n = _others.size();
+			for (const Bin &bin : _bins) {
+				n += bin.rayIndices.size();
+			}
+			return n;
+		}
+
+		// 積んだすべてを評価して results[rayIndex] に書き, キューを空にする
+		void sample_eval(BxDFSample *results) {
+			using namespace shading_queue_detail;
+
+			const MaterialTable::LambertianParams &lambertian = _table->lambertian_params;
+			const float *lambertianParams[kParamCount] = {
+				lambertian.R.x(), lambertian.R.y(), lambertian.R.z(), lambertian.shadingNormal.data(), nullptr
+			};
+			run(BxDFKind::Lambertian, lambertianParams, 4, BxDFLobe::Diffuse, lambertian_sample_eval<Lane>, results);
+
+			const float *wardParams[kParamCount] = {};
+			run(BxDFKind::Ward, wardParams, 0, BxDFLobe::Glossy, ward_sample_eval<Lane>, results);
+
+			const MaterialTable::GGXParams &ggx = _table->ggx_params;
+			const float *ggxParams[kParamCount] = {
+				ggx.R.x(), ggx.R.y(), ggx.R.z(), ggx.alphaU.data(), ggx.alphaV.data()
+			};
+			run(BxDFKind::GGX, ggxParams, 5, BxDFLobe::Glossy, ggx_sample_eval<Lane>, results);
+
+			ReplayRandom random;
+			for (const OtherEntry &e : _others) {
+				random.u[0] = e.u0;
+				random.u[1] = e.u1;
+				random.i = 0;
+				results[e.rayIndex] = e.shadingPoint.bxdf->sample_eval(&random, e.wo, e.shadingPoint);
+			}
+			_others.clear();
+		}
+	private:
+		using Kernel = void(*)(const float *const *, const float *const *, float *const *);
+
+		void run(BxDFKind kind, const float *const *table, int paramCount, BxDFLobe lobe, Kernel kernel, BxDFSample *results) {
+			using namespace shading_queue_detail;
+
+			Bin &bin = _bins[(int)kind];
+			std::size_t n = bin.rayIndices.size();
+			if (n == 0) {
+				return;
+			}
+
+			// 端数は最後の要素で埋める
+			while (bin.rayIndices.size() % kBatchSize) {
+				for (int i = 0; i < kInputCount; ++i) {
+					bin.inputs[i].push_back(bin.inputs[i][n - 1]);
+				}
+				bin.tableIndices.push_back(bin.tableIndices[n - 1]);
+				bin.rayIndices.push_back(bin.rayIndices[n - 1]);
+			}
+
+			alignas(32) float params[kParamCount][kBatchSize];
+			alignas(32) float outputs[kOutputCount][kBatchSize];
+			for (std::size_t base = 0; base < n; base += kBatchSize) {
+				const uint32_t *indices = bin.tableIndices.data() + base;
+				for (int p = 0; p < paramCount; ++p) {
+					gather(table[p], indices, params[p]);
+				}
+
+				for (int lane = 0; lane < kBatchSize; lane += Lane::width) {
+					const float *in[kInputCount];
+					for (int i = 0; i < kInputCount; ++i) {
+						in[i] = bin.inputs[i].data() + base + lane;
+					}
+					const float *param[kParamCount];
+					for (int p = 0; p < kParamCount; ++p) {
+						param[p] = params[p] + lane;
+					}
+					float *out[kOutputCount];
+					for (int o = 0; o < kOutputCount; ++o) {
+						out[o] = outputs[o] + lane;
+					}
+					kernel(in, param, out);
+				}
+
+				std::size_t count = std::min<std::size_t>(kBatchSize, n - base);
+				for (std::size_t lane = 0; lane < count; ++lane) {
+					BxDFSample &s = results[bin.rayIndices[base + lane]];
+					s.wi = glm::vec3(outputs[kWiX][lane], outputs[kWiY][lane], outputs[kWiZ][lane]);
+					s.f = glm::vec3(outputs[kFX][lane], outputs[kFY][lane], outputs[kFZ][lane]);
+					s.pdf = outputs[kPdf][lane];
+					s.lobe = lobe;
+				}
+			}
+
+			for (int i = 0; i < kInputCount; ++i) {
+				bin.inputs[i].clear();
+			}
+			bin.tableIndices.clear();
+			bin.rayIndices.clear();
+		}
+
+		static void gather(const float *table, const uint32_t *indices, float *dst) {
+#if defined(RT_FAST_MATH_AVX2)
+			__m256i index = _mm256_loadu_si256((const __m256i *)indices);
+			_mm256_store_ps(dst, _mm256_i32gather_ps(table, index, 4));
+#else
+			for (int i = 0; i < shading_queue_detail::kBatchSize; ++i) {
+				dst[i] = table[indices[i]];
+			}
+#endif
+		}
+
+		struct Bin {
+			std::vector<float> inputs[shading_queue_detail::kInputCount];
+			std::vector<uint32_t> tableIndices;
+			std::vector<uint32_t> rayIndices;
+		};
+		struct OtherEntry {
+			uint32_t rayIndex;
+			glm::vec3 wo;
+			ShadingPoint shadingPoint;
+			float u0;
+			float u1;
+		};
+
+		const MaterialTable *_table;
+		Bin _bins[kBxDFKindCount];
+		std::vector<OtherEntry> _others;
+	};
+}
\ No newline at end of file
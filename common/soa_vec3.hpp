@@ -0,0 +1,42 @@
+﻿#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace rt {
+	// glm::vec3 の配列を x, y, z の 3 本に分けて持つ
+	class SoAVec3 {
+	public:
+		void reserve(std::size_t n) {
+			_x.reserve(n);
+			_y.reserve(n);
+			_z.reserve(n);
+		}
+		void push_back(const glm::vec3 &v) {
+			_x.push_back(v.x);
+			_y.push_back(v.y);
+			_z.push_back(v.z);
+		}
+		glm::vec3 operator[](std::size_t i) const {
+			return glm::vec3(_x[i], _y[i], _z[i]);
+		}
+		std::size_t size() const {
+			return _x.size();
+		}
+		bool empty() const {
+			return _x.empty();
+		}
+		const float *x() const {
+			return _x.data();
+		}
+		const float *y() const {
+			return _y.data();
+		}
+		const float *z() const {
+			return _z.data();
+		}
+	private:
+		std::vector<float> _x;
+		std::vector<float> _y;
+		std::vector<float> _z;
+	};
+}
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include "peseudo_random.hpp"
+#include "fast_math.hpp"
 
 namespace rt {
 	// z up but it is not important.
@@ -11,8 +12,10 @@ namespace rt {
 		Real phi = u0 * glm::two_pi<Real>();
 		Real z = glm::mix(Real(-1.0), Real(+1.0), u1);
 		Real r_xy = std::sqrt(std::max(Real(1.0) - z * z, Real(0.0)));
-		Real x = r_xy * std::cos(phi);
-		Real y = r_xy * std::sin(phi);
+		Real sinPhi, cosPhi;
+		math::sincos(phi, &sinPhi, &cosPhi);
+		Real x = r_xy * cosPhi;
+		Real y = r_xy * sinPhi;
 		return glm::tvec3<Real>(x, y, z);
 	}
 
@@ -22,8 +25,10 @@ namespace rt {
 		Real phi = u0 * glm::two_pi<Real>();
 		Real z = u1;
 		Real r_xy = std::sqrt(std::max(Real(1.0) - z * z, Real(0.0)));
-		Real x = r_xy * std::cos(phi);
-		Real y = r_xy * std::sin(phi);
+		Real sinPhi, cosPhi;
+		math::sincos(phi, &sinPhi, &cosPhi);
+		Real x = r_xy * cosPhi;
+		Real y = r_xy * sinPhi;
 		return glm::tvec3<Real>(x, y, z);
 	}
 }
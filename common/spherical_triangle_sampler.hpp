@@ -2,84 +2,87 @@
 #include <algorithm>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
+#include "fast_math.hpp"
 
 namespace rt {
+	/*
+	 Arvo, "Stratified Sampling of Spherical Triangles"
+	 the setup has no acos. the solid angle is Van Oosterom and Strackee (one atan2), and
+	 sin, cos of the angle at A come from the cross products. sample_direction() then needs one sincos.
+	 the setup is meant to be built once and shared by sample and pdf.
+	*/
 	template <class Real>
 	class SphericalTriangleSampler {
 	public:
 		using Vec3 = glm::tvec3<Real>;
 
+		SphericalTriangleSampler() {}
+
 		/*
 		 a, b, c はポリゴンの頂点
-		 n はポリゴンの法線
+		 o は立体角を見る点
 		*/
-		SphericalTriangleSampler(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &o)
-		:_a(a), _b(b), _c(c), _o(o) {
+		SphericalTriangleSampler(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &o) {
 			_A = glm::normalize(a - o);
 			_B = glm::normalize(b - o);
-			_C = glm::normalize(c - o);
+			Vec3 C = glm::normalize(c - o);
+
+			Vec3 nAB = glm::cross(_A, _B);
+			Vec3 nAC = glm::cross(_A, C);
+			Real lengthAC = glm::length(nAC);
+
+			// |A . (B x C)|
+			Real det = std::abs(glm::dot(nAB, C));
+			_cos_c = glm::dot(_A, _B);
+			_sr = Real(2.0) * math::atan2(det, Real(1.0) + _cos_c + glm::dot(_B, C) + glm::dot(C, _A));
 
-			_nAB = glm::normalize(glm::cross(_A, _B));
-			_nBC = glm::normalize(glm::cross(_B, _C));
-			_nCA = glm::normalize(glm::cross(_C, _A));
+			// (A x B) x (A x C) = (A . (B x C)) A
+			Real denom = glm::length(nAB) * lengthAC;
+			_cosAlpha = glm::dot(nAB, nAC) / denom;
+			_sinAlpha = det / denom;
 
-			_alpha = std::acos(glm::dot(-_nAB, _nCA));
-			_beta = std::acos(glm::dot(-_nBC, _nAB));
-			_gamma = std::acos(glm::dot(-_nCA, _nBC));
-			_sr = _alpha + _beta + _gamma - glm::pi<Real>();
+			// normalize(C - (C . A) A)
+			_CperpA = glm::cross(nAC, _A) / lengthAC;
 		}
 
 		Real solidAngle() const {
 			return _sr;
 		}
+		Real pdf() const {
+			return Real(1.0) / _sr;
+		}
 
 		Vec3 sample_direction(Real xi_u, Real xi_v) const {
-			Real _area = _sr * xi_u;
-
-			Real phi = _area - _alpha;
-			Real sinPhi = sin(phi);
-			Real cosPhi = cos(phi);
-			
-			Real cos_c = glm::dot(_A, _B);
+			Real sinArea, cosArea;
+			math::sincos(_sr * xi_u, &sinArea, &cosArea);
 
-			Real sinAlpha = sin(_alpha);
-			Real cosAlpha = cos(_alpha);
+			// sin, cos of (area - alpha)
+			Real sinPhi = sinArea * _cosAlpha - cosArea * _sinAlpha;
+			Real cosPhi = cosArea * _cosAlpha + sinArea * _sinAlpha;
 
-			Real u = cosPhi - cosAlpha;
-			Real v = sinPhi + sinAlpha * cos_c;
+			Real u = cosPhi - _cosAlpha;
+			Real v = sinPhi + _sinAlpha * _cos_c;
 
 			Real cos_b_hat =
-				((v * cosPhi - u * sinPhi) * cosAlpha - v)
+				((v * cosPhi - u * sinPhi) * _cosAlpha - v)
 				/
-				((v * sinPhi + u * cosPhi) * sinAlpha);
+				((v * sinPhi + u * cosPhi) * _sinAlpha);
+			cos_b_hat = glm::clamp(cos_b_hat, Real(-1.0), Real(1.0));
 
-			auto ortho_vector = [](Vec3 x, Vec3 y) {
-				return glm::normalize(x - glm::dot(x, y) * y);
-			};
-
-			Vec3 C_hat = _A * cos_b_hat + sqrt(std::max(Real(1.0) - cos_b_hat * cos_b_hat, Real(0.0))) * ortho_vector(_C, _A);
+			Vec3 C_hat = _A * cos_b_hat + std::sqrt(std::max(Real(1.0) - cos_b_hat * cos_b_hat, Real(0.0))) * _CperpA;
 			Real cosTheta = Real(1.0) - xi_v * (Real(1.0) - glm::dot(C_hat, _B));
-			Vec3 P = cosTheta * _B + sqrt(std::max(Real(1.0) - cosTheta * cosTheta, Real(0.0))) * ortho_vector(C_hat, _B);
+			Vec3 P = cosTheta * _B + std::sqrt(std::max(Real(1.0) - cosTheta * cosTheta, Real(0.0))) * glm::normalize(C_hat - glm::dot(C_hat, _B) * _B);
 
 			return P;
 		}
-
-		Vec3 _a;
-		Vec3 _b;
-		Vec3 _c;
-
-		Vec3 _o;
+	private:
 		Vec3 _A;
 		Vec3 _B;
-		Vec3 _C;
-
-		Vec3 _nAB;
-		Vec3 _nBC;
-		Vec3 _nCA;
+		Vec3 _CperpA;
 
-		Real _alpha = Real(0.0);
-		Real _beta = Real(0.0);
-		Real _gamma = Real(0.0);
+		Real _cos_c = Real(0.0);
+		Real _cosAlpha = Real(1.0);
+		Real _sinAlpha = Real(0.0);
 		Real _sr = Real(0.0);
 	};
 }
\ No newline at end of file
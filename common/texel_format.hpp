@@ -0,0 +1,209 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+namespace rt {
+	enum class TexelFormat {
+		RGBA32F, // 16 bytes
+		RGB16F,  //  6 bytes, half float
+		RGBE,    //  4 bytes, Radiance shared exponent
+		RGB9E5,  //  4 bytes, 9:9:9:5 shared exponent
+	};
+
+	inline int texel_bytes(TexelFormat format) {
+		switch (format) {
+		case TexelFormat::RGBA32F: return 16;
+		case TexelFormat::RGB16F:  return 6;
+		case TexelFormat::RGBE:    return 4;
+		case TexelFormat::RGB9E5:  return 4;
+		}
+		return 0;
+	}
+
+	/*
+	 half float conversion, round to nearest even.
+	 "half <-> float conversions", Fabian Giesen
+	*/
+	inline uint16_t float_to_half(float value) {
+		const uint32_t f32infty = 255u << 23;
+		const uint32_t f16max = (127u + 16u) << 23;
+		const uint32_t denorm_magic_bits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+		uint32_t f;
+		memcpy(&f, &value, sizeof(f));
+		uint32_t sign = f & 0x80000000u;
+		f ^= sign;
+
+		uint16_t o;
+		if (f >= f16max) {
+			o = f32infty < f ? 0x7E00 : 0x7C00; // NaN or Inf
+		}
+		else if (f < (113u << 23)) {
+			// subnormal or zero
+			float fv, denorm_magic;
+			memcpy(&fv, &f, sizeof(f));
+			memcpy(&denorm_magic, &denorm_magic_bits, sizeof(denorm_magic));
+			fv += denorm_magic;
+			memcpy(&f, &fv, sizeof(f));
+			o = (uint16_t)(f - denorm_magic_bits);
+		}
+		else {
+			uint32_t mant_odd = (f >> 13) & 1u;
+			f += ((uint32_t)(15 - 127) << 23) + 0xFFFu;
+			f += mant_odd;
+			o = (uint16_t)(f >> 13);
+		}
+		return o | (uint16_t)(sign >> 16);
+	}
+	inline float half_to_float(uint16_t h) {
+		const uint32_t shifted_exp = 0x7C00u << 13;
+		uint32_t o = (h & 0x7FFFu) << 13;
+		uint32_t exp = shifted_exp & o;
+		o += (uint32_t)(127 - 15) << 23;
+
+		if (exp == shifted_exp) {
+			o += (uint32_t)(128 - 16) << 23; // Inf / NaN
+		}
+		else if (exp == 0) {
+			// subnormal
+			const uint32_t magic_bits = 113u << 23;
+			float magic, f;
+			o += 1u << 23;
+			memcpy(&f, &o, sizeof(f));
+			memcpy(&magic, &magic_bits, sizeof(magic));
+			f -= magic;
+			memcpy(&o, &f, sizeof(f));
+		}
+		o |= (uint32_t)(h & 0x8000u) << 16;
+
+		float value;
+		memcpy(&value, &o, sizeof(value));
+		return value;
+	}
+
+	struct TexelRGB16F {
+		uint16_t r;
+		uint16_t g;
+		uint16_t b;
+	};
+	inline TexelRGB16F encode_rgb16f(const glm::vec3 &c) {
+		return { float_to_half(c.x), float_to_half(c.y), float_to_half(c.z) };
+	}
+	inline glm::vec3 decode_rgb16f(TexelRGB16F t) {
+		return glm::vec3(half_to_float(t.r), half_to_float(t.g), half_to_float(t.b));
+	}
+
+	/*
+	 Radiance RGBE, "Real Pixels", Greg Ward
+	 the byte order is the same as in .hdr files, and the decode is the same as stb_image.
+	 negative values are clamped to zero.
+	*/
+	struct TexelRGBE {
+		uint8_t r;
+		uint8_t g;
+		uint8_t b;
+		uint8_t e;
+	};
+	inline TexelRGBE encode_rgbe(const glm::vec3 &c) {
+		float r = std::max(c.x, 0.0f);
+		float g = std::max(c.y, 0.0f);
+		float b = std::max(c.z, 0.0f);
+		float v = std::max(std::max(r, g), b);
+		if (!(1.0e-32f <= v)) {
+			return { 0, 0, 0, 0 };
+		}
+		if (!std::isfinite(v)) {
+			return { 255, 255, 255, 255 };
+		}
+		int e;
+		float m = std::frexp(v, &e);
+		float scale = m * 256.0f / v;
+		return {
+			(uint8_t)std::min(r * scale, 255.0f),
+			(uint8_t)std::min(g * scale, 255.0f),
+			(uint8_t)std::min(b * scale, 255.0f),
+			(uint8_t)(e + 128)
+		};
+	}
+	inline glm::vec3 decode_rgbe(TexelRGBE t) {
+		if (t.e == 0) {
+			return glm::vec3(0.0f);
+		}
+		float f = std::ldexp(1.0f, (int)t.e - (128 + 8));
+		return glm::vec3(t.r * f, t.g * f, t.b * f);
+	}
+
+	/*
+	 9:9:9:5 shared exponent, EXT_texture_shared_exponent
+	 range is [0, 65408]. r | g << 9 | b << 18 | e << 27
+	*/
+	inline uint32_t encode_rgb9e5(const glm::vec3 &c) {
+		constexpr int N = 9;
+		constexpr int B = 15;
+		constexpr float kMax = (float)((1 << N) - 1) / (1 << N) * (float)(1 << (31 - B));
+
+		auto clamp_component = [kMax](float x) {
+			return 0.0f < x ? std::min(x, kMax) : 0.0f; // NaN goes to 0
+		};
+		float r = clamp_component(c.x);
+		float g = clamp_component(c.y);
+		float b = clamp_component(c.z);
+		float maxrgb = std::max(std::max(r, g), b);
+
+		// max(-B - 1, floor(log2(maxrgb))) + 1 + B
+		int exp_shared = 0;
+		if (0.0f < maxrgb) {
+			int e;
+			std::frexp(maxrgb, &e);
+			exp_shared = std::max(-B - 1, e - 1) + 1 + B;
+		}
+		float denom = std::ldexp(1.0f, exp_shared - B - N);
+		int maxm = (int)std::floor(maxrgb / denom + 0.5f);
+		if (maxm == (1 << N)) {
+			denom *= 2.0f;
+			exp_shared += 1;
+		}
+		uint32_t rm = (uint32_t)std::floor(r / denom + 0.5f);
+		uint32_t gm = (uint32_t)std::floor(g / denom + 0.5f);
+		uint32_t bm = (uint32_t)std::floor(b / denom + 0.5f);
+		return rm | (gm << 9) | (bm << 18) | ((uint32_t)exp_shared << 27);
+	}
+	inline glm::vec3 decode_rgb9e5(uint32_t t) {
+		float f = std::ldexp(1.0f, (int)(t >> 27) - (15 + 9));
+		return glm::vec3(
+			(float)(t & 0x1FFu) * f,
+			(float)((t >> 9) & 0x1FFu) * f,
+			(float)((t >> 18) & 0x1FFu) * f
+		);
+	}
+
+	// one texel stored in format at src (texel_bytes(format) bytes). alpha is 1 except RGBA32F
+	inline glm::vec4 decode_texel(TexelFormat format, const uint8_t *src) {
+		switch (format) {
+		case TexelFormat::RGB16F: {
+			TexelRGB16F t;
+			memcpy(&t, src, sizeof(t));
+			return glm::vec4(decode_rgb16f(t), 1.0f);
+		}
+		case TexelFormat::RGBE: {
+			TexelRGBE t;
+			memcpy(&t, src, sizeof(t));
+			return glm::vec4(decode_rgbe(t), 1.0f);
+		}
+		case TexelFormat::RGB9E5: {
+			uint32_t t;
+			memcpy(&t, src, sizeof(t));
+			return glm::vec4(decode_rgb9e5(t), 1.0f);
+		}
+		default:
+			break;
+		}
+		glm::vec4 value;
+		memcpy(&value, src, sizeof(value));
+		return value;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,511 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tbb/tbb.h>
+#include <glm/glm.hpp>
+
+#include "assertion.hpp"
+#include "image2d.hpp"
+#include "mapped_file.hpp"
+
+namespace rt {
+	enum {
+		kTextureTileSize = 64,
+		kTextureTileTexels = kTextureTileSize * kTextureTileSize,
+	};
+
+	inline int mip_level_count(int width, int height) {
+		int levels = 1;
+		while (1 < (std::max(width, height) >> (levels - 1))) {
+			++levels;
+		}
+		return levels;
+	}
+	inline int mip_level_size(int size, int level) {
+		return std::max(size >> level, 1);
+	}
+	inline int tile_count(int size) {
+		return (size + kTextureTileSize - 1) / kTextureTileSize;
+	}
+	inline std::size_t tile_bytes(TexelFormat format) {
+		return (std::size_t)kTextureTileTexels * texel_bytes(format);
+	}
+
+	/*
+	 where the tiles of a mip pyramid come from.
+	 read_tile() fills kTextureTileSize^2 texels encoded in format() (tile_bytes(format()) bytes),
+	 texels outside of the level are clamped to the edge.
+	 it is called from many threads at once.
+	*/
+	class ITileSource {
+	public:
+		virtual ~ITileSource() {}
+		virtual int width() const = 0;
+		virtual int height() const = 0;
+		virtual int levels() const = 0;
+		virtual TexelFormat format() const = 0;
+		virtual void read_tile(int level, int tx, int ty, uint8_t *texels) const = 0;
+	};
+
+	// mip pyramid of a resident image, 2x2 box filtered. the levels keep the texel format of the image.
+	class ImageTileSource : public ITileSource {
+	public:
+		ImageTileSource(std::shared_ptr<Image2D> image) {
+			_levels.push_back(image);
+			for (int level = 1, n = mip_level_count(image->width(), image->height()); level < n; ++level) {
+				const Image2D &src = *_levels.back();
+				auto dst = std::shared_ptr<Image2D>(new Image2D());
+				dst->resize(mip_level_size(image->width(), level), mip_level_size(image->height(), level), image->format());
+
+				tbb::parallel_for(tbb::blocked_range<int>(0, dst->height()), [&](const tbb::blocked_range<int> &range) {
+					for (int y = range.begin(); y < range.end(); ++y) {
+						for (int x = 0; x < dst->width(); ++x) {
+							int x0 = std::min(x * 2, src.width() - 1);
+							int x1 = std::min(x * 2 + 1, src.width() - 1);
+							int y0 = std::min(y * 2, src.height() - 1);
+							int y1 = std::min(y * 2 + 1, src.height() - 1);
+							glm::vec4 sum = src.texel(x0, y0) + src.texel(x1, y0) + src.texel(x0, y1) + src.texel(x1, y1);
+							dst->set_texel(x, y, sum * 0.25f);
+						}
+					}
+				});
+				_levels.push_back(dst);
+			}
+		}
+		int width() const override {
+			return _levels[0]->width();
+		}
+		int height() const override {
+			return _levels[0]->height();
+		}
+		int levels() const override {
+			return (int)_levels.size();
+		}
+		TexelFormat format() const override {
+			return _levels[0]->format();
+		}
+		void read_tile(int level, int tx, int ty, uint8_t *texels) const override {
+			const Image2D &image = *_levels[level];
+			int bytes = texel_bytes(image.format());
+			for (int y = 0; y < kTextureTileSize; ++y) {
+				int iy = std::min(ty * kTextureTileSize + y, image.height() - 1);
+				uint8_t *row = texels + (std::size_t)y * kTextureTileSize * bytes;
+
+				// the texels in the level are copied as is, the rest repeats the last one
+				int x0 = tx * kTextureTileSize;
+				int n = std::min(image.width() - x0, (int)kTextureTileSize);
+				memcpy(row, image.encoded_texel(iy * image.width() + x0), (std::size_t)n * bytes);
+				for (int x = n; x < kTextureTileSize; ++x) {
+					memcpy(row + x * bytes, row + (n - 1) * bytes, bytes);
+				}
+			}
+		}
+	private:
+		std::vector<std::shared_ptr<Image2D>> _levels;
+	};
+
+	/*
+	 Tiled mip file: header, key, then the tiles of every level in (level, ty, tx) order,
+	 the texels are stored in the texel format of the source.
+	 the file is memory mapped, so only the tiles that are actually read are paged in by the OS.
+	*/
+	class TiledFileSource : public ITileSource {
+	public:
+		enum {
+			kVersion = 2,
+		};
+
+		// write all tiles of source to path. key is stored to validate the file later.
+		static bool write(const std::filesystem::path &path, const ITileSource &source, const std::string &key) {
+			Header header;
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.version = kVersion;
+			header.keyBytes = (uint32_t)key.size();
+			header.width = source.width();
+			header.height = source.height();
+			header.levels = source.levels();
+			header.tileSize = kTextureTileSize;
+			header.format = (int32_t)source.format();
+
+			return write_file_atomic(path, [&](FILE *fp) {
+				const char zeros[16] = {};
+				bool ok = true;
+				ok = ok && fwrite(&header, sizeof(Header), 1, fp) == 1;
+				ok = ok && fwrite(key.data(), 1, key.size(), fp) == key.size();
+				ok = ok && fwrite(zeros, 1, padded(key.size()) - key.size(), fp) == padded(key.size()) - key.size();
+
+				std::vector<uint8_t> texels(tile_bytes(source.format()));
+				for (int level = 0; level < header.levels && ok; ++level) {
+					int tiles_x = tile_count(mip_level_size(header.width, level));
+					int tiles_y = tile_count(mip_level_size(header.height, level));
+					for (int ty = 0; ty < tiles_y && ok; ++ty) {
+						for (int tx = 0; tx < tiles_x && ok; ++tx) {
+							source.read_tile(level, tx, ty, texels.data());
+							ok = fwrite(texels.data(), 1, texels.size(), fp) == texels.size();
+						}
+					}
+				}
+				return ok;
+			});
+		}
+
+		// if succeeded return true
+		bool open(const std::filesystem::path &path, const std::string &key) {
+			_tileOffsets.clear();
+			if (_file.open(path) == false) {
+				return false;
+			}
+			Header header;
+			if (_file.size() < sizeof(Header)) {
+				_file.close();
+				return false;
+			}
+			memcpy(&header, _file.data(), sizeof(Header));
+			if (memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kVersion || header.tileSize != kTextureTileSize || texel_bytes((TexelFormat)header.format) == 0) {
+				_file.close();
+				return false;
+			}
+			if (header.keyBytes != key.size() || _file.size() < sizeof(Header) + padded(key.size()) || memcmp(_file.data() + sizeof(Header), key.data(), key.size()) != 0) {
+				_file.close();
+				return false;
+			}
+
+			_width = header.width;
+			_height = header.height;
+			_levels = header.levels;
+			_format = (TexelFormat)header.format;
+
+			std::size_t offset = sizeof(Header) + padded(key.size());
+			for (int level = 0; level < _levels; ++level) {
+				_tileOffsets.push_back(offset);
+				offset += (std::size_t)tile_count(mip_level_size(_width, level)) * tile_count(mip_level_size(_height, level)) * tile_bytes(_format);
+			}
+			if (offset != _file.size()) {
+				_file.close();
+				return false;
+			}
+			return true;
+		}
+
+		int width() const override {
+			return _width;
+		}
+		int height() const override {
+			return _height;
+		}
+		int levels() const override {
+			return _levels;
+		}
+		TexelFormat format() const override {
+			return _format;
+		}
+		void read_tile(int level, int tx, int ty, uint8_t *texels) const override {
+			int tiles_x = tile_count(mip_level_size(_width, level));
+			std::size_t offset = _tileOffsets[level] + ((std::size_t)ty * tiles_x + tx) * tile_bytes(_format);
+			memcpy(texels, _file.data() + offset, tile_bytes(_format));
+		}
+	private:
+		static constexpr char kMagic[8] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', '\0' };
+		struct Header {
+			char magic[8];
+			uint32_t version = 0;
+			uint32_t keyBytes = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			int32_t levels = 0;
+			int32_t tileSize = 0;
+			int32_t format = 0;
+		};
+		static std::size_t padded(std::size_t bytes) {
+			return (bytes + 15) & ~std::size_t(15);
+		}
+
+		MappedFile _file;
+		int _width = 0;
+		int _height = 0;
+		int _levels = 0;
+		TexelFormat _format = TexelFormat::RGBA32F;
+		std::vector<std::size_t> _tileOffsets;
+	};
+
+	/*
+	 open "<image>.tiles" made from the image file, or make it if it is missing, stale or in another format.
+	 the image itself is only decoded when the tiled file has to be made.
+	*/
+	inline std::shared_ptr<ITileSource> open_tiled_texture(const std::filesystem::path &image_path, TexelFormat format = TexelFormat::RGBA32F) {
+		std::string key = file_identity(image_path);
+		if (key.empty()) {
+			return std::shared_ptr<ITileSource>();
+		}
+		std::filesystem::path tiled_path = image_path;
+		tiled_path += ".tiles";
+
+		auto source = std::shared_ptr<TiledFileSource>(new TiledFileSource());
+		if (source->open(tiled_path, key) && source->format() == format) {
+			return source;
+		}
+
+		auto image = std::shared_ptr<Image2D>(new Image2D());
+		if (image->load(image_path.string().c_str(), format) == false) {
+			return std::shared_ptr<ITileSource>();
+		}
+		ImageTileSource image_source(image);
+		if (TiledFileSource::write(tiled_path, image_source, key) && source->open(tiled_path, key)) {
+			return source;
+		}
+		// can't write next to the image, keep it resident.
+		return std::shared_ptr<ITileSource>(new ImageTileSource(image));
+	}
+
+	/*
+	 Tiles of many textures are paged in on demand and shared under one memory budget.
+	 tiles keep the texel format of the source and are decoded per texel, so the budget counts the encoded bytes.
+	 the least recently used tiles are evicted first.
+	 each thread keeps a few recently used tiles without locking, these are alive until replaced
+	 even if they are evicted, so the resident memory can exceed the budget by a few tiles per thread.
+	 add() must not be called during lookups.
+	*/
+	class TextureCache {
+	public:
+		enum {
+			kThreadCacheEntries = 16,
+		};
+		struct Tile {
+			TexelFormat format = TexelFormat::RGBA32F;
+			std::vector<uint8_t> texels; // tile_bytes(format)
+		};
+		struct Stats {
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+			uint64_t evictions = 0;
+			std::size_t residentBytes = 0;
+		};
+
+		TextureCache(std::size_t budget_bytes) :_budgetBytes(budget_bytes), _instance(next_instance()) {
+		}
+		TextureCache(const TextureCache &) = delete;
+		void operator=(const TextureCache &) = delete;
+
+		// returns the texture id
+		int add(std::shared_ptr<ITileSource> source) {
+			RT_ASSERT(source);
+			RT_ASSERT(source->levels() <= 32);
+			_sources.push_back(source);
+			return (int)_sources.size() - 1;
+		}
+		const ITileSource &source(int texture) const {
+			return *_sources[texture];
+		}
+
+		// texel of a level with repeat addressing. y = 0 is the top row same as Image2D
+		glm::vec4 texel(int texture, int level, int x, int y) const {
+			const ITileSource &s = *_sources[texture];
+			level = glm::clamp(level, 0, s.levels() - 1);
+			int w = mip_level_size(s.width(), level);
+			int h = mip_level_size(s.height(), level);
+			x = repeat(x, w);
+			y = repeat(y, h);
+			const Tile *tile = acquire(texture, level, x / kTextureTileSize, y / kTextureTileSize);
+			int index = (y % kTextureTileSize) * kTextureTileSize + (x % kTextureTileSize);
+			return decode_texel(tile->format, tile->texels.data() + (std::size_t)index * texel_bytes(tile->format));
+		}
+
+		/*
+		v
+		^
+		|
+		o----> u
+		nearest texel, same as Image2D::sample_repeat
+		*/
+		glm::vec4 sample_repeat(int texture, float u, float v, int level = 0) const {
+			const ITileSource &s = *_sources[texture];
+			level = glm::clamp(level, 0, s.levels() - 1);
+			int w = mip_level_size(s.width(), level);
+			int h = mip_level_size(s.height(), level);
+
+			u = glm::fract(u);
+			v = glm::fract(v);
+			int x = glm::clamp((int)(u * w), 0, w - 1);
+			int y = glm::clamp((int)((1.0f - v) * h), 0, h - 1);
+			return texel(texture, level, x, y);
+		}
+
+		/*
+		v
+		^
+		|
+		o----> u
+		same as Image2D::sample_repeat
+		*/
+		glm::vec4 bilinear(int texture, float u, float v, int level = 0) const {
+			const ITileSource &s = *_sources[texture];
+			level = glm::clamp(level, 0, s.levels() - 1);
+			int w = mip_level_size(s.width(), level);
+			int h = mip_level_size(s.height(), level);
+
+			float fx = glm::fract(u) * w - 0.5f;
+			float fy = (1.0f - glm::fract(v)) * h - 0.5f;
+			float x0 = std::floor(fx);
+			float y0 = std::floor(fy);
+			float tx = fx - x0;
+			float ty = fy - y0;
+			int ix = (int)x0;
+			int iy = (int)y0;
+
+			glm::vec4 c00 = texel(texture, level, ix, iy);
+			glm::vec4 c10 = texel(texture, level, ix + 1, iy);
+			glm::vec4 c01 = texel(texture, level, ix, iy + 1);
+			glm::vec4 c11 = texel(texture, level, ix + 1, iy + 1);
+			return glm::mix(glm::mix(c00, c10, tx), glm::mix(c01, c11, tx), ty);
+		}
+
+		// lod = log2(footprint in texels of level 0)
+		glm::vec4 trilinear(int texture, float u, float v, float lod) const {
+			const ITileSource &s = *_sources[texture];
+			lod = glm::clamp(lod, 0.0f, (float)(s.levels() - 1));
+			int level = (int)lod;
+			float t = lod - level;
+			glm::vec4 c0 = bilinear(texture, u, v, level);
+			if (t <= 0.0f) {
+				return c0;
+			}
+			glm::vec4 c1 = bilinear(texture, u, v, level + 1);
+			return glm::mix(c0, c1, t);
+		}
+
+		Stats stats() const {
+			Stats s;
+			s.hits = _hits.load(std::memory_order_relaxed);
+			s.misses = _misses.load(std::memory_order_relaxed);
+			s.evictions = _evictions.load(std::memory_order_relaxed);
+			std::lock_guard<std::mutex> lock(_mutex);
+			s.residentBytes = _residentBytes;
+			return s;
+		}
+	private:
+		static int repeat(int x, int n) {
+			int r = x % n;
+			return r < 0 ? r + n : r;
+		}
+		static uint64_t tile_key(int texture, int level, int tx, int ty) {
+			return ((uint64_t)texture << 44) | ((uint64_t)level << 39) | ((uint64_t)ty << 20) | (uint64_t)tx;
+		}
+		static uint64_t next_instance() {
+			static std::atomic<uint64_t> counter(0);
+			return ++counter;
+		}
+
+		const Tile *acquire(int texture, int level, int tx, int ty) const {
+			uint64_t key = tile_key(texture, level, tx, ty);
+
+			struct ThreadCache {
+				uint64_t instance = 0;
+				uint64_t keys[kThreadCacheEntries];
+				std::shared_ptr<const Tile> tiles[kThreadCacheEntries];
+			};
+			static thread_local ThreadCache threadCache;
+			if (threadCache.instance != _instance) {
+				threadCache.instance = _instance;
+				for (int i = 0; i < kThreadCacheEntries; ++i) {
+					threadCache.keys[i] = ~0ull;
+					threadCache.tiles[i].reset();
+				}
+			}
+			int slot = (int)((key ^ (key >> 20) ^ (key >> 39)) % kThreadCacheEntries);
+			if (threadCache.keys[slot] == key) {
+				_hits.fetch_add(1, std::memory_order_relaxed);
+				return threadCache.tiles[slot].get();
+			}
+
+			std::shared_ptr<const Tile> tile = find_or_load(key, texture, level, tx, ty);
+			threadCache.keys[slot] = key;
+			threadCache.tiles[slot] = tile;
+			return tile.get();
+		}
+
+		std::shared_ptr<const Tile> find_or_load(uint64_t key, int texture, int level, int tx, int ty) const {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				auto it = _tiles.find(key);
+				if (it != _tiles.end()) {
+					_lru.splice(_lru.begin(), _lru, it->second.lru);
+					_hits.fetch_add(1, std::memory_order_relaxed);
+					return it->second.tile;
+				}
+			}
+
+			// read outside of the lock. two threads may read the same tile, the first one wins.
+			_misses.fetch_add(1, std::memory_order_relaxed);
+			auto tile = std::shared_ptr<Tile>(new Tile());
+			tile->format = _sources[texture]->format();
+			tile->texels.resize(tile_bytes(tile->format));
+			_sources[texture]->read_tile(level, tx, ty, tile->texels.data());
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto it = _tiles.find(key);
+			if (it != _tiles.end()) {
+				_lru.splice(_lru.begin(), _lru, it->second.lru);
+				return it->second.tile;
+			}
+			_lru.push_front(key);
+			_tiles[key] = Entry{ tile, _lru.begin() };
+			_residentBytes += tile->texels.size();
+
+			while (_budgetBytes < _residentBytes && 1 < _tiles.size()) {
+				uint64_t victim = _lru.back();
+				_lru.pop_back();
+				auto victim_it = _tiles.find(victim);
+				_residentBytes -= victim_it->second.tile->texels.size();
+				_tiles.erase(victim_it);
+				_evictions.fetch_add(1, std::memory_order_relaxed);
+			}
+			return tile;
+		}
+
+		struct Entry {
+			std::shared_ptr<const Tile> tile;
+			std::list<uint64_t>::iterator lru;
+		};
+
+		std::size_t _budgetBytes = 0;
+		uint64_t _instance = 0;
+		std::vector<std::shared_ptr<ITileSource>> _sources;
+
+		mutable std::mutex _mutex;
+		mutable std::unordered_map<uint64_t, Entry> _tiles;
+		mutable std::list<uint64_t> _lru;
+		mutable std::size_t _residentBytes = 0;
+
+		mutable std::atomic<uint64_t> _hits{ 0 };
+		mutable std::atomic<uint64_t> _misses{ 0 };
+		mutable std::atomic<uint64_t> _evictions{ 0 };
+	};
+
+	// one level of a texture in the cache, for the code that walks all texels like an Image2D
+	class TextureCacheLevel {
+	public:
+		TextureCacheLevel(const TextureCache &cache, int texture, int level = 0) :_cache(cache), _texture(texture), _level(level) {
+		}
+		int width() const {
+			return mip_level_size(_cache.source(_texture).width(), _level);
+		}
+		int height() const {
+			return mip_level_size(_cache.source(_texture).height(), _level);
+		}
+		glm::vec4 texel(int x, int y) const {
+			return _cache.texel(_texture, _level, x, y);
+		}
+	private:
+		const TextureCache &_cache;
+		int _texture = 0;
+		int _level = 0;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <type_traits>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "mapped_file.hpp"
+#include "render_split.hpp"
+#include "assertion.hpp"
+
+namespace rt {
+	/*
+	 kTileSize x kTileSize のタイルごとに連続して並べた, ピクセルと乱数の状態の置き場.
+	   [pixels : tileCount * kTileSize^2 * Pixel][random states : tileCount * kTileSize^2 * uvec4]
+	 backing が空ならヒープ, そうでなければそのファイルをメモリマップして置く (out-of-core).
+	 後者では evictTile() で描き終えたタイルをファイルへ書き戻してメモリから外すので,
+	 メモリに乗るのは描いている途中のタイルだけになり, 解像度はディスクの大きさで決まる.
+	 新しく作ったファイルは 0 で埋まっているので, Pixel は 0 のバイト列が初期状態であること
+	*/
+	template <class Pixel>
+	class TiledFramebuffer {
+	public:
+		static_assert(std::is_trivially_copyable<Pixel>::value, "Pixel is placed in a memory mapped file");
+		enum {
+			kTileSize = 64,
+			kTilePixels = kTileSize * kTileSize,
+		};
+
+		// if succeeded return true. 失敗したら何も持たない
+		bool allocate(int width, int height, const std::filesystem::path &backing = std::filesystem::path()) {
+			_file.close();
+			_heapPixels.clear();
+			_heapStates.clear();
+
+			_width = width;
+			_height = height;
+			_tileCountX = (width + kTileSize - 1) / kTileSize;
+			_tileCountY = (height + kTileSize - 1) / kTileSize;
+			std::size_t slots = (std::size_t)tileCount() * kTilePixels;
+
+			if (backing.empty()) {
+				_heapPixels.resize(slots);
+				_heapStates.resize(slots);
+				_pixels = _heapPixels.data();
+				_states = _heapStates.data();
+				return true;
+			}
+
+			// 1 タイル分の大きさはページの倍数 (4096 の倍数) なので, タイルの境目はページの境目になる
+			std::size_t bytes = slots * (sizeof(Pixel) + sizeof(glm::uvec4));
+			if (_file.create(backing, bytes) == false) {
+				_pixels = nullptr;
+				_states = nullptr;
+				_width = _height = _tileCountX = _tileCountY = 0;
+				return false;
+			}
+			_pixels = (Pixel *)_file.mutableData();
+			_states = (glm::uvec4 *)(_file.mutableData() + slots * sizeof(Pixel));
+			return true;
+		}
+
+		int width() const {
+			return _width;
+		}
+		int height() const {
+			return _height;
+		}
+		bool outOfCore() const {
+			return _file.isOpened();
+		}
+
+		int tileCount() const {
+			return _tileCountX * _tileCountY;
+		}
+		// 画像に収めたタイルの範囲. タイルは行ごとに左から
+		PixelWindow tileWindow(int tile) const {
+			PixelWindow w;
+			w.x0 = (tile % _tileCountX) * kTileSize;
+			w.y0 = (tile / _tileCountX) * kTileSize;
+			w.x1 = std::min(w.x0 + (int)kTileSize, _width);
+			w.y1 = std::min(w.y0 + (int)kTileSize, _height);
+			return w;
+		}
+		// out-of-core のときだけ意味がある. 中身は次に触ったときにファイルから戻る
+		void evictTile(int tile) {
+			std::size_t slots = (std::size_t)tileCount() * kTilePixels;
+			_file.evict((std::size_t)tile * kTilePixels * sizeof(Pixel), kTilePixels * sizeof(Pixel));
+			_file.evict(slots * sizeof(Pixel) + (std::size_t)tile * kTilePixels * sizeof(glm::uvec4), kTilePixels * sizeof(glm::uvec4));
+		}
+
+		Pixel *pixel(int x, int y) {
+			return _pixels + slot(x, y);
+		}
+		const Pixel *pixel(int x, int y) const {
+			return _pixels + slot(x, y);
+		}
+		glm::uvec4 *state(int x, int y) {
+			return _states + slot(x, y);
+		}
+		const glm::uvec4 *state(int x, int y) const {
+			return _states + slot(x, y);
+		}
+	private:
+		std::size_t slot(int x, int y) const {
+			RT_ASSERT(0 <= x && x < _width && 0 <= y && y < _height);
+			int tile = (y / kTileSize) * _tileCountX + x / kTileSize;
+			return (std::size_t)tile * kTilePixels + (y % kTileSize) * kTileSize + x % kTileSize;
+		}
+
+		int _width = 0;
+		int _height = 0;
+		int _tileCountX = 0;
+		int _tileCountY = 0;
+		Pixel *_pixels = nullptr;
+		glm::uvec4 *_states = nullptr;
+
+		std::vector<Pixel> _heapPixels;
+		std::vector<glm::uvec4> _heapStates;
+		MappedFile _file;
+	};
+}
\ No newline at end of file
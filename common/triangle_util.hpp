@@ -15,6 +15,16 @@ namespace rt {
 		}
 		return n_unnormalized / l;
 	}
+	// triangle_normal_cw と同じ向き. 面積がちょうど 0 のときだけ 0 を返すので, 細かいメッシュの面の法線に使う
+	template <typename Real>
+	inline glm::tvec3<Real> triangle_geometric_normal_cw(const glm::tvec3<Real> &v0, const glm::tvec3<Real> &v1, const glm::tvec3<Real> &v2) {
+		auto n_unnormalized = glm::cross(v2 - v0, v1 - v0);
+		auto l = glm::length(n_unnormalized);
+		if (l == Real(0.0)) {
+			return glm::tvec3<Real>();
+		}
+		return n_unnormalized / l;
+	}
 	template <typename Real>
 	inline Real triangle_area(const glm::tvec3<Real> &p0, const glm::tvec3<Real> &p1, const glm::tvec3<Real> &p2) {
 		auto va = p0 - p1;
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <atomic>
+
+namespace rt {
+	/*
+	 single producer, single consumer のトリプルバッファ.
+	 書く側は back() に書いて publish(), 読む側は acquire() してから front() を読む.
+	 どちらも atomic の exchange だけなので, 互いを待たない. 読む側が遅ければ古いものは飛ばされる
+	*/
+	template <class T>
+	class TripleBuffer {
+	public:
+		// producer
+		T &back() {
+			return _buffers[_back];
+		}
+		void publish() {
+			int old = _middle.exchange(_back | kDirty, std::memory_order_acq_rel);
+			_back = old & kIndexMask;
+		}
+
+		// consumer. 新しいものがあれば front() を入れ替えて true
+		bool acquire() {
+			if ((_middle.load(std::memory_order_relaxed) & kDirty) == 0) {
+				return false;
+			}
+			int old = _middle.exchange(_front, std::memory_order_acq_rel);
+			_front = old & kIndexMask;
+			return true;
+		}
+		const T &front() const {
+			return _buffers[_front];
+		}
+	private:
+		enum {
+			kIndexMask = 0x3,
+			kDirty = 0x4,
+		};
+		T _buffers[3];
+		int _back = 0;
+		std::atomic<int> _middle = 1;
+		int _front = 2;
+	};
+}
\ No newline at end of file
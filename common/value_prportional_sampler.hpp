@@ -1,29 +1,58 @@
 ﻿#pragma once
 
 #include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#include <emmintrin.h>
+#define RT_VALUE_PROPORTIONAL_SAMPLER_SSE2 1
+#endif
 
 namespace rt{
+	/*
+	 the search for the sample is
+	   small N : linear count of cumulative values <= x (4 floats at once with SSE2)
+	   large N : Eytzinger (BFS order) layout built lazily at the first sample, branchless descent
+	 the buffers keep their capacity across clear(), so a sampler that is reused per shading point
+	 doesn't allocate once it has grown. call reserve() to skip the growth too.
+	*/
 	template <class Real>
 	class ValueProportionalSampler {
 	public:
+		enum {
+			kLinearSearchMax = 64,
+		};
+
 		void clear() {
 			_sumValue = Real(0.0);
 			_values.clear();
 			_cumulativeAreas.clear();
+			_eytzingerBuilt = false;
+		}
+		void reserve(int n) {
+			_values.reserve(n);
+			_cumulativeAreas.reserve(n);
 		}
 		void add(Real value) {
 			_sumValue += value;
 			_values.push_back(value);
 			_cumulativeAreas.push_back(_sumValue);
+			_eytzingerBuilt = false;
 		}
 
 		int sample(PeseudoRandom *random) const {
 			Real area_at = (Real)random->uniform(0.0, _sumValue);
-			auto it = std::upper_bound(_cumulativeAreas.begin(), _cumulativeAreas.end(), area_at);
-			std::size_t index = std::distance(_cumulativeAreas.begin(), it);
-			index = std::min(index, _cumulativeAreas.size() - 1);
-			return (int)index;
+			return search(area_at);
+		}
+
+		// the first index whose cumulative value is larger than area_at (same as std::upper_bound), clamped to size() - 1
+		int search(Real area_at) const {
+			int n = (int)_cumulativeAreas.size();
+			int index = n <= kLinearSearchMax ? search_linear(area_at) : search_eytzinger(area_at);
+			return std::min(index, n - 1);
 		}
+
 		Real sumValue() const {
 			return _sumValue;
 		}
@@ -34,8 +63,91 @@ namespace rt{
 			return (int)_values.size();
 		}
 	private:
+		int search_linear(Real area_at) const {
+			const Real *c = _cumulativeAreas.data();
+			int n = (int)_cumulativeAreas.size();
+			int i = 0;
+			int count = 0;
+#if defined(RT_VALUE_PROPORTIONAL_SAMPLER_SSE2)
+			if (std::is_same<Real, float>::value) {
+				__m128 x = _mm_set1_ps((float)area_at);
+				for (; i + 4 <= n; i += 4) {
+					__m128 v = _mm_loadu_ps((const float *)c + i);
+					int mask = _mm_movemask_ps(_mm_cmple_ps(v, x));
+					count += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+				}
+			}
+#endif
+			for (; i < n; ++i) {
+				count += c[i] <= area_at ? 1 : 0;
+			}
+			return count;
+		}
+
+		int search_eytzinger(Real area_at) const {
+			if (_eytzingerBuilt == false) {
+				build_eytzinger();
+			}
+			const Real *e = _eytzinger.data();
+			int n = (int)_cumulativeAreas.size();
+
+			// go right while e[k] <= x. the answer is the last node where we went left.
+			int k = 1;
+			while (k <= n) {
+#if defined(RT_VALUE_PROPORTIONAL_SAMPLER_SSE2)
+				// the 16 grandchildren of k live in one or two cache lines
+				_mm_prefetch((const char *)(e + std::min(k * 16, n)), _MM_HINT_T0);
+#endif
+				k = 2 * k + (e[k] <= area_at ? 1 : 0);
+			}
+			// drop the trailing 1 bits (right turns) and the last left turn
+			k >>= count_trailing_ones(k) + 1;
+			return k == 0 ? n : _eytzingerIndex[k];
+		}
+
+		static int count_trailing_ones(int k) {
+			int n = 0;
+			while (k & 1) {
+				k >>= 1;
+				n++;
+			}
+			return n;
+		}
+
+		void build_eytzinger() const {
+			int n = (int)_cumulativeAreas.size();
+			_eytzinger.resize(n + 1);
+			_eytzingerIndex.resize(n + 1);
+
+			// in-order traversal of the implicit tree visits the sorted array in order
+			int i = 0;
+			int k = 1;
+			for (;;) {
+				while (k <= n) {
+					k = 2 * k;
+				}
+				// climb up while we came from the right
+				while (k & 1) {
+					k >>= 1;
+				}
+				k >>= 1;
+				if (k == 0) {
+					break;
+				}
+				_eytzinger[k] = _cumulativeAreas[i];
+				_eytzingerIndex[k] = i;
+				i++;
+				k = 2 * k + 1;
+			}
+			_eytzingerBuilt = true;
+		}
+
 		Real _sumValue = Real(0.0);
 		std::vector<Real> _values;
 		std::vector<Real> _cumulativeAreas;
+
+		mutable bool _eytzingerBuilt = false;
+		mutable std::vector<Real> _eytzinger;
+		mutable std::vector<int> _eytzingerIndex;
 	};
 }
\ No newline at end of file
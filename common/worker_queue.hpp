@@ -0,0 +1,86 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rt {
+	/*
+	 画像の保存など, 待ちたくない仕事を別スレッドで順に片付ける.
+	 capacity を超えて積もうとすると push() は空くまで待つ (メモリを際限なく使わないため).
+	 デストラクタは積まれた仕事を全部終えてから返る
+	*/
+	class WorkerQueue {
+	public:
+		WorkerQueue(int threads = 1, int capacity = 8) :_capacity(capacity) {
+			for (int i = 0; i < threads; ++i) {
+				_threads.emplace_back([this]() {
+					run();
+				});
+			}
+		}
+		~WorkerQueue() {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_quit = true;
+			}
+			_pushed.notify_all();
+			for (auto &thread : _threads) {
+				thread.join();
+			}
+		}
+		WorkerQueue(const WorkerQueue &) = delete;
+		void operator=(const WorkerQueue &) = delete;
+
+		void push(std::function<void()> job) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_popped.wait(lock, [&]() { return _jobs.size() < _capacity; });
+			_jobs.emplace_back(std::move(job));
+			lock.unlock();
+			_pushed.notify_one();
+		}
+
+		// 積まれた仕事が全部終わるまで待つ
+		void wait() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_popped.wait(lock, [&]() { return _jobs.empty() && _running == 0; });
+		}
+	private:
+		void run() {
+			for (;;) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_pushed.wait(lock, [&]() { return _quit || _jobs.empty() == false; });
+					if (_jobs.empty()) {
+						return;
+					}
+					job = std::move(_jobs.front());
+					_jobs.pop_front();
+					_running++;
+				}
+				_popped.notify_all();
+
+				job();
+
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_running--;
+				}
+				_popped.notify_all();
+			}
+		}
+
+		std::size_t _capacity = 0;
+		std::vector<std::thread> _threads;
+		std::mutex _mutex;
+		std::condition_variable _pushed;
+		std::condition_variable _popped;
+		std::deque<std::function<void()>> _jobs;
+		int _running = 0;
+		bool _quit = false;
+	};
+}
\ No newline at end of file